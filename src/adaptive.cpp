@@ -0,0 +1,191 @@
+/*
+    Adjusts the quality, chroma subsampling and scale of the images of the
+    session, so that the frames stay under the limits given by the client.
+
+    Each frame is measured against the limits, giving its load (1 = at the
+    limit). When the smoothed load goes over 1, the settings are lowered by
+    one step: first the quality, then the subsampling and finally the scale.
+    When there is room, they are raised again in the opposite order, but only
+    if the load after the step is predicted to stay under the limits, so the
+    settings don't oscillate between two steps.
+*/
+
+#include <algorithm>
+
+#include "adaptive.hpp"
+
+// Only Linux/X11 can scale images and change the chroma subsampling,
+// other platforms only adjust the quality
+#ifdef __linux__
+    const bool CAN_SCALE = true;
+#else
+    const bool CAN_SCALE = false;
+#endif
+
+const unsigned int MIN_QUALITY = 20;
+const unsigned int QUALITY_STEP = 5;
+const float SCALE_STEP = 0.75f;
+const float DEFAULT_MIN_SCALE = 0.25f;
+
+// Predicted growth of the load when a setting is raised by one step.
+// The load of scaling grows with the number of pixels.
+const float QUALITY_STEP_COST = 1.1f;
+const float SUBSAMPLING_STEP_COST = 1.25f;
+
+// Settings are only raised if the load is predicted to stay below this
+const float MAX_RAISED_LOAD = 0.85f;
+
+// Weight of the newest frame in the smoothed load
+const float LOAD_SMOOTHING = 0.3f;
+
+bool isSameTarget(const AdaptiveTarget& a, const AdaptiveTarget& b) {
+    return a.max_encode_ms() == b.max_encode_ms()
+           && a.max_bytes() == b.max_bytes()
+           && a.target_fps() == b.target_fps()
+           && a.min_scale() == b.min_scale();
+}
+
+unsigned int getMinQuality(const AdaptiveState* state) {
+    return std::min(MIN_QUALITY, state->maxQuality);
+}
+
+float getMinScale(const AdaptiveState* state) {
+    if (state->target.min_scale() <= 0)
+        return DEFAULT_MIN_SCALE;
+
+    return std::min(state->target.min_scale(), 1.0f);
+}
+
+void setAdaptiveTarget(const AdaptiveTarget& target,
+                       const ImageOptions& options, AdaptiveState* state) {
+    if (state->hasTarget && isSameTarget(target, state->target)
+        && options.quality == state->maxQuality
+        && options.subsampling == state->maxSubsampling) {
+        return;
+    }
+
+    state->target = target;
+    state->maxQuality = options.quality;
+    state->maxSubsampling = CAN_SCALE ? options.subsampling
+                                      : SUBSAMPLING_420;
+    state->hasTarget = true;
+
+    // Start from the best settings
+    state->quality = state->maxQuality;
+    state->subsampling = state->maxSubsampling;
+    state->scale = 1;
+    state->smoothedLoad = -1;
+}
+
+void applyAdaptiveSettings(const AdaptiveState* state,
+                           ImageOptions* options) {
+    if (!state->hasTarget)
+        return;
+
+    options->quality = state->quality;
+    options->subsampling = state->subsampling;
+    options->scale = state->scale;
+}
+
+bool lowerSettings(AdaptiveState* state) {
+    /*
+        Lowers the settings by one step, returns false if they are
+        already the lowest allowed
+     */
+
+    if (state->quality > getMinQuality(state)) {
+        state->quality = std::max(state->quality - QUALITY_STEP,
+                                  getMinQuality(state));
+    } else if (CAN_SCALE && state->subsampling > SUBSAMPLING_420) {
+        state->subsampling = (ChromaSubsampling)(state->subsampling - 1);
+    } else if (CAN_SCALE && state->scale > getMinScale(state)) {
+        state->scale = std::max(state->scale * SCALE_STEP,
+                                getMinScale(state));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool raiseSettings(AdaptiveState* state, float load) {
+    /*
+        Raises the setting that was lowered last by one step, if the load
+        is predicted to stay low enough. Returns false if nothing changed.
+     */
+
+    if (state->scale < 1) {
+        float scale = std::min(state->scale / SCALE_STEP, 1.0f);
+        float growth = (scale / state->scale) * (scale / state->scale);
+        if (load * growth >= MAX_RAISED_LOAD)
+            return false;
+
+        state->scale = scale;
+    } else if (state->subsampling < state->maxSubsampling) {
+        if (load * SUBSAMPLING_STEP_COST >= MAX_RAISED_LOAD)
+            return false;
+
+        state->subsampling = (ChromaSubsampling)(state->subsampling + 1);
+    } else if (state->quality < state->maxQuality) {
+        if (load * QUALITY_STEP_COST >= MAX_RAISED_LOAD)
+            return false;
+
+        state->quality = std::min(state->quality + QUALITY_STEP,
+                                  state->maxQuality);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void updateAdaptiveSettings(const Frame& frame, uint64_t frameTime,
+                            AdaptiveState* state) {
+    if (!state->hasTarget || frame.timestamp == state->measuredTimestamp)
+        return;
+
+    const ImageOptions& options = frame.options;
+    if (options.quality != state->quality
+        || options.subsampling != state->subsampling
+        || options.scale != state->scale) {
+        return;
+    }
+    state->measuredTimestamp = frame.timestamp;
+
+    // Frames of the capture thread are returned without waiting,
+    // but they took at least the encoding time to make
+    frameTime = std::max(frameTime, frame.encodeTime);
+
+    float load = 0;
+    if (state->target.max_encode_ms() > 0) {
+        load = std::max(load, frame.encodeTime
+                              / (state->target.max_encode_ms() * 1000));
+    }
+    if (state->target.max_bytes() > 0) {
+        load = std::max(load, (float)frame.image.size()
+                              / state->target.max_bytes());
+    }
+    if (state->target.target_fps() > 0) {
+        load = std::max(load, frameTime * state->target.target_fps()
+                              / 1000000);
+    }
+
+    if (state->smoothedLoad < 0)
+        state->smoothedLoad = load;
+    else
+        state->smoothedLoad += LOAD_SMOOTHING * (load - state->smoothedLoad);
+
+    bool changed;
+    if (state->smoothedLoad > 1)
+        changed = lowerSettings(state);
+    else
+        changed = raiseSettings(state, state->smoothedLoad);
+
+    // Frames with the new settings are measured from scratch
+    if (changed)
+        state->smoothedLoad = -1;
+}
+
+void getAdaptiveSettings(const Frame& frame, AdaptiveSettings* settings) {
+    settings->set_quality(frame.options.quality);
+    settings->set_subsampling(frame.options.subsampling);
+    settings->set_scale(frame.options.scale);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+
+#include "messages.pb.h"
+#include "image.hpp"
+
+/*
+    The adaptive settings of the captures of one display in a session,
+    and the limits they are adjusted to stay under
+ */
+struct AdaptiveState {
+    // Limits and the best settings
+    AdaptiveTarget target;
+    unsigned int maxQuality = 0;
+    ChromaSubsampling maxSubsampling = SUBSAMPLING_420;
+    bool hasTarget = false;
+
+    // Current settings
+    unsigned int quality = 0;
+    ChromaSubsampling subsampling = SUBSAMPLING_420;
+    float scale = 1;
+
+    // Smoothed load of the frames since the settings changed,
+    // negative until a frame has been measured
+    float smoothedLoad = -1;
+
+    // Timestamp of the last measured frame, so a frame is only measured once
+    uint64_t measuredTimestamp = 0;
+};
+
+/*
+    Sets the limits of the adaptive settings in state. The quality and
+    subsampling in options are the best settings that will be used.
+    The settings start over from the best ones when any of these change.
+ */
+void setAdaptiveTarget(const AdaptiveTarget& target,
+                       const ImageOptions& options, AdaptiveState* state);
+
+/*
+    Replaces the quality, subsampling and scale in options with the current
+    adaptive settings in state.
+ */
+void applyAdaptiveSettings(const AdaptiveState* state,
+                           ImageOptions* options);
+
+/*
+    Measures a frame that was returned to the client and adjusts the
+    settings in state for the next frames by at most one step. frameTime is the time
+    it took to get the frame in microseconds, including the capture.
+    Frames that were not encoded with the current settings are ignored.
+ */
+void updateAdaptiveSettings(const Frame& frame, uint64_t frameTime,
+                            AdaptiveState* state);
+
+/*
+    Writes the settings the frame was encoded with to settings.
+ */
+void getAdaptiveSettings(const Frame& frame, AdaptiveSettings* settings);
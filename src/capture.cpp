@@ -0,0 +1,357 @@
+/*
+    Background capture threads that deliver the latest encoded frame
+    through a triple buffer. Each display has its own thread and buffer.
+
+    The capture thread always writes to the back slot and the request loop
+    always reads from the front slot. A finished frame is published by
+    swapping the back slot with the middle slot, and picked up by swapping
+    the middle slot with the front slot. Neither side ever waits for the other.
+*/
+
+#include <iostream>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <map>
+
+#include "capture.hpp"
+#include "history.hpp"
+#include "platform.hpp"
+#include "source.hpp"
+
+// Bits of middleSlot that hold the index of the middle slot
+const int SLOT_INDEX_MASK = 3;
+
+// Set in middleSlot when the middle slot holds a frame the reader hasn't seen
+const int SLOT_FRESH = 4;
+
+// How long the capture thread waits for the window to change before it
+// checks whether it should capture something else, in milliseconds
+const unsigned int DAMAGE_WAIT_TIMEOUT = 100;
+
+// Frames of one display and its capture thread
+struct CaptureContext {
+    std::string display;
+
+    Frame slots[3];
+    int backSlot = 0;
+    int frontSlot = 1;
+    std::atomic<int> middleSlot;
+
+    // Held while a frame of the display is captured, since the capture
+    // thread and the request loop can both capture
+    std::mutex captureMutex;
+
+    // The window and options the capture thread should capture with
+    std::mutex targetMutex;
+    std::condition_variable targetChanged;
+    std::string targetName;
+    ImageOptions targetOptions;
+    bool hasTarget = false;
+
+    std::thread captureThread;
+    bool stopCapture = false;
+
+    CaptureContext() : middleSlot(2) {}
+};
+
+// Capture contexts by display name, only used by the request loop
+std::map<std::string, CaptureContext*> captureContexts;
+
+// Whether each display gets a capture thread, and its frame rate limit
+bool captureThreads = false;
+unsigned int captureFps = 0;
+
+// Size that the frame buffers are allocated with, and whether they are
+// locked in memory (see reserveFrameBuffers)
+size_t frameBufferBytes = 0;
+bool lockFrameBuffers = false;
+
+// Whether it has been printed that a frame buffer grew past the size
+// it was allocated with
+std::atomic<bool> reportedGrowth{false};
+
+uint64_t getTimestamp() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()
+    ).count();
+}
+
+void captureFrame(CaptureContext* context, Frame* frame,
+                  std::string* processName, const ImageOptions& options) {
+    /*
+        Takes a screenshot of the display of the context into the given
+        frame, replacing its old contents. The display has to be selected
+        by the current thread. Other displays can be captured at the
+        same time.
+        Throws invalid_argument if the window could not be captured.
+     */
+
+    std::lock_guard<std::mutex> lock(context->captureMutex);
+
+    frame->image.setSize(0);
+    frame->tensor.setSize(0);
+    frame->timestamp = getTimestamp();
+    frame->encodeTime = 0;
+    frame->tiles.Clear();
+    frame->damageGeneration = 0;
+    frame->bandOffsets.clear();
+    frame->bandHeight = 0;
+    frame->roiRegions.clear();
+    frame->windowRegions.clear();
+    frame->processName = *processName;
+    frame->options = options;
+
+    getCaptureSource()->capture(processName, frame, options);
+
+    // Locked buffers can't grow, but the others fault in new pages when
+    // they do, which defeats allocating them at startup
+    if (frameBufferBytes != 0 && frame->image.capacity() > frameBufferBytes
+        && !reportedGrowth.exchange(true)) {
+        std::cout << "Frame buffers: an image needed "
+                  << frame->image.capacity() << " bytes, more than the "
+                  << frameBufferBytes << " bytes they were allocated with"
+                  << std::endl;
+    }
+
+    // The history only has one timeline, which is the default display.
+    // Still holding the lock of the display, so its frames are added in
+    // timestamp order, and addToHistory takes the lock of the history.
+    // Images with only the changed tiles can't be used on their own, and
+    // multi-window captures have no image.
+    if (!options.tilesOnly && options.windows.empty()
+        && context->display.empty()) {
+        addToHistory(frame->image, frame->timestamp);
+    }
+}
+
+bool hasImage(const Frame& frame) {
+    // Multi-window captures only have the images of the windows
+    return !frame.image.empty() || !frame.windowRegions.empty();
+}
+
+bool isUnchanged(const Frame& frame, const std::string& processName,
+                 const ImageOptions& options) {
+    /*
+        Returns true if the frame was captured from the given window with
+        the given options, and the window hasn't been drawn to since.
+     */
+
+    return frame.damageGeneration != 0 && hasImage(frame)
+           && frame.processName == processName && frame.options == options
+           && frame.damageGeneration == getCaptureSource()->getGeneration();
+}
+
+void captureLoop(CaptureContext* context, unsigned int maxFps) {
+    // The display was opened by the request loop before the thread started
+    CaptureSource* source = getCaptureSource();
+    source->selectDisplay(context->display);
+
+    std::chrono::microseconds interval(maxFps > 0 ? 1000000 / maxFps : 0);
+    auto nextCapture = std::chrono::steady_clock::now();
+
+    // What the newest published frame was captured from
+    std::string capturedName;
+    ImageOptions capturedOptions;
+    uint64_t capturedGeneration = 0;
+
+    while (true) {
+        std::string name;
+        ImageOptions options;
+
+        // Wait until the first request has told us what to capture
+        {
+            std::unique_lock<std::mutex> lock(context->targetMutex);
+            context->targetChanged.wait(lock, [&]{
+                return context->hasTarget || context->stopCapture;
+            });
+
+            if (context->stopCapture)
+                return;
+
+            name = context->targetName;
+            options = context->targetOptions;
+        }
+
+        // Nothing was drawn since the last capture, so wait for the window
+        // to change instead of capturing and encoding the same image again
+        if (capturedGeneration != 0 && capturedName == name
+            && capturedOptions == options
+            && capturedGeneration == source->getGeneration()) {
+            source->waitForChange(capturedGeneration, DAMAGE_WAIT_TIMEOUT);
+            continue;
+        }
+
+        try {
+            Frame* frame = &context->slots[context->backSlot];
+            captureFrame(context, frame, &name, options);
+
+            capturedName = name;
+            capturedOptions = options;
+            capturedGeneration = frame->damageGeneration;
+
+            // Publish the frame and take the old middle slot as the new back slot
+            context->backSlot =
+                context->middleSlot.exchange(context->backSlot | SLOT_FRESH)
+                & SLOT_INDEX_MASK;
+        } catch (const std::invalid_argument& e) {
+            // The window may not exist yet, try again a bit later
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+
+        if (maxFps > 0) {
+            nextCapture += interval;
+            auto now = std::chrono::steady_clock::now();
+
+            // Don't try to catch up if we have fallen behind
+            if (nextCapture < now)
+                nextCapture = now;
+
+            std::this_thread::sleep_until(nextCapture);
+        }
+    }
+}
+
+void startCaptureThread(unsigned int maxFps) {
+    captureThreads = true;
+    captureFps = maxFps;
+}
+
+void stopCaptureThread() {
+    for (auto& named : captureContexts) {
+        CaptureContext* context = named.second;
+        if (!context->captureThread.joinable())
+            continue;
+
+        {
+            std::lock_guard<std::mutex> lock(context->targetMutex);
+            context->stopCapture = true;
+        }
+        context->targetChanged.notify_all();
+
+        context->captureThread.join();
+    }
+    captureThreads = false;
+}
+
+void reserveFrames(CaptureContext* context) {
+    /*
+        Allocates and locks the image buffers of the frames of the context
+        (see reserveFrameBuffers)
+     */
+
+    // Resizing the buffers writes to every page of them
+    for (Frame& frame : context->slots)
+        frame.image.reserve(frameBufferBytes);
+
+    if (!lockFrameBuffers)
+        return;
+
+    // A locked buffer must not grow, since the new memory would not be
+    // locked and the old memory would stay locked until it is freed
+    for (Frame& frame : context->slots) {
+        lockMemory(frame.image.header(ImageBuffer::HEADROOM),
+                   ImageBuffer::HEADROOM + frameBufferBytes);
+        frame.image.fixCapacity();
+    }
+}
+
+CaptureContext* getCaptureContext(const std::string& display) {
+    /*
+        Returns the capture context of the given display, and creates it
+        the first time. The capture thread of the display is started (if
+        enabled) the first time the context is returned after
+        startCaptureThread, because the context of the default display can
+        be created before that.
+     */
+
+    CaptureContext* context;
+    auto found = captureContexts.find(display);
+    if (found != captureContexts.end()) {
+        context = found->second;
+    } else {
+        context = new CaptureContext();
+        context->display = display;
+        captureContexts[display] = context;
+
+        if (frameBufferBytes != 0) {
+            try {
+                reserveFrames(context);
+            } catch (const std::invalid_argument& e) {
+                std::cout << "Could not lock the frames of display "
+                          << display << ": " << e.what() << std::endl;
+            }
+        }
+    }
+
+    if (captureThreads && !context->captureThread.joinable())
+        context->captureThread = std::thread(captureLoop, context, captureFps);
+
+    return context;
+}
+
+void reserveFrameBuffers(size_t bytes, bool lock) {
+    frameBufferBytes = bytes;
+    lockFrameBuffers = lock;
+
+    if (bytes == 0 || captureContexts.count("") != 0)
+        return;
+
+    CaptureContext* context = new CaptureContext();
+    captureContexts[""] = context;
+
+    try {
+        reserveFrames(context);
+    } catch (const std::invalid_argument&) {
+        lockFrameBuffers = false;
+        throw;
+    }
+}
+
+Frame* getFrame(const std::string& display, std::string* processName,
+                const ImageOptions& options, uint64_t minGeneration) {
+    CaptureContext* context = getCaptureContext(display);
+    Frame* frame = &context->slots[context->frontSlot];
+
+    if (!context->captureThread.joinable()) {
+        // Images with only the changed tiles are relative to the previous
+        // capture, so they have to be captured again to report no changes
+        if (options.tilesOnly || !isUnchanged(*frame, *processName, options))
+            captureFrame(context, frame, processName, options);
+        return frame;
+    }
+
+    // Tell the capture thread what to capture
+    {
+        std::lock_guard<std::mutex> lock(context->targetMutex);
+        if (!context->hasTarget || context->targetName != *processName
+            || context->targetOptions != options) {
+            context->targetName = *processName;
+            context->targetOptions = options;
+            context->hasTarget = true;
+            context->targetChanged.notify_all();
+        }
+    }
+
+    // Pick up the newest published frame, if there is one
+    if (context->middleSlot.load() & SLOT_FRESH) {
+        context->frontSlot = context->middleSlot.exchange(context->frontSlot)
+                             & SLOT_INDEX_MASK;
+    }
+
+    frame = &context->slots[context->frontSlot];
+
+    // The capture thread hasn't caught up with this target yet
+    // or the frame is older than the caller wants
+    if (!hasImage(*frame) || frame->processName != *processName
+        || frame->options != options
+        || frame->damageGeneration < minGeneration) {
+        captureFrame(context, frame, processName, options);
+    }
+
+    return frame;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "image.hpp"
+
+/*
+    Returns the current time of a monotonic clock in microseconds.
+    All frame timestamps use this clock.
+ */
+uint64_t getTimestamp();
+
+/*
+    Makes each display continuously capture and encode screenshots in a
+    background thread, so that getFrame can return a finished frame
+    without waiting for the capture. The thread of a display is started
+    by the first call to getFrame for it.
+
+    The thread captures the window and options given in the latest call to
+    getFrame for its display. maxFps limits how many frames are captured per
+    second (0 = no limit). If changes to the window are tracked (see
+    getDamageGeneration), the thread waits for the window to change
+    instead of capturing the same image again.
+ */
+void startCaptureThread(unsigned int maxFps);
+
+/*
+    Stops the background capture threads, if they are running.
+ */
+void stopCaptureThread();
+
+/*
+    Makes the image buffers of the frames of every display have room for
+    images of the given size from the start, so that the encoder and the
+    socket (which sends the images straight from these buffers) never have
+    to grow them and fault in new pages while capturing. The buffers are
+    written to when they are allocated. A buffer that still has to grow
+    for a larger image is printed the first time it happens.
+
+    If lock is true, the buffers are also locked in memory (see lockMemory)
+    and kept at their size: an image that doesn't fit fails to encode with
+    an error instead of moving the buffer to memory that isn't locked.
+    The size has to be enough for the worst case of the encoder, such as
+    tjBufSize for jpg images.
+
+    Only the buffers of the encoded images are covered. Tensors, regions
+    of interest, additional outputs, window images and the buffer that
+    requests are received into are still allocated when they are needed.
+
+    The frames of the default display are allocated right away, and those
+    of other displays when they are first captured. Should be called
+    before startCaptureThread.
+
+    Throws invalid_argument if the frames of the default display could not
+    be locked. The buffers are still allocated, and the frames that were
+    locked before the failure stay locked, but no more frames are locked.
+    Failures to lock the frames of other displays are printed.
+ */
+void reserveFrameBuffers(size_t bytes, bool lock);
+
+/*
+    Returns a screenshot of the given window on the given display
+    (see getScreenshot). The display has to be selected by the calling
+    thread (see selectDisplay).
+
+    If the background capture thread is running and has already captured
+    the given window with the given options, returns the newest frame
+    captured by it without blocking. Otherwise the screenshot is taken
+    synchronously.
+
+    Frames that were captured before the damage generation of the window
+    reached minGeneration are not returned. Without the capture thread,
+    the previous frame is returned again if the window hasn't changed
+    since it was captured with the same options.
+
+    The returned frame is owned by this module and stays valid until the
+    next call to getFrame for the same display. Its image buffer is reused for later frames,
+    so capturing does not allocate memory once the buffers have grown
+    to fit the frames.
+
+    Throws invalid_argument if the window could not be captured.
+ */
+Frame* getFrame(const std::string& display, std::string* processName,
+                const ImageOptions& options, uint64_t minGeneration = 0);
@@ -0,0 +1,430 @@
+/*
+    Converts captured BGRX images to uncompressed pixel formats.
+
+    Every conversion has a plain C++ implementation that is also used for the
+    pixels left over at the end of each row. On x86 CPUs the bulk of each row
+    is handled by SSE2 kernels, or by SSSE3/AVX2 kernels when the CPU
+    supports them. All kernels use the same integer arithmetic, so they
+    produce exactly the same output.
+*/
+
+#include <cstring>
+#include <stdexcept>
+
+#include "convert.hpp"
+#include "cpu.hpp"
+
+// Weights of the luma conversions (B, G, R), sums to 256
+const int GRAY_WEIGHTS[3] = { 29, 150, 77 };
+const int Y_WEIGHTS[3] = { 25, 129, 66 };
+
+// Offset added to the luma values
+const int GRAY_OFFSET = 0;
+const int Y_OFFSET = 16;
+
+size_t getRawImageSize(ImageFormat format, unsigned int width,
+                       unsigned int height) {
+    size_t pixels = (size_t)width * height;
+    size_t chroma = (size_t)((width + 1) / 2) * ((height + 1) / 2);
+
+    switch (format) {
+        case FORMAT_BGRX:
+            return pixels * 4;
+        case FORMAT_RGB24:
+            return pixels * 3;
+        case FORMAT_GRAY8:
+            return pixels;
+        case FORMAT_I420:
+            return pixels + 2 * chroma;
+        default:
+            return 0;
+    }
+}
+
+/*
+    Luma (gray / Y)
+*/
+
+// Converts pixels [x, width) of a row
+inline void lumaRowScalar(const unsigned char* src, unsigned char* dst,
+                          unsigned int x, unsigned int width,
+                          const int* weights, int offset) {
+    for (; x < width; x++) {
+        const unsigned char* p = src + x * 4;
+        int sum = weights[0] * p[0] + weights[1] * p[1] + weights[2] * p[2];
+        dst[x] = ((sum + 128) >> 8) + offset;
+    }
+}
+
+#ifdef __SSE2__
+// Returns the luma values of 4 pixels as 32-bit integers
+inline __m128i lumaSSE2(__m128i pixels, __m128i weights) {
+    __m128i zero = _mm_setzero_si128();
+
+    // Sums of B * wb + G * wg and R * wr for each pixel
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), weights);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), weights);
+
+    // Add the two partial sums of each pixel together
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+                                 _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+                                _MM_SHUFFLE(3, 1, 3, 1));
+    __m128i sum = _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+
+    return _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+}
+
+// Converts the row from x onwards 16 pixels at a time,
+// returns the index of the first pixel left unconverted
+unsigned int lumaRowSSE2(const unsigned char* src, unsigned char* dst,
+                         unsigned int x, unsigned int width,
+                         const int* weights, int offset) {
+    __m128i w = _mm_setr_epi16(weights[0], weights[1], weights[2], 0,
+                               weights[0], weights[1], weights[2], 0);
+    __m128i off = _mm_set1_epi16(offset);
+
+    for (; x + 16 <= width; x += 16) {
+        const __m128i* p = (const __m128i*)(src + x * 4);
+        __m128i y0 = lumaSSE2(_mm_loadu_si128(p), w);
+        __m128i y1 = lumaSSE2(_mm_loadu_si128(p + 1), w);
+        __m128i y2 = lumaSSE2(_mm_loadu_si128(p + 2), w);
+        __m128i y3 = lumaSSE2(_mm_loadu_si128(p + 3), w);
+
+        __m128i lo = _mm_add_epi16(_mm_packs_epi32(y0, y1), off);
+        __m128i hi = _mm_add_epi16(_mm_packs_epi32(y2, y3), off);
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(lo, hi));
+    }
+    return x;
+}
+#endif
+
+#ifdef X86_DISPATCH
+__attribute__((target("avx2")))
+inline __m256i lumaAVX2(__m256i pixels, __m256i weights) {
+    __m256i zero = _mm256_setzero_si256();
+
+    // Works like lumaSSE2 separately in both 128-bit lanes
+    __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), weights);
+    __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), weights);
+
+    __m256 even = _mm256_shuffle_ps(_mm256_castsi256_ps(lo),
+                                    _mm256_castsi256_ps(hi),
+                                    _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 odd = _mm256_shuffle_ps(_mm256_castsi256_ps(lo),
+                                   _mm256_castsi256_ps(hi),
+                                   _MM_SHUFFLE(3, 1, 3, 1));
+    __m256i sum = _mm256_add_epi32(_mm256_castps_si256(even),
+                                   _mm256_castps_si256(odd));
+
+    return _mm256_srli_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(128)), 8);
+}
+
+// Converts the row from x onwards 32 pixels at a time,
+// returns the index of the first pixel left unconverted
+__attribute__((target("avx2")))
+unsigned int lumaRowAVX2(const unsigned char* src, unsigned char* dst,
+                         unsigned int x, unsigned int width,
+                         const int* weights, int offset) {
+    __m256i w = _mm256_setr_epi16(weights[0], weights[1], weights[2], 0,
+                                  weights[0], weights[1], weights[2], 0,
+                                  weights[0], weights[1], weights[2], 0,
+                                  weights[0], weights[1], weights[2], 0);
+    __m256i off = _mm256_set1_epi16(offset);
+
+    // Packing works within 128-bit lanes, this puts the pixels back in order
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    for (; x + 32 <= width; x += 32) {
+        const __m256i* p = (const __m256i*)(src + x * 4);
+        __m256i y0 = lumaAVX2(_mm256_loadu_si256(p), w);
+        __m256i y1 = lumaAVX2(_mm256_loadu_si256(p + 1), w);
+        __m256i y2 = lumaAVX2(_mm256_loadu_si256(p + 2), w);
+        __m256i y3 = lumaAVX2(_mm256_loadu_si256(p + 3), w);
+
+        __m256i lo = _mm256_add_epi16(_mm256_packs_epi32(y0, y1), off);
+        __m256i hi = _mm256_add_epi16(_mm256_packs_epi32(y2, y3), off);
+        __m256i packed = _mm256_packus_epi16(lo, hi);
+
+        _mm256_storeu_si256((__m256i*)(dst + x),
+                            _mm256_permutevar8x32_epi32(packed, order));
+    }
+    return x;
+}
+#endif
+
+void lumaPlane(const RawImage& src, unsigned char* dst, const int* weights,
+               int offset) {
+    for (unsigned int y = 0; y < src.height; y++) {
+        const unsigned char* row =
+            (const unsigned char*)src.data + (size_t)y * src.stride;
+        unsigned char* out = dst + (size_t)y * src.width;
+        unsigned int x = 0;
+
+        #ifdef X86_DISPATCH
+            if (cpuHasAVX2)
+                x = lumaRowAVX2(row, out, x, src.width, weights, offset);
+        #endif
+        #ifdef __SSE2__
+            x = lumaRowSSE2(row, out, x, src.width, weights, offset);
+        #endif
+
+        lumaRowScalar(row, out, x, src.width, weights, offset);
+    }
+}
+
+/*
+    RGB24
+*/
+
+inline void rgbRowScalar(const unsigned char* src, unsigned char* dst,
+                         unsigned int x, unsigned int width) {
+    for (; x < width; x++) {
+        dst[x * 3] = src[x * 4 + 2];
+        dst[x * 3 + 1] = src[x * 4 + 1];
+        dst[x * 3 + 2] = src[x * 4];
+    }
+}
+
+#ifdef X86_DISPATCH
+// Converts the row from x onwards 16 pixels at a time,
+// returns the index of the first pixel left unconverted
+__attribute__((target("ssse3")))
+unsigned int rgbRowSSSE3(const unsigned char* src, unsigned char* dst,
+                         unsigned int x, unsigned int width) {
+    // Picks R, G and B of 4 pixels into the first 12 bytes
+    __m128i mask = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                 -1, -1, -1, -1);
+
+    for (; x + 16 <= width; x += 16) {
+        const __m128i* p = (const __m128i*)(src + x * 4);
+        __m128i a = _mm_shuffle_epi8(_mm_loadu_si128(p), mask);
+        __m128i b = _mm_shuffle_epi8(_mm_loadu_si128(p + 1), mask);
+        __m128i c = _mm_shuffle_epi8(_mm_loadu_si128(p + 2), mask);
+        __m128i d = _mm_shuffle_epi8(_mm_loadu_si128(p + 3), mask);
+
+        // Join the four 12 byte blocks into three 16 byte blocks
+        __m128i* out = (__m128i*)(dst + x * 3);
+        _mm_storeu_si128(out, _mm_or_si128(a, _mm_slli_si128(b, 12)));
+        _mm_storeu_si128(out + 1, _mm_or_si128(_mm_srli_si128(b, 4),
+                                               _mm_slli_si128(c, 8)));
+        _mm_storeu_si128(out + 2, _mm_or_si128(_mm_srli_si128(c, 8),
+                                               _mm_slli_si128(d, 4)));
+    }
+    return x;
+}
+
+// Converts the row from x onwards 8 pixels at a time,
+// returns the index of the first pixel left unconverted
+__attribute__((target("avx2")))
+unsigned int rgbRowAVX2(const unsigned char* src, unsigned char* dst,
+                        unsigned int x, unsigned int width) {
+    __m256i mask = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                    -1, -1, -1, -1,
+                                    2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                    -1, -1, -1, -1);
+
+    // Moves the 12 bytes of the upper lane right after the ones of the lower
+    __m256i order = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+    // Each iteration writes 32 bytes of which only the first 24 are used,
+    // so stop early enough to not write past the end of the row
+    for (; x + 11 <= width; x += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(src + x * 4));
+        v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, mask), order);
+        _mm256_storeu_si256((__m256i*)(dst + x * 3), v);
+    }
+    return x;
+}
+#endif
+
+/*
+    I420 chroma
+*/
+
+// Weights of the chroma conversions (B, G, R)
+const int U_WEIGHTS[3] = { 112, -74, -38 };
+const int V_WEIGHTS[3] = { -18, -94, 112 };
+
+// Converts chroma samples [x, chromaWidth) of a pair of rows.
+// The last column of an odd width image is paired with itself.
+inline void chromaRowScalar(const unsigned char* row0,
+                            const unsigned char* row1,
+                            unsigned char* u, unsigned char* v,
+                            unsigned int x, unsigned int width) {
+    unsigned int chromaWidth = (width + 1) / 2;
+
+    for (; x < chromaWidth; x++) {
+        unsigned int left = x * 2;
+        unsigned int right = (left + 1 < width) ? left + 1 : left;
+
+        int avg[3];
+        for (int c = 0; c < 3; c++) {
+            int sum = row0[left * 4 + c] + row0[right * 4 + c]
+                      + row1[left * 4 + c] + row1[right * 4 + c];
+            avg[c] = (sum + 2) >> 2;
+        }
+
+        int us = U_WEIGHTS[0] * avg[0] + U_WEIGHTS[1] * avg[1]
+                 + U_WEIGHTS[2] * avg[2];
+        int vs = V_WEIGHTS[0] * avg[0] + V_WEIGHTS[1] * avg[1]
+                 + V_WEIGHTS[2] * avg[2];
+        u[x] = ((us + 128) >> 8) + 128;
+        v[x] = ((vs + 128) >> 8) + 128;
+    }
+}
+
+#ifdef __SSE2__
+// Returns the averages of two 2x2 pixel blocks as 16-bit integers
+// (B G R X B G R X), given 4 pixels from two rows
+inline __m128i blockAverageSSE2(__m128i top, __m128i bottom) {
+    __m128i zero = _mm_setzero_si128();
+
+    // Sum the rows, then the pixel pairs
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(top, zero),
+                               _mm_unpacklo_epi8(bottom, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(top, zero),
+                               _mm_unpackhi_epi8(bottom, zero));
+    __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+                                _mm_unpackhi_epi64(lo, hi));
+
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+// Returns the chroma values of 4 blocks as 32-bit integers
+inline __m128i chromaSSE2(__m128i avg01, __m128i avg23, __m128i weights) {
+    __m128i lo = _mm_madd_epi16(avg01, weights);
+    __m128i hi = _mm_madd_epi16(avg23, weights);
+
+    __m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+                                 _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi),
+                                _MM_SHUFFLE(3, 1, 3, 1));
+    __m128i sum = _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+
+    sum = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(128)), 8);
+    return _mm_add_epi32(sum, _mm_set1_epi32(128));
+}
+
+// Converts a pair of rows 4 chroma samples (8 pixels) at a time,
+// returns the number of chroma samples done
+unsigned int chromaRowSSE2(const unsigned char* row0,
+                           const unsigned char* row1,
+                           unsigned char* u, unsigned char* v,
+                           unsigned int width) {
+    __m128i uw = _mm_setr_epi16(U_WEIGHTS[0], U_WEIGHTS[1], U_WEIGHTS[2], 0,
+                                U_WEIGHTS[0], U_WEIGHTS[1], U_WEIGHTS[2], 0);
+    __m128i vw = _mm_setr_epi16(V_WEIGHTS[0], V_WEIGHTS[1], V_WEIGHTS[2], 0,
+                                V_WEIGHTS[0], V_WEIGHTS[1], V_WEIGHTS[2], 0);
+    __m128i zero = _mm_setzero_si128();
+
+    unsigned int x = 0;
+    for (; x * 2 + 8 <= width; x += 4) {
+        const __m128i* p0 = (const __m128i*)(row0 + x * 8);
+        const __m128i* p1 = (const __m128i*)(row1 + x * 8);
+        __m128i avg01 = blockAverageSSE2(_mm_loadu_si128(p0),
+                                         _mm_loadu_si128(p1));
+        __m128i avg23 = blockAverageSSE2(_mm_loadu_si128(p0 + 1),
+                                         _mm_loadu_si128(p1 + 1));
+
+        __m128i us = chromaSSE2(avg01, avg23, uw);
+        __m128i vs = chromaSSE2(avg01, avg23, vw);
+
+        // Pack to bytes, only the lowest 4 bytes of each are used
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(us, vs), zero);
+        int uBytes = _mm_cvtsi128_si32(packed);
+        int vBytes = _mm_cvtsi128_si32(_mm_srli_si128(packed, 4));
+        memcpy(u + x, &uBytes, 4);
+        memcpy(v + x, &vBytes, 4);
+    }
+    return x;
+}
+#endif
+
+/*
+    Public functions
+*/
+
+void convertBGRXtoBGRX(const RawImage& src, char* dst) {
+    size_t rowBytes = (size_t)src.width * 4;
+
+    if (src.stride == rowBytes) {
+        memcpy(dst, src.data, rowBytes * src.height);
+        return;
+    }
+
+    for (unsigned int y = 0; y < src.height; y++)
+        memcpy(dst + y * rowBytes, src.data + (size_t)y * src.stride, rowBytes);
+}
+
+void convertBGRXtoRGB24(const RawImage& src, char* dst) {
+    for (unsigned int y = 0; y < src.height; y++) {
+        const unsigned char* row =
+            (const unsigned char*)src.data + (size_t)y * src.stride;
+        unsigned char* out = (unsigned char*)dst + (size_t)y * src.width * 3;
+        unsigned int x = 0;
+
+        #ifdef X86_DISPATCH
+            if (cpuHasAVX2)
+                x = rgbRowAVX2(row, out, x, src.width);
+            if (cpuHasSSSE3)
+                x = rgbRowSSSE3(row, out, x, src.width);
+        #endif
+
+        rgbRowScalar(row, out, x, src.width);
+    }
+}
+
+void convertBGRXtoGray8(const RawImage& src, char* dst) {
+    lumaPlane(src, (unsigned char*)dst, GRAY_WEIGHTS, GRAY_OFFSET);
+}
+
+void convertBGRXtoI420(const RawImage& src, char* dst) {
+    unsigned int chromaWidth = (src.width + 1) / 2;
+    unsigned int chromaHeight = (src.height + 1) / 2;
+
+    unsigned char* yPlane = (unsigned char*)dst;
+    unsigned char* uPlane = yPlane + (size_t)src.width * src.height;
+    unsigned char* vPlane = uPlane + (size_t)chromaWidth * chromaHeight;
+
+    lumaPlane(src, yPlane, Y_WEIGHTS, Y_OFFSET);
+
+    for (unsigned int y = 0; y < chromaHeight; y++) {
+        // The last row of an odd height image is paired with itself
+        unsigned int top = y * 2;
+        unsigned int bottom = (top + 1 < src.height) ? top + 1 : top;
+
+        const unsigned char* row0 =
+            (const unsigned char*)src.data + (size_t)top * src.stride;
+        const unsigned char* row1 =
+            (const unsigned char*)src.data + (size_t)bottom * src.stride;
+        unsigned char* u = uPlane + (size_t)y * chromaWidth;
+        unsigned char* v = vPlane + (size_t)y * chromaWidth;
+        unsigned int x = 0;
+
+        #ifdef __SSE2__
+            x = chromaRowSSE2(row0, row1, u, v, src.width);
+        #endif
+
+        chromaRowScalar(row0, row1, u, v, x, src.width);
+    }
+}
+
+void convertImage(const RawImage& src, ImageFormat format, char* dst) {
+    switch (format) {
+        case FORMAT_BGRX:
+            convertBGRXtoBGRX(src, dst);
+            break;
+        case FORMAT_RGB24:
+            convertBGRXtoRGB24(src, dst);
+            break;
+        case FORMAT_GRAY8:
+            convertBGRXtoGray8(src, dst);
+            break;
+        case FORMAT_I420:
+            convertBGRXtoI420(src, dst);
+            break;
+        default:
+            throw std::invalid_argument("not an uncompressed image format");
+    }
+}
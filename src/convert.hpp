@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+
+#include "image.hpp"
+
+/*
+    Returns the number of bytes needed for an uncompressed image of the given
+    format and size. Returns 0 for compressed formats (JPG and QOI).
+
+    Layouts of the uncompressed formats (rows are tightly packed):
+        FORMAT_BGRX:  4 bytes per pixel, B G R X
+        FORMAT_RGB24: 3 bytes per pixel, R G B
+        FORMAT_GRAY8: 1 byte per pixel
+        FORMAT_I420:  Y plane (width * height) followed by U and V planes
+                      (each (width + 1) / 2 * (height + 1) / 2)
+ */
+size_t getRawImageSize(ImageFormat format, unsigned int width,
+                       unsigned int height);
+
+/*
+    Converts a BGRX image to the given uncompressed format and writes it
+    to dst, which must have room for getRawImageSize bytes.
+
+    Uses SSE2/SSSE3/AVX2 kernels when the CPU supports them.
+    Throws invalid_argument if the format is not an uncompressed format.
+ */
+void convertImage(const RawImage& src, ImageFormat format, char* dst);
+
+/*
+    Conversion functions for the individual formats.
+    Grayscale uses full range BT.601 weights and I420 uses limited range
+    BT.601, with chroma averaged over 2x2 pixel blocks.
+ */
+void convertBGRXtoBGRX(const RawImage& src, char* dst);
+void convertBGRXtoRGB24(const RawImage& src, char* dst);
+void convertBGRXtoGray8(const RawImage& src, char* dst);
+void convertBGRXtoI420(const RawImage& src, char* dst);
@@ -0,0 +1,16 @@
+/*
+    Detects the CPU features at startup (see cpu.hpp)
+*/
+
+#include "cpu.hpp"
+
+#ifdef X86_DISPATCH
+    // __builtin_cpu_init has to be called before using
+    // __builtin_cpu_supports in static initializers
+    const bool cpuHasSSSE3 = (__builtin_cpu_init(),
+                              __builtin_cpu_supports("ssse3"));
+    const bool cpuHasAVX2 = (__builtin_cpu_init(),
+                             __builtin_cpu_supports("avx2"));
+    const bool cpuHasF16C = (__builtin_cpu_init(),
+                             __builtin_cpu_supports("f16c"));
+#endif
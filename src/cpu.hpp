@@ -0,0 +1,25 @@
+#pragma once
+
+/*
+    SIMD intrinsics and the CPU features that kernels are selected with.
+
+    Kernels that need more than SSE2 (which every x86-64 CPU has) are
+    compiled with target attributes and only called if the CPU supports
+    them, so the binary still runs on older CPUs. X86_DISPATCH is defined
+    when the compiler supports this.
+ */
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define X86_DISPATCH
+    #include <immintrin.h>
+
+    // Set by static initializers, so they can't be used in other
+    // static initializers
+    extern const bool cpuHasSSSE3;
+    extern const bool cpuHasAVX2;
+    extern const bool cpuHasF16C;
+#endif
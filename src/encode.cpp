@@ -0,0 +1,670 @@
+/*
+    Encodes captured images as jpg or converts them to uncompressed formats
+    and tensors, optionally scaling them first.
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <turbojpeg.h>
+
+#include "encode.hpp"
+#include "convert.hpp"
+#include "tensor.hpp"
+#include "resize.hpp"
+#include "maxpool.hpp"
+#include "qoi.hpp"
+#include "tiles.hpp"
+#include "threadpool.hpp"
+
+// Largest width or height an image can be scaled to
+const unsigned int MAX_SCALED_SIZE = 16384;
+
+// Bands of a jpg image that is encoded in parallel have at least this many
+// rows of MCUs, so that small images are encoded in one piece
+const unsigned int MIN_BAND_MCU_ROWS = 4;
+
+// Largest restart interval (in MCUs) a DRI marker can hold
+const unsigned int MAX_RESTART_INTERVAL = 65535;
+
+// JPEG markers (the byte after 0xff)
+const unsigned char MARKER_SOF0 = 0xc0;
+const unsigned char MARKER_SOF1 = 0xc1;
+const unsigned char MARKER_RST0 = 0xd0;
+const unsigned char MARKER_EOI = 0xd9;
+const unsigned char MARKER_SOS = 0xda;
+const unsigned char MARKER_DRI = 0xdd;
+
+void initEncoder(EncodeState* state) {
+    state->instance = tjInitCompress();
+    if (state->instance == NULL)
+        std::cout << "Initializing libjpeg-turbo failed!" << std::endl;
+}
+
+void shutdownEncoder(EncodeState* state) {
+    if (state->instance != NULL)
+        tjDestroy(state->instance);
+
+    state->instance = NULL;
+
+    for (tjhandle instance : state->bandInstances)
+        tjDestroy(instance);
+    for (tjhandle instance : state->outputInstances)
+        tjDestroy(instance);
+
+    state->bandInstances.clear();
+    state->outputInstances.clear();
+    state->outputScaled.clear();
+    state->bandBuffers.clear();
+    state->bandSizes.clear();
+}
+
+inline unsigned int readBigEndian16(const unsigned char* p) {
+    return p[0] << 8 | p[1];
+}
+
+inline void writeBigEndian16(unsigned char* p, unsigned int value) {
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+bool getJPEGLayout(const unsigned char* jpeg, unsigned long size,
+                   JPEGLayout* layout) {
+    /*
+        Finds the SOF and SOS markers and the entropy-coded data of a jpg
+        image written by libjpeg-turbo. Returns false if the image doesn't
+        have the expected structure or already uses restart markers.
+     */
+
+    layout->sof = 0;
+
+    // Skip SOI, then walk through the marker segments until SOS
+    size_t i = 2;
+    while (i + 4 <= size && jpeg[i] == 0xff) {
+        unsigned char marker = jpeg[i + 1];
+        size_t length = readBigEndian16(jpeg + i + 2);
+
+        if (marker == MARKER_SOF0 || marker == MARKER_SOF1) {
+            layout->sof = i;
+        } else if (marker == MARKER_DRI) {
+            return false;
+        } else if (marker == MARKER_SOS) {
+            layout->sos = i;
+            layout->data = i + 2 + length;
+            layout->dataEnd = size - 2;
+
+            return layout->sof != 0 && layout->data <= layout->dataEnd
+                   && jpeg[size - 2] == 0xff && jpeg[size - 1] == MARKER_EOI;
+        }
+        i += 2 + length;
+    }
+    return false;
+}
+
+unsigned int getBandCount(unsigned int width, unsigned int height,
+                          int subsamp, unsigned int* bandHeight) {
+    /*
+        Returns how many bands an image should be split into for encoding,
+        and the height of the bands (a multiple of the MCU height).
+     */
+
+    unsigned int mcuWidth = tjMCUWidth[subsamp];
+    unsigned int mcuHeight = tjMCUHeight[subsamp];
+    unsigned int mcuColumns = (width + mcuWidth - 1) / mcuWidth;
+    unsigned int mcuRows = (height + mcuHeight - 1) / mcuHeight;
+
+    unsigned int bands = std::min(getThreadPoolSize(),
+                                  mcuRows / MIN_BAND_MCU_ROWS);
+    if (bands <= 1 || mcuColumns > MAX_RESTART_INTERVAL)
+        return 1;
+
+    // Each band is one restart interval, which limits the size of a band
+    unsigned int bandRows = (mcuRows + bands - 1) / bands;
+    bandRows = std::min(bandRows, MAX_RESTART_INTERVAL / mcuColumns);
+
+    *bandHeight = bandRows * mcuHeight;
+    return (mcuRows + bandRows - 1) / bandRows;
+}
+
+unsigned long joinBands(unsigned int bands, unsigned int height,
+                        unsigned int restartInterval, EncodeState* state,
+                        ImageBuffer* imageBuffer,
+                        std::vector<uint32_t>* bandOffsets) {
+    /*
+        Joins separately encoded bands of an image into one jpg image.
+
+        libjpeg-turbo starts each band with fresh DC predictions and ends it
+        on a byte boundary, which is exactly what a restart marker does. So
+        the entropy-coded data of the bands can be joined with restart
+        markers in between, under the headers of the first band with the
+        full image height and a DRI marker for the restart interval.
+
+        Returns 0 if the bands can't be joined, for example if they were
+        encoded with different Huffman tables.
+     */
+
+    const std::vector<std::vector<unsigned char>>& bandBuffers =
+        state->bandBuffers;
+
+    std::vector<JPEGLayout>& layouts = state->bandLayouts;
+    layouts.resize(bands);
+    for (unsigned int band = 0; band < bands; band++) {
+        if (!getJPEGLayout(bandBuffers[band].data(), state->bandSizes[band],
+                           &layouts[band])) {
+            return 0;
+        }
+    }
+
+    // The headers of all bands have to match, apart from the height
+    const unsigned char* first = bandBuffers[0].data();
+    const JPEGLayout& header = layouts[0];
+    for (unsigned int band = 1; band < bands; band++) {
+        const unsigned char* jpeg = bandBuffers[band].data();
+        const JPEGLayout& layout = layouts[band];
+        size_t heightOffset = header.sof + 5;
+
+        if (layout.data != header.data || layout.sof != header.sof
+            || memcmp(jpeg, first, heightOffset) != 0
+            || memcmp(jpeg + heightOffset + 2, first + heightOffset + 2,
+                      header.data - heightOffset - 2) != 0) {
+            return 0;
+        }
+    }
+
+    // Headers, DRI, the data of each band, RST markers and EOI
+    size_t size = header.data + 6 + 2 * (bands - 1) + 2;
+    for (unsigned int band = 0; band < bands; band++)
+        size += layouts[band].dataEnd - layouts[band].data;
+
+    unsigned char* out = (unsigned char*)imageBuffer->reserve(size);
+    unsigned char* start = out;
+
+    memcpy(out, first, header.sos);
+    writeBigEndian16(out + header.sof + 5, height);
+    out += header.sos;
+
+    *out++ = 0xff;
+    *out++ = MARKER_DRI;
+    writeBigEndian16(out, 4);
+    writeBigEndian16(out + 2, restartInterval);
+    out += 4;
+
+    memcpy(out, first + header.sos, header.data - header.sos);
+    out += header.data - header.sos;
+
+    bandOffsets->clear();
+    for (unsigned int band = 0; band < bands; band++) {
+        const JPEGLayout& layout = layouts[band];
+        if (band > 0) {
+            *out++ = 0xff;
+            *out++ = MARKER_RST0 + (band - 1) % 8;
+        }
+
+        bandOffsets->push_back(out - start);
+        memcpy(out, bandBuffers[band].data() + layout.data,
+               layout.dataEnd - layout.data);
+        out += layout.dataEnd - layout.data;
+    }
+
+    *out++ = 0xff;
+    *out++ = MARKER_EOI;
+
+    return out - start;
+}
+
+unsigned long encodeJPGBands(const RawImage& raw, unsigned int quality,
+                             int subsamp, unsigned int bands,
+                             unsigned int bandHeight, EncodeState* state,
+                             ImageBuffer* imageBuffer, Frame* frame) {
+    /*
+        Encodes horizontal bands of the image in parallel and joins them
+        into one jpg image with restart markers between the bands.
+        Returns 0 if the bands couldn't be joined.
+     */
+
+    std::vector<tjhandle>& bandInstances = state->bandInstances;
+    std::vector<std::vector<unsigned char>>& bandBuffers = state->bandBuffers;
+    std::vector<unsigned long>& bandSizes = state->bandSizes;
+
+    while (bandInstances.size() < bands) {
+        tjhandle instance = tjInitCompress();
+        if (instance == NULL)
+            throw std::invalid_argument("libjpeg-turbo is not initialized");
+
+        bandInstances.push_back(instance);
+    }
+    bandBuffers.resize(std::max<size_t>(bandBuffers.size(), bands));
+    bandSizes.resize(bandBuffers.size());
+
+    std::vector<char>& failed = state->bandFailed;
+    failed.resize(bands);
+
+    parallelFor(bands, 1, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int band = begin; band < end; band++) {
+            unsigned int y = band * bandHeight;
+            unsigned int height = std::min(bandHeight, raw.height - y);
+
+            unsigned long size = tjBufSize(raw.width, height, subsamp);
+            if (bandBuffers[band].size() < size)
+                bandBuffers[band].resize(size);
+
+            unsigned char* jpegBuffer = bandBuffers[band].data();
+            bandSizes[band] = size;
+            failed[band] = tjCompress2(
+                bandInstances[band],
+                (const unsigned char*)raw.data + (size_t)y * raw.stride,
+                raw.width, raw.stride, height, TJPF_BGRX, &jpegBuffer,
+                &bandSizes[band], subsamp, quality, TJFLAG_NOREALLOC) != 0;
+        }
+    });
+
+    for (unsigned int band = 0; band < bands; band++) {
+        if (failed[band])
+            throw std::invalid_argument(tjGetErrorStr2(bandInstances[band]));
+    }
+
+    unsigned int mcuColumns = (raw.width + tjMCUWidth[subsamp] - 1)
+                              / tjMCUWidth[subsamp];
+    unsigned int restartInterval = mcuColumns * bandHeight
+                                   / tjMCUHeight[subsamp];
+
+    unsigned long bytes = joinBands(bands, raw.height, restartInterval,
+                                    state, imageBuffer, &frame->bandOffsets);
+    if (bytes != 0)
+        frame->bandHeight = bandHeight;
+
+    return bytes;
+}
+
+unsigned long encodeJPG(const RawImage& raw, unsigned int quality,
+                        ChromaSubsampling subsampling, bool useBands,
+                        tjhandle instance, EncodeState* state,
+                        ImageBuffer* imageBuffer, Frame* frame) {
+    if (instance == NULL)
+        throw std::invalid_argument("libjpeg-turbo is not initialized");
+
+    int subsamp = TJSAMP_420;
+    if (subsampling == SUBSAMPLING_422)
+        subsamp = TJSAMP_422;
+    else if (subsampling == SUBSAMPLING_444)
+        subsamp = TJSAMP_444;
+
+    // Large images are split into bands that are encoded in parallel if
+    // requested, and if there is a frame to store the offsets of the bands
+    // in. Otherwise the image is the same as libjpeg-turbo makes it.
+    unsigned int bandHeight = 0;
+    unsigned int bands = 1;
+    if (useBands && frame != NULL)
+        bands = getBandCount(raw.width, raw.height, subsamp, &bandHeight);
+
+    if (bands > 1) {
+        unsigned long bytes = encodeJPGBands(raw, quality, subsamp, bands,
+                                             bandHeight, state, imageBuffer,
+                                             frame);
+        if (bytes != 0)
+            return bytes;
+    }
+
+    // Make sure the buffer fits the worst case jpg size, so libjpeg-turbo
+    // can write the image straight into it
+    unsigned long bufferLength = tjBufSize(raw.width, raw.height, subsamp);
+    unsigned char* jpegBuffer =
+        (unsigned char*)imageBuffer->reserve(bufferLength);
+
+    // Compress image as jpg
+    if (tjCompress2(instance, (const unsigned char*)raw.data,
+                    raw.width, raw.stride, raw.height, TJPF_BGRX,
+                    &jpegBuffer, &bufferLength, subsamp, quality,
+                    TJFLAG_NOREALLOC) != 0) {
+        throw std::invalid_argument(tjGetErrorStr2(instance));
+    }
+
+    return bufferLength;
+}
+
+unsigned long encodeImage(const RawImage& raw, const ImageOptions& options,
+                          tjhandle instance, EncodeState* state,
+                          ImageBuffer* imageBuffer, Frame* frame) {
+    /*
+        Encodes the image with the given libjpeg-turbo instance. Images
+        that are encoded for a frame are split into bands with the
+        instances of the state.
+     */
+
+    unsigned long bytes;
+
+    if (options.format == FORMAT_JPEG) {
+        bytes = encodeJPG(raw, options.quality, options.subsampling,
+                          options.jpegBands, instance, state, imageBuffer,
+                          frame);
+    } else if (options.format == FORMAT_QOI) {
+        size_t maxBytes = getQOIMaxSize(raw.width, raw.height);
+        bytes = encodeQOI(raw, imageBuffer->reserve(maxBytes));
+    } else {
+        bytes = getRawImageSize(options.format, raw.width, raw.height);
+        if (bytes == 0)
+            throw std::invalid_argument("unknown image format");
+
+        convertImage(raw, options.format, imageBuffer->reserve(bytes));
+    }
+
+    imageBuffer->setSize(bytes);
+    imageBuffer->setInfo(options.format, raw.width, raw.height);
+    return bytes;
+}
+
+void encodeTensor(const RawImage& raw, const TensorSettings& settings,
+                  ImageBuffer* tensorBuffer) {
+    size_t bytes = getTensorSize(settings.type, raw.width, raw.height);
+
+    convertToTensor(raw, settings, tensorBuffer->reserve(bytes));
+
+    tensorBuffer->setSize(bytes);
+}
+
+bool clipRegion(const CaptureRegion& region, const RawImage& image,
+                CaptureRegion* clipped, RawImage* part) {
+    /*
+        Clips the region to the image and points part to the clipped region
+        of the image. Returns false if the region is outside the image.
+     */
+
+    long left = std::max<long>(region.x, 0);
+    long top = std::max<long>(region.y, 0);
+    long right = std::min<long>((long)region.x + region.width, image.width);
+    long bottom = std::min<long>((long)region.y + region.height,
+                                 image.height);
+
+    if (right <= left || bottom <= top)
+        return false;
+
+    clipped->x = left;
+    clipped->y = top;
+    clipped->width = right - left;
+    clipped->height = bottom - top;
+
+    part->data = image.data + (size_t)top * image.stride + left * 4;
+    part->width = clipped->width;
+    part->height = clipped->height;
+    part->stride = image.stride;
+    return true;
+}
+
+void encodeRegionsOfInterest(const RawImage& captured,
+                             const ImageOptions& options, EncodeState* state,
+                             Frame* frame) {
+    /*
+        Encodes the regions of interest of the captured image separately
+        with their own quality, clipped to the image.
+     */
+
+    frame->roiImages.resize(std::max(frame->roiImages.size(),
+                                     options.rois.size()));
+    frame->roiRegions.resize(options.rois.size());
+
+    for (size_t i = 0; i < options.rois.size(); i++) {
+        const RoiSettings& roi = options.rois[i];
+        CaptureRegion* region = &frame->roiRegions[i];
+
+        RawImage patch;
+        if (!clipRegion(roi.region, captured, region, &patch)) {
+            *region = CaptureRegion();
+            frame->roiImages[i].setSize(0);
+            frame->roiImages[i].setInfo(options.format, 0, 0);
+            continue;
+        }
+
+        ImageOptions roiOptions = options;
+        if (roi.quality != 0)
+            roiOptions.quality = roi.quality;
+
+        encodeImage(patch, roiOptions, state->instance, state,
+                    &frame->roiImages[i], NULL);
+    }
+}
+
+void encodeOutput(const RawImage& captured, const OutputSettings& output,
+                  tjhandle instance, std::vector<char>* scaled,
+                  ImageBuffer* imageBuffer) {
+    /*
+        Crops, scales and encodes one additional output of a frame
+     */
+
+    RawImage raw = captured;
+    if (output.crop.width != 0 && output.crop.height != 0) {
+        CaptureRegion clipped;
+        if (!clipRegion(output.crop, captured, &clipped, &raw))
+            throw std::invalid_argument("output crop is outside the image");
+    }
+
+    ImageOptions encodeOptions;
+    encodeOptions.format = output.format;
+    encodeOptions.quality = output.quality;
+    encodeOptions.subsampling = output.subsampling;
+    encodeOptions.width = output.width;
+    encodeOptions.height = output.height;
+    encodeOptions.scale = output.scale;
+
+    if (encodeOptions.isScaled()) {
+        unsigned int width, height;
+        getScaledSize(raw.width, raw.height, encodeOptions, &width, &height);
+
+        scaled->resize((size_t)width * height * 4);
+        resizeImage(raw, width, height, output.filter, scaled->data());
+
+        raw.data = scaled->data();
+        raw.width = width;
+        raw.height = height;
+        raw.stride = width * 4;
+    }
+
+    encodeImage(raw, encodeOptions, instance, NULL, imageBuffer, NULL);
+}
+
+void encodeOutputs(const RawImage* captured, size_t capturedCount,
+                   const std::vector<OutputSettings>& outputs,
+                   EncodeState* state, std::vector<ImageBuffer>* images) {
+    /*
+        Makes the outputs from the captured images in parallel and writes
+        them to the first buffers of images. There is either one captured
+        image that all outputs are made from, or one for each output.
+     */
+
+    size_t count = outputs.size();
+    std::vector<tjhandle>& outputInstances = state->outputInstances;
+    std::vector<std::vector<char>>& outputScaled = state->outputScaled;
+
+    while (outputInstances.size() < count) {
+        tjhandle instance = tjInitCompress();
+        if (instance == NULL)
+            throw std::invalid_argument("libjpeg-turbo is not initialized");
+
+        outputInstances.push_back(instance);
+    }
+    outputScaled.resize(std::max(outputScaled.size(), count));
+    images->resize(std::max(images->size(), count));
+
+    // The body of parallelFor must not throw, so errors are rethrown after
+    std::vector<std::string>& errors = state->outputErrors;
+    errors.resize(std::max(errors.size(), count));
+    for (size_t i = 0; i < count; i++)
+        errors[i].clear();
+
+    parallelFor(count, 1, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int i = begin; i < end; i++) {
+            try {
+                const RawImage& source = captured[capturedCount == 1 ? 0 : i];
+                encodeOutput(source, outputs[i], outputInstances[i],
+                             &outputScaled[i], &(*images)[i]);
+            } catch (const std::invalid_argument& e) {
+                errors[i] = e.what();
+            }
+        }
+    });
+
+    for (size_t i = 0; i < count; i++) {
+        if (!errors[i].empty())
+            throw std::invalid_argument(errors[i]);
+    }
+}
+
+void getScaledSize(unsigned int srcWidth, unsigned int srcHeight,
+                   const ImageOptions& options,
+                   unsigned int* width, unsigned int* height) {
+    *width = options.width;
+    *height = options.height;
+
+    if (*width == 0 && *height == 0) {
+        *width = srcWidth;
+        *height = srcHeight;
+    }
+    if (*width == 0)
+        *width = ((uint64_t)srcWidth * *height + srcHeight / 2) / srcHeight;
+    if (*height == 0)
+        *height = ((uint64_t)srcHeight * *width + srcWidth / 2) / srcWidth;
+
+    if (options.scale != 1) {
+        *width = (unsigned int)(*width * options.scale + 0.5f);
+        *height = (unsigned int)(*height * options.scale + 0.5f);
+    }
+
+    if (*width == 0)
+        *width = 1;
+    if (*height == 0)
+        *height = 1;
+
+    if (*width > MAX_SCALED_SIZE || *height > MAX_SCALED_SIZE)
+        throw std::invalid_argument("requested image size is too large");
+}
+
+void resetEncodeState(EncodeState* state) {
+    resetMaxPool(&state->maxPool);
+    resetTileMap(&state->tiles);
+}
+
+unsigned long encodeFrame(const RawImage& captured, const ImageOptions& options,
+                          EncodeState* state, Frame* frame) {
+    auto start = std::chrono::steady_clock::now();
+    RawImage raw = captured;
+
+    if (options.isScaled()) {
+        if (captured.width == 0 || captured.height == 0)
+            throw std::invalid_argument("captured image is empty");
+
+        unsigned int width, height;
+        getScaledSize(captured.width, captured.height, options,
+                      &width, &height);
+
+        // Scaled image, reused between frames of the same thread
+        thread_local std::vector<char> scaled;
+        scaled.resize((size_t)width * height * 4);
+        resizeImage(captured, width, height, options.filter, scaled.data());
+
+        raw.data = scaled.data();
+        raw.width = width;
+        raw.height = height;
+        raw.stride = width * 4;
+    }
+
+    maxPoolImage(&raw, options.maxPool, &state->maxPool);
+
+    if (options.tensor.enabled)
+        encodeTensor(raw, options.tensor, &frame->tensor);
+    else
+        frame->tensor.setSize(0);
+
+    if (options.tileSize != 0)
+        updateTileMap(raw, options.tileSize, &frame->tiles, &state->tiles);
+
+    unsigned long bytes;
+    if (options.tileSize != 0 && options.tilesOnly) {
+        frame->tiles.set_tiles_only(true);
+
+        RawImage packed;
+        packChangedTiles(raw, frame->tiles, &packed, &state->tiles);
+
+        if (packed.width != 0) {
+            bytes = encodeImage(packed, options, state->instance, state,
+                                &frame->image, frame);
+        } else {
+            // Nothing changed, so there is no image
+            bytes = 0;
+            frame->image.setSize(0);
+            frame->image.setInfo(options.format, 0, 0);
+        }
+    } else {
+        bytes = encodeImage(raw, options, state->instance, state,
+                            &frame->image, frame);
+    }
+
+    encodeRegionsOfInterest(captured, options, state, frame);
+    encodeOutputs(&captured, 1, options.outputs, state, &frame->outputImages);
+
+    frame->encodeTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return bytes;
+}
+
+unsigned long encodeWindowOutputs(const RawImage* captured,
+                                  size_t capturedCount,
+                                  const std::vector<CaptureRegion>& windows,
+                                  const ImageOptions& options,
+                                  EncodeState* state, Frame* frame) {
+    /*
+        Encodes the windows of encodeWindows and encodeWindowImages.
+        An empty window is the whole captured image.
+     */
+
+    auto start = std::chrono::steady_clock::now();
+
+    // Each window is an output with the size and format of the options
+    std::vector<OutputSettings>& outputs = state->windowOutputs;
+    outputs.resize(windows.size());
+    for (size_t i = 0; i < windows.size(); i++) {
+        outputs[i].crop = windows[i];
+        outputs[i].width = options.width;
+        outputs[i].height = options.height;
+        outputs[i].scale = options.scale;
+        outputs[i].filter = options.filter;
+        outputs[i].format = options.format;
+        outputs[i].quality = options.quality;
+        outputs[i].subsampling = options.subsampling;
+    }
+
+    encodeOutputs(captured, capturedCount, outputs, state,
+                  &frame->windowImages);
+
+    // There is no image of the whole capture
+    frame->image.setSize(0);
+    frame->image.setInfo(options.format, 0, 0);
+    frame->tensor.setSize(0);
+
+    unsigned long bytes = 0;
+    for (size_t i = 0; i < windows.size(); i++)
+        bytes += frame->windowImages[i].size();
+
+    frame->encodeTime = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+    return bytes;
+}
+
+unsigned long encodeWindows(const RawImage& captured,
+                            const std::vector<CaptureRegion>& windows,
+                            const ImageOptions& options, EncodeState* state,
+                            Frame* frame) {
+    return encodeWindowOutputs(&captured, 1, windows, options, state, frame);
+}
+
+unsigned long encodeWindowImages(const std::vector<RawImage>& windows,
+                                 const ImageOptions& options,
+                                 EncodeState* state, Frame* frame) {
+    // Each window is encoded whole
+    state->wholeImages.resize(windows.size());
+    return encodeWindowOutputs(windows.data(), windows.size(),
+                               state->wholeImages, options, state, frame);
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <turbojpeg.h>
+
+#include "image.hpp"
+#include "maxpool.hpp"
+#include "tiles.hpp"
+
+// Location of the headers and the entropy-coded data in a jpg image
+struct JPEGLayout {
+    size_t sof;         // Start of the SOF marker
+    size_t sos;         // Start of the SOS marker
+    size_t data;        // Start of the entropy-coded data
+    size_t dataEnd;     // Start of the EOI marker
+};
+
+/*
+    The state that encodeFrame keeps between the captures of one display
+    (or other capture target): the previous captures, and the
+    libjpeg-turbo instances and buffers that are reused for every image.
+    Each display has its own state, so displays can be encoded at the
+    same time, but a state must only be used by one thread at a time.
+ */
+struct EncodeState {
+    MaxPool maxPool;
+    TileHistory tiles;
+
+    // libjpeg-turbo instance of the image and the regions of interest
+    tjhandle instance = NULL;
+
+    // libjpeg-turbo instances, output buffers, layouts and errors of the
+    // bands of parallel encoded images, one per band
+    std::vector<tjhandle> bandInstances;
+    std::vector<std::vector<unsigned char>> bandBuffers;
+    std::vector<unsigned long> bandSizes;
+    std::vector<JPEGLayout> bandLayouts;
+    std::vector<char> bandFailed;
+
+    // libjpeg-turbo instances, scaled images and errors of the additional
+    // outputs of a frame, one per output, so that the outputs can be made
+    // in parallel
+    std::vector<tjhandle> outputInstances;
+    std::vector<std::vector<char>> outputScaled;
+    std::vector<std::string> outputErrors;
+
+    // The windows of a multi-window capture as outputs and their crops
+    std::vector<OutputSettings> windowOutputs;
+    std::vector<CaptureRegion> wholeImages;
+};
+
+/*
+    Drops the previous captures kept in the state, for example when
+    another window is captured.
+ */
+void resetEncodeState(EncodeState* state);
+
+/*
+    Initializes the image encoder of the state. Should be called once
+    before calling encodeFrame with the state.
+ */
+void initEncoder(EncodeState* state);
+
+/*
+    Frees the libjpeg-turbo instances of the state.
+ */
+void shutdownEncoder(EncodeState* state);
+
+/*
+    Returns the size an image of srcWidth x srcHeight pixels should be
+    scaled to with the given options. If only one of the dimensions is
+    given in the options, the other one keeps the aspect ratio, and if
+    neither is given, the source size is used. The size is then multiplied
+    by the scale factor of the options.
+
+    Throws invalid_argument if the size is too large.
+ */
+void getScaledSize(unsigned int srcWidth, unsigned int srcHeight,
+                   const ImageOptions& options,
+                   unsigned int* width, unsigned int* height);
+
+/*
+    Encodes a captured BGRX image in the format given in options and writes
+    it to the image buffer of the frame. If a tensor is enabled in the
+    options, it is written to the tensor buffer of the frame.
+    If a size is given in the options, the image is scaled to it first,
+    and both the image and the tensor are made from the scaled image.
+    If max-pooling is enabled, the (scaled) image is max-pooled with the
+    previous captures kept in state before it is encoded (see maxPoolImage).
+    If a tile size is given, the tiles that changed since the previous
+    capture kept in state are stored in the frame, and if only the changed tiles were
+    requested, only they are encoded (see packChangedTiles). The tensor
+    always has the whole image.
+    If bands are enabled in the options, large jpg images are encoded in
+    horizontal bands in parallel, and the offsets of the bands are stored
+    in the frame.
+    The regions of interest in the options are cut from the captured image
+    (before scaling and max-pooling) and encoded separately with their own
+    quality into the frame.
+    The additional outputs in the options are made from the captured image
+    in parallel, each with its own crop, size, format and quality.
+    The time spent on all of this is stored in the frame.
+    Returns the size of the encoded image in bytes.
+
+    Throws invalid_argument if the image could not be encoded.
+ */
+unsigned long encodeFrame(const RawImage& raw, const ImageOptions& options,
+                          EncodeState* state, Frame* frame);
+
+/*
+    Crops the windows out of a captured image of the whole display and
+    encodes each of them with the size, format and quality given in options,
+    in parallel. The windows are rectangles of the captured image, and the
+    images are written to the window images of the frame in the same order.
+    The frame gets no image of the whole capture.
+    The time spent on this is stored in the frame.
+    Returns the total size of the encoded images in bytes.
+
+    Throws invalid_argument if an image could not be encoded.
+ */
+unsigned long encodeWindows(const RawImage& captured,
+                            const std::vector<CaptureRegion>& windows,
+                            const ImageOptions& options, EncodeState* state,
+                            Frame* frame);
+
+/*
+    Like encodeWindows, but each window has been captured into an image
+    of its own instead of being cropped from one capture of the display.
+ */
+unsigned long encodeWindowImages(const std::vector<RawImage>& windows,
+                                 const ImageOptions& options,
+                                 EncodeState* state, Frame* frame);
@@ -0,0 +1,111 @@
+/*
+    Keeps a bounded, time-ordered history of recently captured frames.
+*/
+
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <algorithm>
+
+#include "history.hpp"
+
+struct HistoryEntry {
+    std::vector<char> image;
+    uint64_t timestamp;
+
+    ImageFormat format;
+    unsigned int width;
+    unsigned int height;
+};
+
+// Mutex that should be used before accessing the variables defined here
+std::mutex historyMutex;
+
+// Frames in the order they were captured
+std::deque<HistoryEntry> history;
+
+// Total size of the images in the history and the maximum allowed size
+size_t historyBytes = 0;
+size_t historyBudget = 0;
+
+void setHistoryBudget(size_t bytes) {
+    std::lock_guard<std::mutex> lock(historyMutex);
+
+    historyBudget = bytes;
+
+    while (!history.empty() && historyBytes > historyBudget) {
+        historyBytes -= history.front().image.size();
+        history.pop_front();
+    }
+}
+
+size_t getHistoryBudget() {
+    std::lock_guard<std::mutex> lock(historyMutex);
+    return historyBudget;
+}
+
+void addToHistory(const ImageBuffer& image, uint64_t timestamp) {
+    std::lock_guard<std::mutex> lock(historyMutex);
+
+    size_t imageBytes = image.size();
+
+    if (imageBytes == 0 || imageBytes > historyBudget)
+        return;
+
+    // Drop the oldest frames until the new one fits. The buffer of the last
+    // dropped frame is reused for the new frame to avoid an allocation.
+    std::vector<char> buffer;
+    while (!history.empty() && historyBytes + imageBytes > historyBudget) {
+        historyBytes -= history.front().image.size();
+        buffer.swap(history.front().image);
+        history.pop_front();
+    }
+
+    buffer.assign(image.data(), image.data() + imageBytes);
+
+    history.push_back(HistoryEntry());
+    history.back().image.swap(buffer);
+    history.back().timestamp = timestamp;
+    history.back().format = image.format();
+    history.back().width = image.width();
+    history.back().height = image.height();
+    historyBytes += imageBytes;
+}
+
+void addEntry(const HistoryEntry& entry, Response* respMsg) {
+    TimedImage* timedImage = respMsg->add_history();
+    timedImage->set_image(entry.image.data(), entry.image.size());
+    timedImage->set_timestamp(entry.timestamp);
+    timedImage->set_format(entry.format);
+    timedImage->set_width(entry.width);
+    timedImage->set_height(entry.height);
+}
+
+bool getHistoryFrameAt(uint64_t timestamp, Response* respMsg) {
+    std::lock_guard<std::mutex> lock(historyMutex);
+
+    // Find the first frame captured after the timestamp
+    auto next = std::upper_bound(
+        history.begin(), history.end(), timestamp,
+        [](uint64_t t, const HistoryEntry& e) { return t < e.timestamp; }
+    );
+
+    // Every frame in the history is newer than the timestamp
+    if (next == history.begin())
+        return false;
+
+    addEntry(*(next - 1), respMsg);
+    return true;
+}
+
+unsigned int getHistoryLastFrames(unsigned int count, Response* respMsg) {
+    std::lock_guard<std::mutex> lock(historyMutex);
+
+    if (count > history.size())
+        count = history.size();
+
+    for (auto it = history.end() - count; it != history.end(); it++)
+        addEntry(*it, respMsg);
+
+    return count;
+}
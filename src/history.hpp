@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "messages.pb.h"
+#include "image.hpp"
+
+/*
+    Sets how many bytes of encoded images the frame history may hold.
+    When the history is full, the oldest frames are dropped to make room
+    for new ones. A budget of 0 disables the history (the default).
+ */
+void setHistoryBudget(size_t bytes);
+
+/*
+    Returns the byte budget of the frame history.
+ */
+size_t getHistoryBudget();
+
+/*
+    Adds a copy of an encoded image to the frame history.
+    timestamp is the capture time of the image (see getTimestamp in
+    capture.hpp). Images should be added in timestamp order.
+ */
+void addToHistory(const ImageBuffer& image, uint64_t timestamp);
+
+/*
+    Adds the newest frame that was captured at or before the given
+    timestamp to the history field of the response.
+
+    Returns false if there is no such frame in the history.
+ */
+bool getHistoryFrameAt(uint64_t timestamp, Response* respMsg);
+
+/*
+    Adds the count newest frames (or all frames, if there are fewer of them)
+    to the history field of the response, oldest frame first.
+
+    Returns the number of frames that were added.
+ */
+unsigned int getHistoryLastFrames(unsigned int count, Response* respMsg);
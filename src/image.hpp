@@ -0,0 +1,351 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "messages.pb.h"
+
+/*
+    An uncompressed 32-bit BGRX image as captured from the display.
+    Rows are stride bytes apart.
+ */
+struct RawImage {
+    const char* data;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+};
+
+/*
+    Settings of the tensor output (see TensorOptions in messages.proto)
+ */
+struct TensorSettings {
+    bool enabled = false;
+    TensorLayout layout = TENSOR_HWC;
+    TensorType type = TENSOR_UINT8;
+
+    // Normalization of each channel (R, G, B)
+    float mean[3] = { 0, 0, 0 };
+    float std[3] = { 1, 1, 1 };
+
+    bool operator==(const TensorSettings& other) const {
+        if (enabled != other.enabled)
+            return false;
+        if (!enabled)
+            return true;
+
+        for (int c = 0; c < 3; c++) {
+            if (mean[c] != other.mean[c] || std[c] != other.std[c])
+                return false;
+        }
+        return layout == other.layout && type == other.type;
+    }
+};
+
+/*
+    A rectangle of the window that is captured (see Rect in messages.proto).
+    An empty rectangle means the whole window.
+ */
+struct CaptureRegion {
+    int x = 0;
+    int y = 0;
+    unsigned int width = 0;
+    unsigned int height = 0;
+
+    bool operator==(const CaptureRegion& other) const {
+        return x == other.x && y == other.y && width == other.width
+               && height == other.height;
+    }
+};
+
+/*
+    A region of the captured image that is encoded separately with its own
+    quality (see RegionOfInterest in messages.proto)
+ */
+struct RoiSettings {
+    CaptureRegion region;
+    unsigned int quality = 0;
+
+    bool operator==(const RoiSettings& other) const {
+        return region == other.region && quality == other.quality;
+    }
+};
+
+/*
+    An additional image made from the same capture as the image
+    (see OutputSpec in messages.proto)
+ */
+struct OutputSettings {
+    // Part of the captured image (empty = whole image)
+    CaptureRegion crop;
+
+    // Size the crop is scaled to (0 = crop size), multiplied by scale
+    unsigned int width = 0;
+    unsigned int height = 0;
+    float scale = 1;
+    ResizeFilter filter = RESIZE_AREA;
+
+    ImageFormat format = FORMAT_JPEG;
+    unsigned int quality = 0;
+    ChromaSubsampling subsampling = SUBSAMPLING_420;
+
+    bool operator==(const OutputSettings& other) const {
+        return crop == other.crop && width == other.width
+               && height == other.height && scale == other.scale
+               && filter == other.filter && format == other.format
+               && quality == other.quality
+               && subsampling == other.subsampling;
+    }
+};
+
+/*
+    Settings that define how a screenshot should be captured and encoded
+ */
+struct ImageOptions {
+    // Format of the encoded image
+    ImageFormat format = FORMAT_JPEG;
+
+    // Quality of the compressed image (0-100)
+    unsigned int quality = 0;
+
+    // Tensor that is produced in addition to the image
+    TensorSettings tensor;
+
+    // Size the image is scaled to before encoding (0 = captured size)
+    unsigned int width = 0;
+    unsigned int height = 0;
+    ResizeFilter filter = RESIZE_AREA;
+    ResizeBackend resizeBackend = RESIZE_CPU;
+
+    // Factor the image is scaled by after the size above has been applied
+    float scale = 1;
+
+    // Chroma subsampling of jpg images
+    ChromaSubsampling subsampling = SUBSAMPLING_420;
+
+    // Whether large jpg images are encoded in bands in parallel
+    bool jpegBands = false;
+
+    // Part of the window that is captured
+    CaptureRegion region;
+
+    // How the window is read from the X server
+    CaptureBackend captureBackend = CAPTURE_XSHM;
+
+    // XRandR monitor that is captured (0 = whole display)
+    unsigned int monitor = 0;
+
+    // Number of consecutive captures the image is max-pooled over
+    // (0 or 1 = no max-pooling)
+    unsigned int maxPool = 0;
+
+    // Size of the tiles that are compared with the previous capture
+    // (0 = no comparison), and whether only the changed tiles are encoded
+    unsigned int tileSize = 0;
+    bool tilesOnly = false;
+
+    // Regions that are encoded separately in addition to the image
+    std::vector<RoiSettings> rois;
+
+    // Additional images made from the same capture
+    std::vector<OutputSettings> outputs;
+
+    // Names of windows that are cropped from one capture of the whole
+    // display instead of capturing a single window
+    std::vector<std::string> windows;
+
+    // _NET_WM_PID (0 = any) and WM_CLASS (empty = any) of the captured
+    // window, in addition to its name
+    unsigned long windowPid = 0;
+    std::string windowClass;
+
+    bool operator==(const ImageOptions& other) const {
+        return format == other.format && quality == other.quality
+               && tensor == other.tensor && width == other.width
+               && height == other.height && filter == other.filter
+               && resizeBackend == other.resizeBackend
+               && scale == other.scale && subsampling == other.subsampling
+               && jpegBands == other.jpegBands && region == other.region && monitor == other.monitor
+               && maxPool == other.maxPool && tileSize == other.tileSize
+               && tilesOnly == other.tilesOnly && rois == other.rois
+               && outputs == other.outputs && windows == other.windows
+               && windowPid == other.windowPid
+               && windowClass == other.windowClass
+               && captureBackend == other.captureBackend;
+    }
+
+    bool operator!=(const ImageOptions& other) const {
+        return !(*this == other);
+    }
+
+    bool isScaled() const {
+        return width != 0 || height != 0 || scale != 1;
+    }
+};
+
+/*
+    A reusable buffer for an encoded image and its format and dimensions.
+
+    Memory is only allocated when the buffer is too small for the next image,
+    so a buffer that is reused for every frame stops allocating once it has
+    grown to fit the largest frame.
+
+    A few bytes are reserved in front of the image, so that the header of
+    the response message can be written right before the image and both
+    can be sent to the socket without copying the image.
+ */
+class ImageBuffer {
+public:
+    // Number of bytes reserved in front of the image
+    static const size_t HEADROOM = 16;
+
+    /*
+        Makes sure the buffer can hold an image of maxBytes bytes and
+        returns a pointer to where the image should be written.
+        The contents of the buffer are not preserved.
+
+        Throws invalid_argument if the buffer is too small and its size
+        has been fixed (see fixCapacity).
+     */
+    char* reserve(size_t maxBytes) {
+        if (storage.size() < HEADROOM + maxBytes) {
+            if (fixed) {
+                throw std::invalid_argument(
+                    "image needs " + std::to_string(maxBytes) + " bytes, "
+                    "the locked frame buffer only has "
+                    + std::to_string(capacity()));
+            }
+            storage.resize(HEADROOM + maxBytes);
+        }
+
+        imageBytes = 0;
+        return data();
+    }
+
+    /*
+        Keeps the buffer at its current size from now on, so that its
+        memory can be locked: images that don't fit are rejected by
+        reserve instead of moving the buffer to new memory.
+     */
+    void fixCapacity() {
+        fixed = true;
+    }
+
+    /*
+        Returns the size of the largest image the buffer can hold
+        without growing.
+     */
+    size_t capacity() const {
+        return storage.empty() ? 0 : storage.size() - HEADROOM;
+    }
+
+    /*
+        Sets the size of the image that was written to the buffer.
+     */
+    void setSize(size_t bytes) {
+        imageBytes = bytes;
+    }
+
+    /*
+        Sets the format and dimensions of the image in the buffer.
+     */
+    void setInfo(ImageFormat format, unsigned int width, unsigned int height) {
+        imageFormat = format;
+        imageWidth = width;
+        imageHeight = height;
+    }
+
+    /*
+        Returns a pointer to the given number of bytes right before the
+        image. bytes can be at most HEADROOM.
+     */
+    char* header(size_t bytes) {
+        return data() - bytes;
+    }
+
+    char* data() {
+        return storage.empty() ? NULL : &storage[HEADROOM];
+    }
+
+    const char* data() const {
+        return storage.empty() ? NULL : &storage[HEADROOM];
+    }
+
+    size_t size() const {
+        return imageBytes;
+    }
+
+    bool empty() const {
+        return imageBytes == 0;
+    }
+
+    ImageFormat format() const {
+        return imageFormat;
+    }
+
+    unsigned int width() const {
+        return imageWidth;
+    }
+
+    unsigned int height() const {
+        return imageHeight;
+    }
+
+private:
+    std::vector<char> storage;
+    size_t imageBytes = 0;
+    bool fixed = false;
+
+    ImageFormat imageFormat = FORMAT_JPEG;
+    unsigned int imageWidth = 0;
+    unsigned int imageHeight = 0;
+};
+
+// A captured and encoded screenshot
+struct Frame {
+    // Encoded image
+    ImageBuffer image;
+
+    // Tensor, if it was requested in the options
+    ImageBuffer tensor;
+
+    // Time when the capture was started (see getTimestamp in capture.hpp)
+    uint64_t timestamp = 0;
+
+    // Time it took to process and encode the image, in microseconds
+    uint64_t encodeTime = 0;
+
+    // Tiles that changed since the previous capture, if requested
+    TileMap tiles;
+
+    // Offsets of the bands of a jpg image that was encoded in parallel
+    // bands, and the height of the bands (see Response.jpeg_band_offsets)
+    std::vector<uint32_t> bandOffsets;
+    unsigned int bandHeight = 0;
+
+    // Encoded regions of interest and where they are in the captured
+    // image, clipped to it. The buffers are reused between captures, so
+    // there can be more buffers than regions.
+    std::vector<ImageBuffer> roiImages;
+    std::vector<CaptureRegion> roiRegions;
+
+    // Additional outputs in the order of the options (there can be more
+    // buffers than outputs, like with the regions of interest)
+    std::vector<ImageBuffer> outputImages;
+
+    // Images of the windows in the options and where the windows are on
+    // the display (like with the regions of interest)
+    std::vector<ImageBuffer> windowImages;
+    std::vector<CaptureRegion> windowRegions;
+
+    // Damage generation of the window when it was captured
+    // (see getDamageGeneration), 0 if changes are not tracked
+    uint64_t damageGeneration = 0;
+
+    // The window and options the frame was captured with
+    std::string processName;
+    ImageOptions options;
+};
@@ -7,20 +7,17 @@
 #include "platform.hpp"
 #include "keys.hpp"
 
-// Mutex that should be used before accessing the variables defined here
-std::mutex inputMutex;
-
-std::set<std::string> pressedKeys;
-std::set<std::string> releasedKeys;
-std::pair<long, long> mouseDelta = std::pair<long, long>(0, 0);
-
-// Keep track of fake input events we are expecting so they can be filtered out
-std::multiset<std::string> expectedKeyDowns;
-std::multiset<std::string> expectedKeyUps;
-std::deque<std::pair<long, long>> expectedMouseMovement;
-
-// Contains keys that are currently held down as a result of calling sendKey
-std::set<std::string> fakeKeysPressed;
+InputState defaultInput;
+
+std::mutex& inputMutex = defaultInput.mutex;
+std::set<std::string>& pressedKeys = defaultInput.pressedKeys;
+std::set<std::string>& releasedKeys = defaultInput.releasedKeys;
+std::pair<long, long>& mouseDelta = defaultInput.mouseDelta;
+std::multiset<std::string>& expectedKeyDowns = defaultInput.expectedKeyDowns;
+std::multiset<std::string>& expectedKeyUps = defaultInput.expectedKeyUps;
+std::deque<std::pair<long, long>>& expectedMouseMovement =
+    defaultInput.expectedMouseMovement;
+std::set<std::string>& fakeKeysPressed = defaultInput.fakeKeysPressed;
 
 #ifdef _WIN32
     #include <windows.h>
@@ -452,65 +449,67 @@ std::unordered_map<std::string, unsigned int>* getKeysMap() {
     return &keys;
 }
 
-void keyEvent(std::string name, bool down) {
-    std::unique_lock<std::mutex> lock(inputMutex);
+void keyEvent(std::string name, bool down, InputState& state) {
+    std::unique_lock<std::mutex> lock(state.mutex);
 
     if (down) {
         // If the key is in expectedKeyDowns, we know this is a fake event
         // that can be ignored
-        auto keyIter = expectedKeyDowns.find(name);
-        if (keyIter != expectedKeyDowns.end())
-            expectedKeyDowns.erase(keyIter);
+        auto keyIter = state.expectedKeyDowns.find(name);
+        if (keyIter != state.expectedKeyDowns.end())
+            state.expectedKeyDowns.erase(keyIter);
         else {
-            pressedKeys.insert(name);
-            releasedKeys.erase(name);
+            state.pressedKeys.insert(name);
+            state.releasedKeys.erase(name);
             lock.unlock();
-            releaseFakeInputs();
+            releaseFakeInputs(state);
             lock.lock();
         }
     } else {
         // If the key is in expectedKeyUps, we know this is a fake event
         // that can be ignored
-        auto keyIter = expectedKeyUps.find(name);
-        if (keyIter != expectedKeyUps.end())
-            expectedKeyUps.erase(keyIter);
+        auto keyIter = state.expectedKeyUps.find(name);
+        if (keyIter != state.expectedKeyUps.end())
+            state.expectedKeyUps.erase(keyIter);
         else
-            releasedKeys.insert(name);
+            state.releasedKeys.insert(name);
     }
 
     return;
 }
 
-bool isUserPressingKeys() {
-    for (auto key : pressedKeys) {
-        if (releasedKeys.count(key) == 0)
+bool isUserPressingKeys(InputState& state) {
+    for (auto key : state.pressedKeys) {
+        if (state.releasedKeys.count(key) == 0)
             return true;
     }
 
     return false;
 }
 
-void releaseFakeInputs() {
+void releaseFakeInputs(InputState& state) {
     // Make a copy of fakeKeysPressed to use in the for loop,
     // because sendKey removes elements from fakeKeysPressed,
-    // which can break the iterator and cause the loop to never end
-    auto fakeKeysPressedCopy = std::set<std::string>(fakeKeysPressed);
+    // which can break the iterator and cause the loop to never end.
+    // sendKey sends the keys to the display the state belongs to, because
+    // this is called by the event thread of that display.
+    auto fakeKeysPressedCopy = std::set<std::string>(state.fakeKeysPressed);
     for (auto key : fakeKeysPressedCopy)
         sendKey(key, false, false);
 
-    std::lock_guard<std::mutex> lock(inputMutex);
-    fakeKeysPressed.clear();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.fakeKeysPressed.clear();
 }
 
-void mouseEvent(long dx, long dy) {
-    std::lock_guard<std::mutex> lock(inputMutex);
+void mouseEvent(long dx, long dy, InputState& state) {
+    std::lock_guard<std::mutex> lock(state.mutex);
 
-    if (!expectedMouseMovement.empty() &&
-        expectedMouseMovement.back() == std::pair<long, long>(dx, dy))
+    if (!state.expectedMouseMovement.empty() &&
+        state.expectedMouseMovement.back() == std::pair<long, long>(dx, dy))
     {
-        expectedMouseMovement.pop_back();
+        state.expectedMouseMovement.pop_back();
     } else {
-        mouseDelta.first += dx;
-        mouseDelta.second += dy;
+        state.mouseDelta.first += dx;
+        state.mouseDelta.second += dy;
     }
 }
\ No newline at end of file
@@ -2,24 +2,42 @@
 #include <unordered_map>
 #include <deque>
 #include <mutex>
+#include <set>
 
-// Mutex that should be used before accessing the variables defined here
-extern std::mutex inputMutex;
+// Inputs of one display. On Linux/X11 each display has its own state,
+// other platforms only use defaultInput.
+struct InputState {
+    // Mutex that should be used before accessing the variables defined here
+    std::mutex mutex;
 
-// Keep track of keys that have been pressed or released since last request
-extern std::set<std::string> pressedKeys;
-extern std::set<std::string> releasedKeys;
+    // Keep track of keys that have been pressed or released since last request
+    std::set<std::string> pressedKeys;
+    std::set<std::string> releasedKeys;
 
-// Keep track of the total mouse delta since last request
-extern std::pair<long, long> mouseDelta;
+    // Keep track of the total mouse delta since last request
+    std::pair<long, long> mouseDelta = std::pair<long, long>(0, 0);
 
-// Keep track of fake input events we are expecting so they can be filtered out
-extern std::multiset<std::string> expectedKeyDowns;
-extern std::multiset<std::string> expectedKeyUps;
-extern std::deque<std::pair<long, long>> expectedMouseMovement;
+    // Keep track of fake input events we are expecting so they can be
+    // filtered out
+    std::multiset<std::string> expectedKeyDowns;
+    std::multiset<std::string> expectedKeyUps;
+    std::deque<std::pair<long, long>> expectedMouseMovement;
 
-// Contains keys that are currently held down as a result of calling sendKey
-extern std::set<std::string> fakeKeysPressed;
+    // Contains keys that are currently held down as a result of calling sendKey
+    std::set<std::string> fakeKeysPressed;
+};
+
+extern InputState defaultInput;
+
+// The variables of defaultInput
+extern std::mutex& inputMutex;
+extern std::set<std::string>& pressedKeys;
+extern std::set<std::string>& releasedKeys;
+extern std::pair<long, long>& mouseDelta;
+extern std::multiset<std::string>& expectedKeyDowns;
+extern std::multiset<std::string>& expectedKeyUps;
+extern std::deque<std::pair<long, long>>& expectedMouseMovement;
+extern std::set<std::string>& fakeKeysPressed;
 
 /*
     Returns the platform-specific key code for the given key name.
@@ -39,23 +57,23 @@ std::unordered_map<std::string, unsigned int>* getKeysMap();
 
 /*
     This function should be called whenever there is a new key up/down event.
-    Maintains the pressedKeys and releasedKeys sets.
+    Maintains the pressedKeys and releasedKeys sets of the given state.
     Also ignores known fake events.
 */
-void keyEvent(std::string name, bool down);
+void keyEvent(std::string name, bool down, InputState& state = defaultInput);
 
 /*
     Returns true if the real user is holding any keys on the keyboard or mouse.
 */
-bool isUserPressingKeys();
+bool isUserPressingKeys(InputState& state = defaultInput);
 
 /*
     Releases all keys that are held down by the sendKey function.
 */
-void releaseFakeInputs();
+void releaseFakeInputs(InputState& state = defaultInput);
 
 /*
     This function should be called whenever there is a new mouse movement event.
-    Maintains mouseDelta and filters out fake events.
+    Maintains mouseDelta of the given state and filters out fake events.
 */
-void mouseEvent(long dx, long dy);
\ No newline at end of file
+void mouseEvent(long dx, long dy, InputState& state = defaultInput);
\ No newline at end of file
@@ -1,42 +1,406 @@
 #include <iostream>
 #include <set>
+#include <map>
+#include <list>
 #include <deque>
 #include <cstring>
+#include <cstdlib>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <fstream>
+#include <cerrno>
+
+// The protobuf headers (included through image.hpp) have to be included
+// before the X11 headers, because Xlib defines Status as a macro
+#include "image.hpp"
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/XKBlib.h>
+#include <X11/Xatom.h>
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/XTest.h>
 #include <X11/extensions/XInput2.h>
+#include <X11/extensions/Xrender.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xcomposite.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/shm.h>
+#include <X11/XWDFile.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
-#include <turbojpeg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "keys.hpp"
 #include "platform.hpp"
+#include "encode.hpp"
+
+// Rectangle of the window that is captured
+struct CaptureArea {
+    int x;
+    int y;
+    unsigned int width;
+    unsigned int height;
+};
+
+// Maximum number of shared memory images kept for each display, and how
+// long an image can stay unused before it is freed (see acquireShm)
+const size_t SHM_POOL_SIZE = 4;
+const std::chrono::seconds SHM_IDLE_TIME(30);
+
+// Shared memory image in the SHM pool of a display (see acquireShm).
+// The image is only a header for the segment, so it is recreated whenever
+// the size changes, and the segment is only replaced when it is too small.
+struct ShmSegment {
+    XShmSegmentInfo shmInfo;
+    XImage* image = NULL;
+
+    // Size of the segment in bytes
+    size_t capacity = 0;
+
+    // Window the segment was last used for and when
+    Window window = None;
+    std::chrono::steady_clock::time_point lastUsed;
+};
+
+// Window that is redirected offscreen with XComposite (see getWindowPixmap)
+struct CompositeWindow {
+    // Pixmap of the window contents (including the border), and the size
+    // of the window when it was named
+    Pixmap pixmap = None;
+    unsigned int width = 0;
+    unsigned int height = 0;
+};
+
+// Properties of a window in the window index (see indexWindow)
+struct WindowEntry {
+    Window parent = None;
+    bool mapped = false;
+
+    // Current size of the window, its position (the outer corner of the
+    // border) inside its parent and its border width, updated from
+    // ConfigureNotify events
+    unsigned int width = 0;
+    unsigned int height = 0;
+    int x = 0;
+    int y = 0;
+    unsigned int border = 0;
+
+    // Depth and visual, which never change. Read when they are first
+    // needed (0 = not read yet), since the create events don't have them.
+    int depth = 0;
+    Visual* visual = NULL;
+
+    // WM_NAME
+    std::string name;
+
+    // WM_CLASS
+    std::string instanceName;
+    std::string className;
+
+    // _NET_WM_PID (0 = not set)
+    unsigned long pid = 0;
+};
+
+// Where a window is on the root window, from the window index
+// (see getIndexedGeometry)
+struct WindowGeometry {
+    // Position of the inside of the window on the root window
+    int x = 0;
+    int y = 0;
+
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int border = 0;
+
+    // 0 and NULL if not read yet (see readWindowVisual)
+    int depth = 0;
+    Visual* visual = NULL;
+};
+
+// Connection to one X display and everything captured from it.
+// Each display has its own event thread, which records its inputs.
+struct DisplayContext {
+    std::string name;
+
+    Display* display = NULL;
+    Display* eventDisplay = NULL;
+    Window root = None;
+
+    // XCB connection of display, for sending requests without waiting
+    // for the reply of each (see CAPTURE_XCB)
+    xcb_connection_t* connection = NULL;
+
+    // Shared memory images of the recently captured windows, the most
+    // recently used first. A list, because the X server refers to the
+    // XShmSegmentInfo of an image, so the segments must not move.
+    std::list<ShmSegment> shmPool;
+
+    Window cachedWindow = None;
+    std::string cachedName;
+    unsigned long cachedPid = 0;
+    std::string cachedClass;
+
+    // Size and depth of the cached window. The size is kept up to date
+    // from the window index (see getIndexedSize).
+    unsigned int windowWidth = 0;
+    unsigned int windowHeight = 0;
+    unsigned int windowDepth = 0;
+    unsigned int windowBorder = 0;
+    Screen* windowScreen = NULL;
+
+    // Encoder of the captures of this display, with its max-pooling and
+    // tile state, which is reset when another window is captured or the
+    // window is resized
+    EncodeState encodeState;
+
+    bool hasXRandR = false;
+
+    // Windows captured from their own pixmaps (see CAPTURE_COMPOSITE).
+    // They stay redirected until they are destroyed or the display is
+    // closed, so capturing them again doesn't have to redirect them again.
+    bool hasXComposite = false;
+    std::map<Window, CompositeWindow> compositeWindows;
+
+    // Images of the windows of a composite or XCB multi-window capture,
+    // and the other state of multi-window captures. Kept between captures,
+    // so that capturing doesn't allocate once they have grown.
+    std::vector<RawImage> windowRaws;
+    std::vector<CaptureRegion> windowCrops;
+    std::vector<Window> windowIds;
+    std::vector<WindowGeometry> windowGeometries;
+    std::vector<xcb_get_geometry_cookie_t> geometryCookies;
+    std::vector<xcb_translate_coordinates_cookie_t> positionCookies;
+    std::vector<xcb_shm_get_image_cookie_t> imageCookies;
+
+    // Framebuffer file of Xvfb mapped into memory, and its pixels
+    // (see CAPTURE_FRAMEBUFFER)
+    void* framebufferFile = NULL;
+    size_t framebufferFileSize = 0;
+    RawImage framebuffer;
+
+    // All windows of the display, so they can be found without asking
+    // the X server. Built when the display is opened and kept up to date
+    // by the event thread.
+    std::map<Window, WindowEntry> windowIndex;
+    std::mutex windowIndexMutex;
+    Atom pidAtom = None;
+
+    bool stopThread = false;
+
+    // Server-side scaling with XRender (see getScaledScreenshot)
+    bool hasXRender = false;
+    XShmSegmentInfo scaledShmInfo;
+    XImage* scaledImage = NULL;
+    Pixmap scaledPixmap = None;
+    Picture scaledPicture = None;
+    Picture windowPicture = None;
+    Window pictureWindow = None;
+
+    // Damage tracking of the captured window (see getDamageGeneration).
+    // The damage object belongs to eventDisplay, so its events are received
+    // by the event thread.
+    bool hasXDamage = false;
+    int damageEventBase = 0;
+    Damage damage = None;
+    std::mutex damageMutex;
+    std::condition_variable damageChanged;
+    uint64_t damageGeneration = 0;
+
+    // Inputs recorded by the event thread and sent with XTest
+    InputState input;
+};
+
+// Displays that have been opened, by name (see selectDisplay)
+std::map<std::string, DisplayContext*> contexts;
+std::mutex contextsMutex;
+
+// Display selected by the current thread
+thread_local DisplayContext* context = NULL;
+
+// -fbdir directory of Xvfb (see setFramebufferDir)
+std::string framebufferDir;
+
+// Size of the huge pages that shared memory is allocated in, 0 when
+// huge pages are not used (see enableHugePages)
+size_t hugePageSize = 0;
+
+void freeShmSegment(ShmSegment* segment) {
+    /*
+        Detaches the segment from X and from our process, which frees it
+        (see allocateShmSegment)
+     */
+
+    if (segment->capacity == 0)
+        return;
+
+    XShmDetach(context->display, &segment->shmInfo);
+    shmdt(segment->shmInfo.shmaddr);
+    segment->capacity = 0;
+}
+
+int createShm(size_t bytes) {
+    /*
+        Creates a shared memory segment of at least the given size, in huge
+        pages if they are enabled and there are enough of them left
+     */
+
+    if (hugePageSize != 0) {
+        size_t rounded = (bytes + hugePageSize - 1) / hugePageSize
+                         * hugePageSize;
+        int shmid = shmget(IPC_PRIVATE, rounded, IPC_CREAT|SHM_HUGETLB|0777);
+        if (shmid != -1)
+            return shmid;
+    }
+
+    return shmget(IPC_PRIVATE, bytes, IPC_CREAT|0777);
+}
+
+void allocateShmSegment(ShmSegment* segment, size_t bytes) {
+    /*
+        Replaces the shared memory of the segment with a new segment
+        of the given size.
+     */
+
+    freeShmSegment(segment);
+
+    XShmSegmentInfo* shmInfo = &segment->shmInfo;
+    shmInfo->shmid = createShm(bytes);
+    if (shmInfo->shmid == -1)
+        throw std::invalid_argument("could not allocate shared memory");
+
+    // Attach shared memory to our process
+    shmInfo->shmaddr = (char*)shmat(shmInfo->shmid, 0, 0);
+    if (shmInfo->shmaddr == (char*)-1) {
+        shmctl(shmInfo->shmid, IPC_RMID, 0);
+        throw std::invalid_argument("could not attach shared memory");
+    }
+
+    // Allow writing to the memory segment
+    shmInfo->readOnly = false;
+
+    // Attach X to the shared memory
+    XShmAttach(context->display, shmInfo);
+
+    // Once X has attached to the segment, it can be marked for removal.
+    // It is then freed when both have detached from it, even if the
+    // process is killed.
+    XSync(context->display, False);
+    shmctl(shmInfo->shmid, IPC_RMID, 0);
+
+    segment->capacity = bytes;
+}
+
+void freeShmPool() {
+    for (ShmSegment& segment : context->shmPool) {
+        freeShmSegment(&segment);
+        if (segment.image != NULL)
+            XDestroyImage(segment.image);
+    }
+    context->shmPool.clear();
+}
+
+bool isIndexed(Window window);
+
+XImage* acquireShm(Window window, unsigned int width, unsigned int height) {
+    /*
+        Returns a shared memory image of the given size for capturing the
+        given window, with the depth of the cached window.
+
+        The images are kept in a pool of the SHM_POOL_SIZE most recently
+        used windows, so switching between a few windows neither allocates
+        nor leaks shared memory. The segment of the window is reused if it
+        is large enough for the new size. A new window takes the segment
+        of the least recently used one when the pool is full. Segments that
+        have not been used for SHM_IDLE_TIME, or whose window has been
+        destroyed, are freed.
+
+        Throws invalid_argument if the image or its shared memory could
+        not be created.
+     */
 
-XShmSegmentInfo shmInfo;
-Display* display;
-Display* eventDisplay;
-XImage* image;
-Window root;
+    std::list<ShmSegment>& pool = context->shmPool;
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
 
-Window cachedWindow;
-std::string cachedName;
+    auto found = pool.begin();
+    while (found != pool.end() && found->window != window)
+        found++;
 
-bool stopThread = false;
+    if (found == pool.end()) {
+        if (pool.size() < SHM_POOL_SIZE)
+            pool.emplace_front();
+        else
+            pool.splice(pool.begin(), pool, std::prev(pool.end()));
+        pool.front().window = window;
+    } else {
+        pool.splice(pool.begin(), pool, found);
+    }
+
+    ShmSegment* segment = &pool.front();
+    segment->lastUsed = now;
+
+    // Free the segments that aren't needed anymore
+    for (auto it = std::next(pool.begin()); it != pool.end();) {
+        if (now - it->lastUsed > SHM_IDLE_TIME
+            || (it->window != context->root && !isIndexed(it->window))) {
+            freeShmSegment(&*it);
+            if (it->image != NULL)
+                XDestroyImage(it->image);
+            it = pool.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    XImage* image = segment->image;
+    if (image != NULL && segment->capacity != 0
+        && image->width == (int)width && image->height == (int)height
+        && image->depth == (int)context->windowDepth)
+        return image;
+
+    // The image is only a header, XDestroyImage doesn't free the segment
+    if (image != NULL)
+        XDestroyImage(image);
+
+    image = XShmCreateImage(context->display,
+                            DefaultVisualOfScreen(context->windowScreen),
+                            context->windowDepth, ZPixmap, NULL,
+                            &segment->shmInfo, width, height);
+    segment->image = image;
+    if (image == NULL)
+        throw std::invalid_argument("could not create a shared memory image");
+
+    size_t bytes = (size_t)image->bytes_per_line * image->height;
+    if (bytes > segment->capacity)
+        allocateShmSegment(segment, bytes);
+
+    image->data = segment->shmInfo.shmaddr;
+    return image;
+}
 
 void initShm(Window window) {
     /*
-        Initializes SHM for the given window
+        Reads the size, depth and screen of the given window, which are
+        used for its shared memory images (see acquireShm).
+        Throws invalid_argument if the window doesn't exist anymore.
      */
 
     // Get window attributes
     XWindowAttributes windowAttributes;
-    XGetWindowAttributes(display, window, &windowAttributes);
-    Screen* screen = windowAttributes.screen;
+    if (XGetWindowAttributes(context->display, window,
+                             &windowAttributes) == 0) {
+        throw std::invalid_argument("window not found");
+    }
+    context->windowScreen = windowAttributes.screen;
 
     // Get window size and depth
     Window root_return;
@@ -46,53 +410,930 @@ void initShm(Window window) {
     unsigned int height_return;
     unsigned int border_width_return;
     unsigned int depth_return;
-    XGetGeometry(display, window, &root_return, &x_return, &y_return,
-                 &width_return, &height_return, &border_width_return,
-                 &depth_return);
+    if (XGetGeometry(context->display, window, &root_return, &x_return,
+                     &y_return, &width_return, &height_return,
+                     &border_width_return, &depth_return) == 0) {
+        throw std::invalid_argument("window not found");
+    }
 
-    int width = width_return;
-    int height = height_return;
+    context->windowWidth = width_return;
+    context->windowHeight = height_return;
+    context->windowDepth = depth_return;
+    context->windowBorder = border_width_return;
+}
 
-    // Create shared memory image
-    image = XShmCreateImage(display, DefaultVisualOfScreen(screen),
-                            depth_return, ZPixmap, NULL,
-                            &shmInfo, width, height);
+bool getIndexedSize(Window window, unsigned int* width, unsigned int* height) {
+    /*
+        Gets the current size of the window from the window index.
+        Returns false if the window isn't in the index.
+     */
 
-    // Create shared memory
-    shmInfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height,
-                           IPC_CREAT|0777);
+    std::lock_guard<std::mutex> lock(context->windowIndexMutex);
 
-    // Attach shared memory to our process
-    shmInfo.shmaddr = image->data = (char*)shmat(shmInfo.shmid, 0, 0);
+    auto found = context->windowIndex.find(window);
+    if (found == context->windowIndex.end())
+        return false;
 
-    // Allow writing to the memory segment
-    shmInfo.readOnly = false;
+    *width = found->second.width;
+    *height = found->second.height;
+    return true;
+}
 
-    // Attach X to the shared memory
-    Status status = XShmAttach(display, &shmInfo);
+void getCaptureArea(Window window, unsigned int width, unsigned int height,
+                    const ImageOptions& options, CaptureArea* area) {
+    /*
+        Finds the rectangle of the window that should be captured:
+        the monitor and region given in options, or the whole window.
+
+        Parameters:
+            window: window that is captured
+            width, height: current size of the window
+            options: monitor and region to capture
+            area: receives the rectangle in window coordinates
+     */
+
+    area->x = 0;
+    area->y = 0;
+    area->width = width;
+    area->height = height;
+
+    // Limit the area to the given monitor
+    if (options.monitor != 0) {
+        if (window != context->root) {
+            throw std::invalid_argument("a monitor can only be selected when "
+                                        "capturing the whole display");
+        }
+        if (!context->hasXRandR)
+            throw std::invalid_argument("XRandR extension not available");
+
+        int count;
+        XRRMonitorInfo* monitors = XRRGetMonitors(context->display,
+                                                  context->root, True, &count);
+        if (monitors == NULL || (int)options.monitor > count) {
+            if (monitors != NULL)
+                XRRFreeMonitors(monitors);
+            throw std::invalid_argument("monitor not found");
+        }
+
+        XRRMonitorInfo& monitor = monitors[options.monitor - 1];
+        area->x = monitor.x;
+        area->y = monitor.y;
+        area->width = monitor.width;
+        area->height = monitor.height;
+        XRRFreeMonitors(monitors);
+    }
+
+    // Limit the area to the given region, clipped to the window/monitor
+    const CaptureRegion& region = options.region;
+    if (region.width != 0 && region.height != 0) {
+        long left = std::max<long>(region.x, 0);
+        long top = std::max<long>(region.y, 0);
+        long right = std::min<long>((long)region.x + region.width,
+                                    area->width);
+        long bottom = std::min<long>((long)region.y + region.height,
+                                     area->height);
+
+        if (right <= left || bottom <= top)
+            throw std::invalid_argument("region is outside the window");
+
+        area->x += left;
+        area->y += top;
+        area->width = right - left;
+        area->height = bottom - top;
+    }
+}
+
+std::string getDisplayNumber() {
+    /*
+        Returns the number of the display, for example "1" for ":1.0"
+     */
+
+    std::string name = XDisplayString(context->display);
+    size_t colon = name.rfind(':');
+    if (colon == std::string::npos)
+        return "";
+
+    size_t dot = name.find('.', colon);
+    if (dot == std::string::npos)
+        dot = name.length();
+    return name.substr(colon + 1, dot - colon - 1);
+}
+
+void mapFramebuffer() {
+    /*
+        Maps the framebuffer file that Xvfb writes to the directory set with
+        setFramebufferDir into memory, if there is one for the display.
+        The file is an XWD image whose pixels Xvfb draws to directly.
+     */
+
+    if (framebufferDir.empty())
+        return;
+
+    std::string dir = framebufferDir;
+    size_t placeholder = dir.find("%d");
+    if (placeholder != std::string::npos)
+        dir.replace(placeholder, 2, getDisplayNumber());
+
+    std::string path = dir + "/Xvfb_screen"
+                       + std::to_string(DefaultScreen(context->display));
+
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if (fd == -1 || fstat(fd, &fileStat) != 0
+        || (size_t)fileStat.st_size < sz_XWDheader) {
+        if (fd != -1)
+            close(fd);
+        std::cout << "Xvfb framebuffer " << path << " not available!"
+                  << std::endl;
+        return;
+    }
+
+    void* file = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        std::cout << "Could not map Xvfb framebuffer " << path << std::endl;
+        return;
+    }
+
+    // The header is big-endian, like in other XWD files
+    XWDFileHeader header;
+    memcpy(&header, file, sz_XWDheader);
+    if (header.file_version != XWD_FILE_VERSION) {
+        CARD32* fields = (CARD32*)&header;
+        for (size_t i = 0; i < sz_XWDheader / 4; i++)
+            fields[i] = __builtin_bswap32(fields[i]);
+    }
+
+    // Only the 32-bit BGRX format of other captures is supported
+    size_t offset = header.header_size + header.ncolors * sz_XWDColor;
+    if (header.file_version != XWD_FILE_VERSION
+        || header.pixmap_format != ZPixmap || header.bits_per_pixel != 32
+        || header.byte_order != LSBFirst || header.red_mask != 0xff0000
+        || header.green_mask != 0xff00 || header.blue_mask != 0xff
+        || offset + (size_t)header.bytes_per_line * header.pixmap_height
+           > (size_t)fileStat.st_size) {
+        munmap(file, fileStat.st_size);
+        std::cout << "Xvfb framebuffer " << path << " has an unsupported "
+                  << "format!" << std::endl;
+        return;
+    }
+
+    context->framebufferFile = file;
+    context->framebufferFileSize = fileStat.st_size;
+    context->framebuffer.data = (const char*)file + offset;
+    context->framebuffer.width = header.pixmap_width;
+    context->framebuffer.height = header.pixmap_height;
+    context->framebuffer.stride = header.bytes_per_line;
+
+    std::cout << "Capturing from Xvfb framebuffer " << path << std::endl;
+}
+
+bool getFramebufferImage(long x, long y, unsigned int width,
+                         unsigned int height, RawImage* raw) {
+    /*
+        Points raw to the given rectangle of the Xvfb framebuffer, without
+        copying it. Returns false if the rectangle is outside the
+        framebuffer.
+     */
+
+    const RawImage& framebuffer = context->framebuffer;
+    if (x < 0 || y < 0 || x + width > framebuffer.width
+        || y + height > framebuffer.height) {
+        return false;
+    }
+
+    raw->data = framebuffer.data + y * framebuffer.stride + x * 4;
+    raw->width = width;
+    raw->height = height;
+    raw->stride = framebuffer.stride;
+    return true;
+}
+
+void releaseCompositeWindows() {
+    /*
+        Frees the pixmaps of the redirected windows that have been destroyed
+     */
+
+    auto it = context->compositeWindows.begin();
+    while (it != context->compositeWindows.end()) {
+        if (isIndexed(it->first)) {
+            it++;
+            continue;
+        }
+
+        if (it->second.pixmap != None)
+            XFreePixmap(context->display, it->second.pixmap);
+        it = context->compositeWindows.erase(it);
+    }
+}
+
+Pixmap getWindowPixmap(Window window, unsigned int width,
+                       unsigned int height, bool refresh) {
+    /*
+        Returns the pixmap that the X server draws the given window into,
+        after redirecting the window offscreen with XComposite if it isn't
+        redirected yet. The window gets a new pixmap whenever it is resized
+        or mapped again, so the pixmap is named again if the size has
+        changed since, or if refresh is set.
+     */
+
+    auto found = context->compositeWindows.find(window);
+    if (found == context->compositeWindows.end()) {
+        releaseCompositeWindows();
+
+        // With automatic redirection the X server still draws the window
+        // on the screen, so nothing changes for the user
+        XCompositeRedirectWindow(context->display, window,
+                                 CompositeRedirectAutomatic);
+        found = context->compositeWindows.insert(
+            std::make_pair(window, CompositeWindow())).first;
+    }
+
+    CompositeWindow& composite = found->second;
+    if (composite.pixmap != None && !refresh && composite.width == width
+        && composite.height == height) {
+        return composite.pixmap;
+    }
+
+    if (composite.pixmap != None)
+        XFreePixmap(context->display, composite.pixmap);
+
+    composite.pixmap = XCompositeNameWindowPixmap(context->display, window);
+    composite.width = width;
+    composite.height = height;
+    return composite.pixmap;
+}
+
+void freeCompositeWindows() {
+    for (auto& redirected : context->compositeWindows) {
+        if (redirected.second.pixmap != None)
+            XFreePixmap(context->display, redirected.second.pixmap);
+        XCompositeUnredirectWindow(context->display, redirected.first,
+                                   CompositeRedirectAutomatic);
+    }
+    context->compositeWindows.clear();
+}
+
+void freeScaledShm() {
+    /*
+        Frees the pixmap and shared memory image used for XRender scaling
+     */
+
+    if (context->scaledImage == NULL)
+        return;
+
+    XRenderFreePicture(context->display, context->scaledPicture);
+    XFreePixmap(context->display, context->scaledPixmap);
+    XShmDetach(context->display, &context->scaledShmInfo);
+    XDestroyImage(context->scaledImage);
+    shmdt(context->scaledShmInfo.shmaddr);
+
+    context->scaledImage = NULL;
+}
+
+void initScaledShm(unsigned int width, unsigned int height) {
+    /*
+        Initializes a pixmap that XRender scales the window into and
+        a shared memory image of the same size that the pixmap is
+        copied to. Both are reused while the scaled size stays the same.
+     */
+
+    if (context->scaledImage != NULL
+        && context->scaledImage->width == (int)width
+        && context->scaledImage->height == (int)height)
+        return;
+
+    freeScaledShm();
+
+    // The pixmap always has 24-bit depth, so the image has the same BGRX
+    // format as other screenshots even if the window has an alpha channel
+    Display* display = context->display;
+    Screen* screen = DefaultScreenOfDisplay(display);
+    XShmSegmentInfo* shmInfo = &context->scaledShmInfo;
+    XImage* image = XShmCreateImage(display, DefaultVisualOfScreen(screen), 24,
+                                    ZPixmap, NULL, shmInfo, width, height);
+    if (image == NULL)
+        throw std::invalid_argument("could not create a shared memory image");
+
+    shmInfo->shmid = createShm(image->bytes_per_line * height);
+    if (shmInfo->shmid == -1) {
+        XDestroyImage(image);
+        throw std::invalid_argument("could not allocate shared memory");
+    }
+
+    shmInfo->shmaddr = (char*)shmat(shmInfo->shmid, 0, 0);
+    if (shmInfo->shmaddr == (char*)-1) {
+        shmctl(shmInfo->shmid, IPC_RMID, 0);
+        XDestroyImage(image);
+        throw std::invalid_argument("could not attach shared memory");
+    }
+
+    image->data = shmInfo->shmaddr;
+    shmInfo->readOnly = false;
+    XShmAttach(display, shmInfo);
+
+    // Freed when both have detached, even if the process is killed
+    // (see allocateShmSegment)
+    XSync(display, False);
+    shmctl(shmInfo->shmid, IPC_RMID, 0);
+
+    context->scaledImage = image;
+
+    context->scaledPixmap = XCreatePixmap(display, context->root,
+                                          width, height, 24);
+    context->scaledPicture = XRenderCreatePicture(
+        display, context->scaledPixmap,
+        XRenderFindStandardFormat(display, PictStandardRGB24), 0, NULL);
+}
+
+void initWindowPicture(Window window) {
+    /*
+        Initializes an XRender picture of the given window, including
+        its child windows
+     */
+
+    if (context->windowPicture != None && context->pictureWindow == window)
+        return;
+
+    if (context->windowPicture != None)
+        XRenderFreePicture(context->display, context->windowPicture);
+
+    XWindowAttributes attrs;
+    XGetWindowAttributes(context->display, window, &attrs);
+
+    XRenderPictureAttributes pictureAttrs;
+    pictureAttrs.subwindow_mode = IncludeInferiors;
+    context->windowPicture = XRenderCreatePicture(
+        context->display, window,
+        XRenderFindVisualFormat(context->display, attrs.visual),
+        CPSubwindowMode, &pictureAttrs);
+    context->pictureWindow = window;
+}
+
+unsigned long getScaledScreenshot(Window window, Frame* frame,
+                                  const ImageOptions& options) {
+    /*
+        Takes a screenshot of the window scaled by the X server.
+
+        XRender scales the window into a pixmap of the requested size, and
+        only the scaled pixmap is copied to shared memory, which reduces
+        the memory traffic by the square of the scaling factor.
+     */
+
+    // Get the current size of the window. This also fails if the window
+    // doesn't exist anymore
+    Window rootReturn;
+    int x, y;
+    unsigned int currentWidth, currentHeight, border, depth;
+    if (XGetGeometry(context->display, window, &rootReturn, &x, &y,
+                     &currentWidth, &currentHeight, &border, &depth) == 0) {
+        throw std::invalid_argument("window not found");
+    }
+
+    CaptureArea area;
+    getCaptureArea(window, currentWidth, currentHeight, options, &area);
+
+    unsigned int width, height;
+    getScaledSize(area.width, area.height, options, &width, &height);
+
+    initScaledShm(width, height);
+    initWindowPicture(window);
+
+    // The transform maps the pixels of the pixmap to the captured area
+    // of the window
+    XTransform transform = {{
+        { XDoubleToFixed((double)area.width / width), 0,
+          XDoubleToFixed(area.x) },
+        { 0, XDoubleToFixed((double)area.height / height),
+          XDoubleToFixed(area.y) },
+        { 0, 0, XDoubleToFixed(1) }
+    }};
+    XRenderSetPictureTransform(context->display, context->windowPicture,
+                               &transform);
+
+    const char* filter = FilterBest;
+    if (options.filter == RESIZE_NEAREST)
+        filter = FilterNearest;
+    else if (options.filter == RESIZE_BILINEAR)
+        filter = FilterBilinear;
+    XRenderSetPictureFilter(context->display, context->windowPicture, filter,
+                            NULL, 0);
+
+    XRenderComposite(context->display, PictOpSrc, context->windowPicture, None,
+                     context->scaledPicture, 0, 0, 0, 0, 0, 0, width, height);
+
+    if (XShmGetImage(context->display, context->scaledPixmap,
+                     context->scaledImage, 0, 0, 0x00ffffff) == 0) {
+        throw std::invalid_argument("window not found");
+    }
+
+    RawImage raw;
+    raw.data = context->scaledImage->data;
+    raw.width = width;
+    raw.height = height;
+    raw.stride = context->scaledImage->bytes_per_line;
+
+    // The image is already at the requested size
+    ImageOptions encodeOptions = options;
+    encodeOptions.width = 0;
+    encodeOptions.height = 0;
+    encodeOptions.scale = 1;
+
+    return encodeFrame(raw, encodeOptions, &context->encodeState, frame);
+}
+
+void trackDamage(Window window) {
+    /*
+        Starts tracking the damage of the given window instead of the
+        previously tracked window. The generation is incremented, because
+        the new window has not been captured yet.
+     */
+
+    if (!context->hasXDamage)
+        return;
+
+    if (context->damage != None)
+        XDamageDestroy(context->eventDisplay, context->damage);
+
+    // Only one event is sent until the damage is subtracted again
+    context->damage = XDamageCreate(context->eventDisplay, window,
+                                    XDamageReportNonEmpty);
+    XFlush(context->eventDisplay);
+
+    {
+        std::lock_guard<std::mutex> lock(context->damageMutex);
+        context->damageGeneration++;
+    }
+    context->damageChanged.notify_all();
+}
+
+void damageEvent(XDamageNotifyEvent* event) {
+    /*
+        Called by the event thread when the tracked window was drawn to
+     */
+
+    // Subtracting the damage re-arms the damage object for the next event
+    XDamageSubtract(context->eventDisplay, event->damage, None, None);
+
+    {
+        std::lock_guard<std::mutex> lock(context->damageMutex);
+        context->damageGeneration++;
+    }
+    context->damageChanged.notify_all();
+}
+
+uint64_t getDamageGeneration() {
+    if (!context->hasXDamage)
+        return 0;
+
+    std::lock_guard<std::mutex> lock(context->damageMutex);
+    return context->damageGeneration;
+}
+
+uint64_t waitForDamage(uint64_t generation, unsigned int timeout) {
+    if (!context->hasXDamage || generation == 0)
+        return getDamageGeneration();
+
+    std::unique_lock<std::mutex> lock(context->damageMutex);
+    context->damageChanged.wait_for(
+        lock, std::chrono::milliseconds(timeout),
+        [&]{ return context->damageGeneration != generation; });
+    return context->damageGeneration;
+}
+
+void readWindowProperty(Window window, Atom property, WindowEntry* entry) {
+    /*
+        Reads the given property (WM_NAME, WM_CLASS or _NET_WM_PID) of the
+        window into the entry. Called by the event thread, or before it
+        has started.
+     */
+
+    Display* display = context->eventDisplay;
+
+    if (property == XA_WM_NAME) {
+        entry->name.clear();
+
+        XTextProperty text;
+        if (XGetWMName(display, window, &text) > 0 && text.value != NULL) {
+            entry->name = (char*)text.value;
+            XFree(text.value);
+        }
+    } else if (property == XA_WM_CLASS) {
+        entry->instanceName.clear();
+        entry->className.clear();
+
+        XClassHint hint;
+        if (XGetClassHint(display, window, &hint) != 0) {
+            if (hint.res_name != NULL) {
+                entry->instanceName = hint.res_name;
+                XFree(hint.res_name);
+            }
+            if (hint.res_class != NULL) {
+                entry->className = hint.res_class;
+                XFree(hint.res_class);
+            }
+        }
+    } else if (property == context->pidAtom) {
+        entry->pid = 0;
+
+        Atom type;
+        int format;
+        unsigned long count;
+        unsigned long bytesAfter;
+        unsigned char* data = NULL;
+        if (XGetWindowProperty(display, window, property, 0, 1, False,
+                               XA_CARDINAL, &type, &format, &count,
+                               &bytesAfter, &data) == Success
+            && data != NULL) {
+            // 32-bit properties are returned as longs
+            if (format == 32 && count == 1)
+                entry->pid = *(unsigned long*)data;
+            XFree(data);
+        }
+    }
+}
+
+void indexWindow(Window window, WindowEntry entry) {
+    /*
+        Adds the window and all of its children to the window index and
+        selects the events that keep them up to date. The events are
+        selected before anything is read, so no change can be missed.
+        The entry has the parent, map state and geometry of the window,
+        and its properties are read here.
+     */
+
+    // Other windows are configured (resized) through the substructure
+    // events of their parent, but the root window has no parent
+    long eventMask = SubstructureNotifyMask | PropertyChangeMask;
+    if (window == context->root)
+        eventMask |= StructureNotifyMask;
+
+    Display* display = context->eventDisplay;
+    XSelectInput(display, window, eventMask);
+
+    readWindowProperty(window, XA_WM_NAME, &entry);
+    readWindowProperty(window, XA_WM_CLASS, &entry);
+    readWindowProperty(window, context->pidAtom, &entry);
+
+    {
+        std::lock_guard<std::mutex> lock(context->windowIndexMutex);
+        context->windowIndex[window] = entry;
+    }
+
+    // Children may have been created before the events were selected
+    Window rootReturn;
+    Window parentReturn;
+    Window* children;
+    unsigned int count;
+    if (XQueryTree(display, window, &rootReturn, &parentReturn,
+                   &children, &count) == 0) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        XWindowAttributes attrs;
+        if (XGetWindowAttributes(display, children[i], &attrs) == 0)
+            continue;
+
+        WindowEntry child;
+        child.parent = window;
+        child.mapped = attrs.map_state != IsUnmapped;
+        child.width = attrs.width;
+        child.height = attrs.height;
+        child.x = attrs.x;
+        child.y = attrs.y;
+        child.border = attrs.border_width;
+        child.depth = attrs.depth;
+        child.visual = attrs.visual;
+        indexWindow(children[i], child);
+    }
+
+    if (children != NULL)
+        XFree(children);
+}
+
+bool windowIndexEvent(XEvent* event) {
+    /*
+        Updates the window index from an event received by the event thread.
+        Returns false if the event isn't about the windows.
+     */
+
+    std::unique_lock<std::mutex> lock(context->windowIndexMutex);
+    std::map<Window, WindowEntry>& index = context->windowIndex;
+
+    switch (event->type) {
+        case CreateNotify: {
+            lock.unlock();
+
+            const XCreateWindowEvent& created = event->xcreatewindow;
+            WindowEntry entry;
+            entry.parent = created.parent;
+            entry.width = created.width;
+            entry.height = created.height;
+            entry.x = created.x;
+            entry.y = created.y;
+            entry.border = created.border_width;
+            indexWindow(created.window, entry);
+            return true;
+        }
+
+        case DestroyNotify:
+            // Children are destroyed (and notified) before their parent
+            index.erase(event->xdestroywindow.window);
+            return true;
+
+        case MapNotify: {
+            auto found = index.find(event->xmap.window);
+            if (found != index.end())
+                found->second.mapped = true;
+            return true;
+        }
+
+        case UnmapNotify: {
+            auto found = index.find(event->xunmap.window);
+            if (found != index.end())
+                found->second.mapped = false;
+            return true;
+        }
+
+        case ReparentNotify: {
+            auto found = index.find(event->xreparent.window);
+            if (found != index.end()) {
+                found->second.parent = event->xreparent.parent;
+                found->second.x = event->xreparent.x;
+                found->second.y = event->xreparent.y;
+            }
+            return true;
+        }
+
+        case PropertyNotify: {
+            Atom property = event->xproperty.atom;
+            Window window = event->xproperty.window;
+            if (property != XA_WM_NAME && property != XA_WM_CLASS
+                && property != context->pidAtom) {
+                return true;
+            }
+
+            // Read the property without holding the lock
+            lock.unlock();
+            WindowEntry changed;
+            readWindowProperty(window, property, &changed);
+            lock.lock();
+
+            auto found = index.find(window);
+            if (found == index.end())
+                return true;
+
+            WindowEntry& entry = found->second;
+            if (property == XA_WM_NAME) {
+                entry.name = changed.name;
+            } else if (property == XA_WM_CLASS) {
+                entry.instanceName = changed.instanceName;
+                entry.className = changed.className;
+            } else {
+                entry.pid = changed.pid;
+            }
+            return true;
+        }
+
+        case ConfigureNotify: {
+            const XConfigureEvent& configure = event->xconfigure;
+            auto found = index.find(configure.window);
+            if (found != index.end()) {
+                found->second.width = configure.width;
+                found->second.height = configure.height;
+
+                // Window managers send events with the position on the
+                // root window instead, but only to the window itself
+                if (!configure.send_event) {
+                    found->second.x = configure.x;
+                    found->second.y = configure.y;
+                    found->second.border = configure.border_width;
+                }
+            }
+            return true;
+        }
+
+        case GravityNotify:
+        case CirculateNotify:
+            return true;
+    }
+    return false;
+}
+
+bool isViewable(const std::map<Window, WindowEntry>& index, Window window) {
+    /*
+        Returns true if the window and all of its ancestors are mapped
+        (the IsViewable map state of XGetWindowAttributes)
+     */
+
+    while (window != context->root) {
+        auto found = index.find(window);
+        if (found == index.end() || !found->second.mapped)
+            return false;
+        window = found->second.parent;
+    }
+    return true;
+}
+
+bool isIndexed(Window window) {
+    std::lock_guard<std::mutex> lock(context->windowIndexMutex);
+    return context->windowIndex.count(window) != 0;
+}
+
+bool getIndexedGeometry(Window window, WindowGeometry* geometry) {
+    /*
+        Gets the position of the window on the root window and its size
+        from the window index, without asking the X server, like
+        XTranslateCoordinates and XGetWindowAttributes would.
+        Returns false if the window or one of its ancestors isn't in the
+        index.
+     */
+
+    std::lock_guard<std::mutex> lock(context->windowIndexMutex);
+    const std::map<Window, WindowEntry>& index = context->windowIndex;
+
+    auto found = index.find(window);
+    if (found == index.end())
+        return false;
+
+    const WindowEntry& entry = found->second;
+    geometry->width = entry.width;
+    geometry->height = entry.height;
+    geometry->border = entry.border;
+    geometry->depth = entry.depth;
+    geometry->visual = entry.visual;
+
+    // The inside of each window is at its position plus its border in the
+    // inside of its parent
+    long x = 0;
+    long y = 0;
+    while (window != context->root) {
+        found = index.find(window);
+        if (found == index.end())
+            return false;
+
+        x += found->second.x + found->second.border;
+        y += found->second.y + found->second.border;
+        window = found->second.parent;
+    }
+
+    geometry->x = x;
+    geometry->y = y;
+    return true;
 }
 
-int xErrorHandler(Display* d, XErrorEvent* e) {
+void readWindowVisual(Window window, WindowGeometry* geometry) {
+    /*
+        Reads the depth and visual of the window if they are not in the
+        geometry yet, and keeps them in the window index, so they are only
+        read from the X server once per window.
+        Throws invalid_argument if the window doesn't exist.
+     */
+
+    if (geometry->depth != 0)
+        return;
+
+    XWindowAttributes attrs;
+    if (XGetWindowAttributes(context->display, window, &attrs) == 0)
+        throw std::invalid_argument("window not found");
+
+    geometry->depth = attrs.depth;
+    geometry->visual = attrs.visual;
+
+    std::lock_guard<std::mutex> lock(context->windowIndexMutex);
+    auto found = context->windowIndex.find(window);
+    if (found != context->windowIndex.end()) {
+        found->second.depth = attrs.depth;
+        found->second.visual = attrs.visual;
+    }
+}
+
+Window findWindow(const std::string& name, unsigned long pid,
+                  const std::string& windowClass) {
+    /*
+        Finds a viewable window from the window index, without asking the
+        X server. If several windows match, the one with the lowest id
+        (usually the one that was created first) is returned.
+        Returns None if no matching window was found.
+
+        Parameters:
+            name: full or partial WM_NAME of the window (empty = any).
+                  Use the xprop command to find the WM_NAME of a window
+                  you want to use.
+            pid: _NET_WM_PID of the window (0 = any)
+            windowClass: instance or class name in the WM_CLASS of the
+                         window (empty = any)
+     */
+
+    std::lock_guard<std::mutex> lock(context->windowIndexMutex);
+
+    for (auto& indexed : context->windowIndex) {
+        const WindowEntry& entry = indexed.second;
+
+        if (!name.empty()
+            && (entry.name.empty()
+                || entry.name.find(name) == std::string::npos)) {
+            continue;
+        }
+        if (pid != 0 && entry.pid != pid)
+            continue;
+        if (!windowClass.empty() && entry.instanceName != windowClass
+            && entry.className != windowClass) {
+            continue;
+        }
+
+        if (isViewable(context->windowIndex, indexed.first))
+            return indexed.first;
+    }
+    return None;
+}
+
+int xErrorHandler(Display* /*display*/, XErrorEvent* /*event*/) {
     return 0;
 }
 
-void initialize() {
-    XInitThreads();
+DisplayContext* openDisplay(const std::string& name) {
+    /*
+        Opens the display with the given name (for example ":1"), or the
+        display in the DISPLAY environment variable if the name is empty,
+        and starts its event thread. The new display is selected by the
+        current thread.
+     */
 
-    display = XOpenDisplay(NULL);
-    eventDisplay = XOpenDisplay(NULL);
-    root = DefaultRootWindow(display);
-    cachedWindow = root;
-    initShm(root);
+    const char* displayName = name.empty() ? NULL : name.c_str();
+    Display* display = XOpenDisplay(displayName);
+    Display* eventDisplay = XOpenDisplay(displayName);
+    if (display == NULL || eventDisplay == NULL) {
+        if (display != NULL)
+            XCloseDisplay(display);
+        if (eventDisplay != NULL)
+            XCloseDisplay(eventDisplay);
+        throw std::invalid_argument(std::string("could not open display ")
+                                    + XDisplayName(displayName));
+    }
 
-    // Set error handler to prevent X from crashing the application on errors
-    XSetErrorHandler(xErrorHandler);
+    context = new DisplayContext();
+    context->name = name;
+    context->display = display;
+    context->eventDisplay = eventDisplay;
+    context->root = DefaultRootWindow(display);
+    context->connection = XGetXCBConnection(display);
+    context->cachedWindow = context->root;
+    initShm(context->root);
+    initEncoder(&context->encodeState);
+
+    // Index the windows before the event thread starts updating the index
+    context->pidAtom = XInternAtom(eventDisplay, "_NET_WM_PID", False);
+    WindowEntry rootEntry;
+    rootEntry.mapped = true;
+    rootEntry.width = context->windowWidth;
+    rootEntry.height = context->windowHeight;
+    indexWindow(context->root, rootEntry);
 
-    // Test availability of XTest
     int eventBaseReturn;
     int errorBaseReturn;
     int majorVersionReturn;
     int minorVersionReturn;
+
+    // Test availability of XRender
+    if (!XRenderQueryExtension(display, &eventBaseReturn, &errorBaseReturn)) {
+        std::cout << "XRender extension not available!" << std::endl
+                  << "Images will be scaled on the CPU" << std::endl;
+    } else {
+        context->hasXRender = true;
+    }
+
+    // Read the pixels from the framebuffer of Xvfb if it is available
+    mapFramebuffer();
+
+    // Test availability of XComposite 0.2 (used for capturing windows
+    // that are covered or off screen). The version we support is passed
+    // in and the version of the server is returned.
+    majorVersionReturn = 0;
+    minorVersionReturn = 2;
+    if (XCompositeQueryExtension(display, &eventBaseReturn, &errorBaseReturn)
+        && XCompositeQueryVersion(display, &majorVersionReturn,
+                                  &minorVersionReturn)
+        && (majorVersionReturn > 0 || minorVersionReturn >= 2)) {
+        context->hasXComposite = true;
+    }
+
+    // Test availability of XRandR (used for selecting monitors)
+    if (XRRQueryExtension(display, &eventBaseReturn, &errorBaseReturn))
+        context->hasXRandR = true;
+
+    // Test availability of XDamage (used for skipping unchanged frames)
+    if (!XDamageQueryExtension(eventDisplay, &context->damageEventBase,
+                               &errorBaseReturn)) {
+        std::cout << "XDamage extension not available!" << std::endl
+                  << "Unchanged frames will be captured again" << std::endl;
+    } else {
+        context->hasXDamage = true;
+        trackDamage(context->root);
+    }
+
+    // Test availability of XTest
     if (!XTestQueryExtension(display, &eventBaseReturn, &errorBaseReturn,
                              &majorVersionReturn, &minorVersionReturn)) {
         std::cout << "XTest extension not available!" << std::endl
@@ -120,145 +1361,696 @@ void initialize() {
     masks[0].mask_len = sizeof(mask);
     masks[0].mask = mask;
 
-    XISelectEvents(eventDisplay, root, masks, 1);
+    XISelectEvents(eventDisplay, context->root, masks, 1);
     XFlush(eventDisplay);
 
-    std::thread(eventThread).detach();
+    std::thread(eventThread, context).detach();
+    return context;
+}
+
+void setFramebufferDir(const std::string& dir) {
+    framebufferDir = dir;
+}
+
+size_t enableHugePages() {
+    // The default huge page size is the one SHM_HUGETLB allocates
+    size_t size = 0;
+    std::ifstream meminfo("/proc/meminfo");
+    std::string field;
+    while (meminfo >> field) {
+        if (field == "Hugepagesize:") {
+            meminfo >> size;
+            size *= 1024;
+            break;
+        }
+    }
+
+    if (size == 0)
+        throw std::invalid_argument("huge pages are not supported by the kernel");
+
+    // Try to allocate one, so that a missing huge page pool is reported
+    // at startup instead of silently falling back to normal pages
+    int shmid = shmget(IPC_PRIVATE, size, IPC_CREAT|SHM_HUGETLB|0600);
+    if (shmid == -1) {
+        throw std::invalid_argument(std::string("could not allocate a huge "
+                                                "page: ") + strerror(errno));
+    }
+    shmctl(shmid, IPC_RMID, 0);
+
+    hugePageSize = size;
+    return size;
+}
+
+void lockMemory(const void* data, size_t bytes) {
+    if (mlock(data, bytes) != 0)
+        throw std::invalid_argument(strerror(errno));
+}
+
+void selectDisplay(const std::string& name) {
+    std::lock_guard<std::mutex> lock(contextsMutex);
+
+    auto found = contexts.find(name);
+    if (found != contexts.end()) {
+        context = found->second;
+        return;
+    }
+
+    contexts[name] = openDisplay(name);
+}
+
+void initialize() {
+    XInitThreads();
+
+    // Set error handler to prevent X from crashing the application on errors
+    XSetErrorHandler(xErrorHandler);
+
+    // Open the default display, other displays are opened when
+    // they are first selected
+    try {
+        selectDisplay("");
+    } catch (const std::invalid_argument& e) {
+        std::cout << e.what() << std::endl;
+    }
 }
 
 void shutdown() {
-    // Tell the event thread to stop
-    stopThread = true;
+    std::lock_guard<std::mutex> lock(contextsMutex);
+
+    for (auto& named : contexts) {
+        context = named.second;
 
-    // Detach from shared memory, destroy XImage and shared memory
-    XShmDetach(display, &shmInfo);
-    XDestroyImage(image);
-    shmdt(shmInfo.shmaddr);
-    XCloseDisplay(display);
+        // Tell the event thread to stop
+        context->stopThread = true;
+
+        if (context->damage != None)
+            XDamageDestroy(context->eventDisplay, context->damage);
+
+        // Free the XRender and XComposite resources
+        freeScaledShm();
+        freeCompositeWindows();
+
+        if (context->framebufferFile != NULL)
+            munmap(context->framebufferFile, context->framebufferFileSize);
+        if (context->windowPicture != None)
+            XRenderFreePicture(context->display, context->windowPicture);
+
+        // Detach from and free the shared memory images
+        freeShmPool();
+        XCloseDisplay(context->display);
+
+        shutdownEncoder(&context->encodeState);
+    }
 }
 
-Window findWindowRecursive(Window window, std::string* name) {
+Window findNamedWindow(const std::string& name, WindowGeometry* geometry) {
     /*
-        Find and return a window with the given name.
-        Uses the WM_NAME property of the window. Use the xprop command
-        to find the WM_NAME of a window you want to use.
-        If no matching window was found, returns the root window.
+        Returns the window with the given name and gets its geometry,
+        both from the window index
+     */
 
-        Parameters:
-            window: the root window whose children are searched
-            name: full or partial string to match with the window name
+    Window window = findWindow(name, 0, "");
+    if (window == None || !getIndexedGeometry(window, geometry))
+        throw std::invalid_argument("window not found: " + name);
+
+    return window;
+}
+
+unsigned long getWindowsScreenshot(Frame* frame, const ImageOptions& options,
+                                   bool framebuffer) {
+    /*
+        Captures the windows in options with one capture of the root window
+        and crops each window out of it.
+
+        Only the bounding box of the windows is copied from the X server,
+        or if framebuffer is set, read from the Xvfb framebuffer.
+        The windows have to be on the screen and not covered by other
+        windows, because the pixels are taken from the root window.
      */
 
-    // Get window children
-    Window root_return;
-    Window parent_return;
-    Window* children_return;
-    unsigned int nchildren_return;
-    if (XQueryTree(display, window, &root_return, &parent_return, 
-                   &children_return, &nchildren_return) == 0) {
-        std::cout << "XQueryTree failed" << std::endl;
-        return root;
+    size_t count = options.windows.size();
+    frame->windowRegions.resize(count);
+
+    // Rectangles of the windows on the root window, clipped to it
+    long left = context->windowWidth;
+    long top = context->windowHeight;
+    long right = 0;
+    long bottom = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const std::string& name = options.windows[i];
+
+        WindowGeometry geometry;
+        findNamedWindow(name, &geometry);
+
+        int x = geometry.x;
+        int y = geometry.y;
+        long windowLeft = std::max(x, 0);
+        long windowTop = std::max(y, 0);
+        long windowRight = std::min<long>((long)x + geometry.width,
+                                          context->windowWidth);
+        long windowBottom = std::min<long>((long)y + geometry.height,
+                                           context->windowHeight);
+        if (windowRight <= windowLeft || windowBottom <= windowTop)
+            throw std::invalid_argument("window is off screen: " + name);
+
+        CaptureRegion& region = frame->windowRegions[i];
+        region.x = windowLeft;
+        region.y = windowTop;
+        region.width = windowRight - windowLeft;
+        region.height = windowBottom - windowTop;
+
+        left = std::min(left, windowLeft);
+        top = std::min(top, windowTop);
+        right = std::max(right, windowRight);
+        bottom = std::max(bottom, windowBottom);
     }
 
-    // Enumerate through every child
-    for (int i = 0; i < nchildren_return; i++) {
-        XWindowAttributes attrs;
-        XGetWindowAttributes(display, children_return[i], &attrs);
+    RawImage raw;
+    if (framebuffer) {
+        if (!getFramebufferImage(left, top, right - left, bottom - top, &raw))
+            throw std::invalid_argument("windows are outside the framebuffer");
+    } else {
+        XImage* image = acquireShm(context->root, right - left, bottom - top);
+        if (XShmGetImage(context->display, context->root, image,
+                         left, top, 0x00ffffff) == 0)
+            throw std::invalid_argument("window not found");
+
+        raw.data = image->data;
+        raw.width = image->width;
+        raw.height = image->height;
+        raw.stride = image->bytes_per_line;
+    }
+
+    // The windows relative to the captured bounding box
+    std::vector<CaptureRegion>& crops = context->windowCrops;
+    crops = frame->windowRegions;
+    for (CaptureRegion& crop : crops) {
+        crop.x -= left;
+        crop.y -= top;
+    }
+
+    return encodeWindows(raw, crops, options, &context->encodeState, frame);
+}
+
+unsigned long getCompositeWindowsScreenshot(Frame* frame,
+                                            const ImageOptions& options) {
+    /*
+        Captures each window in options from its own pixmap (see
+        getWindowPixmap), so the windows can overlap each other or be
+        partly off screen. The windows are read into consecutive parts
+        of one shared memory image.
+     */
+
+    size_t count = options.windows.size();
+    frame->windowRegions.resize(count);
+    context->windowRaws.resize(count);
+
+    std::vector<Window>& windows = context->windowIds;
+    std::vector<WindowGeometry>& geometries = context->windowGeometries;
+    windows.resize(count);
+    geometries.resize(count);
+    unsigned int maxWidth = 0;
+    unsigned int totalHeight = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const std::string& name = options.windows[i];
+        WindowGeometry& geometry = geometries[i];
+        windows[i] = findNamedWindow(name, &geometry);
+        readWindowVisual(windows[i], &geometry);
+        if (geometry.depth != 24 && geometry.depth != 32)
+            throw std::invalid_argument("unsupported window depth: " + name);
+
+        // The whole window is captured even if it is off screen
+        CaptureRegion& region = frame->windowRegions[i];
+        region.x = geometry.x;
+        region.y = geometry.y;
+        region.width = geometry.width;
+        region.height = geometry.height;
+
+        maxWidth = std::max(maxWidth, geometry.width);
+        totalHeight += geometry.height;
+    }
+
+    // All windows fit in an image of the widest window and their total
+    // height, since every window has 4 bytes per pixel
+    XImage* image = acquireShm(context->root, maxWidth, totalHeight);
+    XShmSegmentInfo* shmInfo = (XShmSegmentInfo*)image->obdata;
+    char* data = image->data;
+
+    for (size_t i = 0; i < count; i++) {
+        const WindowGeometry& geometry = geometries[i];
+
+        // An image that is only a header for a part of the segment.
+        // XShmGetImage writes to the offset of its data in the segment.
+        XImage* windowImage = XShmCreateImage(
+            context->display, geometry.visual, geometry.depth, ZPixmap,
+            data, shmInfo, geometry.width, geometry.height);
+        if (windowImage == NULL)
+            throw std::invalid_argument("could not create a shared memory "
+                                        "image for window: "
+                                        + options.windows[i]);
+
+        Pixmap pixmap = getWindowPixmap(windows[i], geometry.width,
+                                        geometry.height, false);
+        int border = geometry.border;
+        Status status = XShmGetImage(context->display, pixmap, windowImage,
+                                     border, border, 0x00ffffff);
+
+        // The window may have been mapped again since its pixmap was named
+        if (status == 0) {
+            pixmap = getWindowPixmap(windows[i], geometry.width,
+                                     geometry.height, true);
+            status = XShmGetImage(context->display, pixmap, windowImage,
+                                  border, border, 0x00ffffff);
+        }
+
+        RawImage& raw = context->windowRaws[i];
+        raw.data = data;
+        raw.width = windowImage->width;
+        raw.height = windowImage->height;
+        raw.stride = windowImage->bytes_per_line;
+
+        data += (size_t)windowImage->bytes_per_line * windowImage->height;
+        XDestroyImage(windowImage);
+
+        if (status == 0)
+            throw std::invalid_argument("window not found: "
+                                        + options.windows[i]);
+    }
+
+    return encodeWindowImages(context->windowRaws, options,
+                              &context->encodeState, frame);
+}
+
+xcb_shm_get_image_cookie_t sendShmGetImage(Drawable source, int x, int y,
+                                           unsigned int width,
+                                           unsigned int height,
+                                           XShmSegmentInfo* shmInfo,
+                                           char* data) {
+    /*
+        Sends an XShmGetImage request with XCB without waiting for the
+        reply. The image is written to data, which is in the segment.
+     */
+
+    return xcb_shm_get_image_unchecked(
+        context->connection, source, x, y, width, height, 0x00ffffff,
+        XCB_IMAGE_FORMAT_Z_PIXMAP, shmInfo->shmseg, data - shmInfo->shmaddr);
+}
+
+bool receiveShmGetImage(xcb_shm_get_image_cookie_t cookie) {
+    /*
+        Waits for the reply of sendShmGetImage.
+        Returns false if the image could not be captured.
+     */
+
+    xcb_generic_error_t* error = NULL;
+    xcb_shm_get_image_reply_t* reply = xcb_shm_get_image_reply(
+        context->connection, cookie, &error);
+
+    bool captured = reply != NULL && error == NULL;
+    free(reply);
+    free(error);
+    return captured;
+}
+
+bool getXcbImage(Window window, Drawable source, XImage* image, int x, int y) {
+    /*
+        Captures the image like XShmGetImage, but the geometry of the window
+        is queried in the same round trip, so a resize is noticed without
+        waiting for the window index to be updated.
+        Returns false if the capture failed or if the window has been
+        resized since its size was read.
+     */
+
+    xcb_connection_t* connection = context->connection;
+
+    // Both requests are in flight before waiting for either reply
+    xcb_get_geometry_cookie_t geometryCookie =
+        xcb_get_geometry_unchecked(connection, window);
+    xcb_shm_get_image_cookie_t imageCookie = sendShmGetImage(
+        source, x, y, image->width, image->height,
+        (XShmSegmentInfo*)image->obdata, image->data);
+
+    xcb_generic_error_t* error = NULL;
+    xcb_get_geometry_reply_t* geometry = xcb_get_geometry_reply(
+        connection, geometryCookie, &error);
+    free(error);
+
+    bool captured = receiveShmGetImage(imageCookie);
+    if (geometry == NULL)
+        return false;
+
+    if (geometry->width != context->windowWidth
+        || geometry->height != context->windowHeight) {
+        captured = false;
+    }
+    free(geometry);
+    return captured;
+}
+
+bool grabImage(Window window, Drawable source, XImage* image, int x, int y,
+               bool xcb) {
+    /*
+        Captures the image of the window from source (the window or its
+        pixmap) with XShmGetImage, or with getXcbImage if xcb is set.
+        Returns false if the capture failed.
+     */
+
+    if (xcb)
+        return getXcbImage(window, source, image, x, y);
 
-        // Get name of the child window
-        XTextProperty xText;
-        if (XGetWMName(display, children_return[i], &xText) > 0
-            && attrs.map_state == IsViewable) {
-            std::string thisName = (char*)xText.value;
+    return XShmGetImage(context->display, source, image, x, y,
+                        0x00ffffff) != 0;
+}
+
+unsigned long getXcbWindowsScreenshot(Frame* frame,
+                                      const ImageOptions& options) {
+    /*
+        Captures each window in options separately with XCB. The grabs and
+        the position and geometry queries of all windows are sent before
+        waiting for any reply, so capturing many windows takes about one
+        round trip to the X server. The sizes of the windows are taken
+        from the window index, and if a window turns out to have been
+        resized, the windows are captured once more with the new sizes.
+
+        The windows have to be visible and on the screen, since they are
+        captured from the screen.
+     */
 
-            if (thisName.find(*name) != std::string::npos)
-                return children_return[i];
+    xcb_connection_t* connection = context->connection;
+    size_t count = options.windows.size();
+    frame->windowRegions.resize(count);
+    context->windowRaws.resize(count);
+
+    std::vector<Window>& windows = context->windowIds;
+    windows.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        windows[i] = findWindow(options.windows[i], 0, "");
+        if (windows[i] == None) {
+            throw std::invalid_argument("window not found: "
+                                        + options.windows[i]);
         }
 
-        // Call recursively for the child
-        Window child = findWindowRecursive(children_return[i], name);
-        if (child != root)
-            return child;
+        CaptureRegion& region = frame->windowRegions[i];
+        if (!getIndexedSize(windows[i], &region.width, &region.height))
+            throw std::invalid_argument("window not found: "
+                                        + options.windows[i]);
     }
-    return root;
+
+    std::vector<xcb_get_geometry_cookie_t>& geometryCookies =
+        context->geometryCookies;
+    std::vector<xcb_translate_coordinates_cookie_t>& positionCookies =
+        context->positionCookies;
+    std::vector<xcb_shm_get_image_cookie_t>& imageCookies =
+        context->imageCookies;
+    geometryCookies.resize(count);
+    positionCookies.resize(count);
+    imageCookies.resize(count);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        // Every window has 4 bytes per pixel
+        unsigned int maxWidth = 0;
+        unsigned int totalHeight = 0;
+        for (const CaptureRegion& region : frame->windowRegions) {
+            maxWidth = std::max(maxWidth, region.width);
+            totalHeight += region.height;
+        }
+
+        XImage* image = acquireShm(context->root, maxWidth, totalHeight);
+        XShmSegmentInfo* shmInfo = (XShmSegmentInfo*)image->obdata;
+        char* data = image->data;
+
+        for (size_t i = 0; i < count; i++) {
+            const CaptureRegion& region = frame->windowRegions[i];
+
+            geometryCookies[i] = xcb_get_geometry_unchecked(connection,
+                                                            windows[i]);
+            positionCookies[i] = xcb_translate_coordinates_unchecked(
+                connection, windows[i], context->root, 0, 0);
+            imageCookies[i] = sendShmGetImage(windows[i], 0, 0, region.width,
+                                              region.height, shmInfo, data);
+
+            RawImage& raw = context->windowRaws[i];
+            raw.data = data;
+            raw.width = region.width;
+            raw.height = region.height;
+            raw.stride = region.width * 4;
+            data += (size_t)raw.stride * raw.height;
+        }
+
+        // Every reply is received, even after an error
+        bool resized = false;
+        std::string error;
+        for (size_t i = 0; i < count; i++) {
+            CaptureRegion& region = frame->windowRegions[i];
+
+            xcb_generic_error_t* geometryError = NULL;
+            xcb_get_geometry_reply_t* geometry = xcb_get_geometry_reply(
+                connection, geometryCookies[i], &geometryError);
+            xcb_generic_error_t* positionError = NULL;
+            xcb_translate_coordinates_reply_t* position =
+                xcb_translate_coordinates_reply(connection, positionCookies[i],
+                                                &positionError);
+            bool captured = receiveShmGetImage(imageCookies[i]);
+
+            if (geometry == NULL || position == NULL) {
+                error = "window not found: " + options.windows[i];
+            } else if (geometry->depth != 24 && geometry->depth != 32) {
+                error = "unsupported window depth: " + options.windows[i];
+            } else if (geometry->width != region.width
+                       || geometry->height != region.height) {
+                region.width = geometry->width;
+                region.height = geometry->height;
+                resized = true;
+            } else if (!captured) {
+                error = "window is off screen: " + options.windows[i];
+            }
+
+            if (position != NULL) {
+                region.x = position->dst_x;
+                region.y = position->dst_y;
+            }
+
+            free(geometry);
+            free(geometryError);
+            free(position);
+            free(positionError);
+        }
+
+        if (!error.empty())
+            throw std::invalid_argument(error);
+        if (!resized)
+            return encodeWindowImages(context->windowRaws, options,
+                                      &context->encodeState, frame);
+    }
+    throw std::invalid_argument("windows are being resized");
 }
 
-unsigned long getJPGScreenshot(std::string* processName, char** imageBuffer,
-                               unsigned int quality) {
+unsigned long getScreenshot(std::string* processName, Frame* frame,
+                            const ImageOptions& options) {
     /*
-        Takes a screenshot of the display.
+        Takes a screenshot of the display selected by the current thread.
 
         Parameters:
-            processName: currently not used
-            imageBuffer: address of the pointer that will receive the new image
-            quality: quality of the compressed jpg (0-100)
+            processName: WM_NAME of the window to capture
+            frame: frame whose buffers will receive the new image and tensor
+            options: format and quality of the image, and the PID and class
+                     of the window to capture
     */
    
     Window window;
 
-    // If process name is unchanged from previous request
-    if (processName->compare(cachedName) == 0) {
-        window = cachedWindow;
-    // If process name has changed
+    // If the window is unchanged from previous request and still exists
+    if (processName->compare(context->cachedName) == 0
+        && options.windowPid == context->cachedPid
+        && options.windowClass == context->cachedClass
+        && (context->cachedWindow == context->root
+            || isIndexed(context->cachedWindow))) {
+        window = context->cachedWindow;
+    // If the window has changed
     } else {
-        if (processName->length() == 0)
-            window = root;
-        else {
-            window = findWindowRecursive(root, processName);
-
-            // If the returned window is root, we didn't find the given window
-            if (window == root)
+        if (processName->length() == 0 && options.windowPid == 0
+            && options.windowClass.empty()) {
+            window = context->root;
+        } else {
+            window = findWindow(*processName, options.windowPid,
+                                options.windowClass);
+            if (window == None)
                 throw std::invalid_argument("window not found");
         }
 
         initShm(window);
-        cachedName = *processName;
-        cachedWindow = window;
+        resetEncodeState(&context->encodeState);
+        trackDamage(window);
+        context->cachedName = *processName;
+        context->cachedPid = options.windowPid;
+        context->cachedClass = options.windowClass;
+        context->cachedWindow = window;
     }
 
-    /*  Get display image to shared memory
-        If this fails it probably means the window doesn't exist anymore.
-        Also seems to fail if the target window is partially outside the screen
-        or resized without calling initShm on it
-    */
-    if (XShmGetImage(display, window, image, 0, 0, 0x00ffffff) == 0) {
-        throw std::invalid_argument("window not found");
+    // The window was resized since it was last captured
+    unsigned int width, height;
+    if (getIndexedSize(window, &width, &height)
+        && (width != context->windowWidth || height != context->windowHeight)) {
+        context->windowWidth = width;
+        context->windowHeight = height;
+        resetEncodeState(&context->encodeState);
     }
 
-    // Initialize libjpeg-turbo instance
-    tjhandle tjInstance = tjInitCompress();
-    if (tjInstance == NULL)
-        return 0;
+    // Read before capturing, so that drawing during the capture
+    // counts as a change to the captured image
+    frame->damageGeneration = getDamageGeneration();
+
+    bool composite = context->hasXComposite
+                     && options.captureBackend == CAPTURE_COMPOSITE;
+    bool xcb = options.captureBackend == CAPTURE_XCB;
+    bool framebuffer = context->framebufferFile != NULL
+                       && options.captureBackend == CAPTURE_FRAMEBUFFER;
+
+    // Several windows are cropped from one capture of the root window,
+    // or captured from their own pixmaps
+    if (!options.windows.empty()) {
+        if (window != context->root) {
+            throw std::invalid_argument("windows can only be captured "
+                                        "without a process name, PID "
+                                        "or class");
+        }
 
-    int subsamp = TJSAMP_420;
+        // Only the image of each window is encoded
+        if (options.tensor.enabled) {
+            throw std::invalid_argument("tensors are not supported with "
+                                        "multiple windows");
+        }
+        if (options.maxPool > 1) {
+            throw std::invalid_argument("max-pooling is not supported with "
+                                        "multiple windows");
+        }
+        if (options.tileSize != 0) {
+            throw std::invalid_argument("tiles are not supported with "
+                                        "multiple windows");
+        }
+        if (!options.rois.empty()) {
+            throw std::invalid_argument("regions of interest are not "
+                                        "supported with multiple windows");
+        }
+        if (!options.outputs.empty()) {
+            throw std::invalid_argument("outputs are not supported with "
+                                        "multiple windows");
+        }
+        if (options.region.width != 0 || options.region.height != 0
+            || options.monitor != 0) {
+            throw std::invalid_argument("regions are not supported with "
+                                        "multiple windows");
+        }
+        if (composite)
+            return getCompositeWindowsScreenshot(frame, options);
+        if (xcb)
+            return getXcbWindowsScreenshot(frame, options);
+        return getWindowsScreenshot(frame, options, framebuffer);
+    }
+
+    // The root window can't be redirected
+    if (window == context->root)
+        composite = false;
+
+    // Let the X server scale the image if requested
+    if (context->hasXRender && options.resizeBackend == RESIZE_XRENDER
+        && options.isScaled() && options.rois.empty()
+        && options.outputs.empty() && !composite) {
+        return getScaledScreenshot(window, frame, options);
+    }
+
+    // Only the requested area is captured, into an image of the same size
+    CaptureArea area;
+    getCaptureArea(window, context->windowWidth, context->windowHeight,
+                   options, &area);
+
+    // The area is read straight from the Xvfb framebuffer, only its
+    // position on the screen is asked from the X server
+    if (framebuffer) {
+        int x = 0;
+        int y = 0;
+        Window child;
+        if (window != context->root
+            && !XTranslateCoordinates(context->display, window, context->root,
+                                      0, 0, &x, &y, &child)) {
+            throw std::invalid_argument("window not found");
+        }
+
+        RawImage raw;
+        if (!getFramebufferImage((long)x + area.x, (long)y + area.y,
+                                 area.width, area.height, &raw)) {
+            throw std::invalid_argument("window is off screen");
+        }
+        return encodeFrame(raw, options, &context->encodeState, frame);
+    }
+
+    XImage* image = acquireShm(window, area.width, area.height);
+
+    // A redirected window is read from its own pixmap, which includes
+    // the border of the window
+    Drawable source = window;
+    int border = 0;
+    if (composite) {
+        source = getWindowPixmap(window, context->windowWidth,
+                                 context->windowHeight, false);
+        border = context->windowBorder;
+    }
 
-    // Allocate a buffer
-    ulong bufferLength = tjBufSize(image->width, image->height, subsamp);
-    *imageBuffer = new char[bufferLength];
+    /*  Get display image to shared memory
+        If this fails it probably means the window doesn't exist anymore.
+        Without XComposite, also seems to fail if the target window is
+        partially outside the screen. It also fails if the window was
+        resized after the window index was last updated, or mapped again
+        after its pixmap was named, so the size is read from the X server
+        and the capture is tried once more.
+    */
+    if (!grabImage(window, source, image, area.x + border, area.y + border,
+                   xcb)) {
+        initShm(window);
+        resetEncodeState(&context->encodeState);
+
+        getCaptureArea(window, context->windowWidth, context->windowHeight,
+                       options, &area);
+        image = acquireShm(window, area.width, area.height);
+        if (composite) {
+            source = getWindowPixmap(window, context->windowWidth,
+                                     context->windowHeight, true);
+            border = context->windowBorder;
+        }
+        if (!grabImage(window, source, image, area.x + border,
+                       area.y + border, xcb)) {
+            throw std::invalid_argument("window not found");
+        }
+    }
 
-    // Compress image as jpg
-    tjCompress2(tjInstance, (const unsigned char*)image->data, image->width, 0,
-                image->height, TJPF_BGRX, (unsigned char**)imageBuffer,
-                &bufferLength, subsamp, quality, 0);
+    RawImage raw;
+    raw.data = image->data;
+    raw.width = image->width;
+    raw.height = image->height;
+    raw.stride = image->bytes_per_line;
 
-    tjDestroy(tjInstance);
-    return bufferLength;
+    return encodeFrame(raw, options, &context->encodeState, frame);
 }
 
 unsigned int moveMouse(long dx, long dy) {
-    int s = XTestFakeRelativeMotionEvent(display, dx, dy, CurrentTime);
-    XFlush(display);
+    InputState& input = context->input;
+
+    int s = XTestFakeRelativeMotionEvent(context->display, dx, dy,
+                                         CurrentTime);
+    XFlush(context->display);
 
-    std::lock_guard<std::mutex> lock(inputMutex);
-    expectedMouseMovement.push_front(std::pair<long, long>(dx, dy));
+    std::lock_guard<std::mutex> lock(input.mutex);
+    input.expectedMouseMovement.push_front(std::pair<long, long>(dx, dy));
 
     return s;
 }
 
 unsigned int sendKey(std::string key, bool down, bool userOverride) {
+    InputState& input = context->input;
     int s;
 
-    if (userOverride && isUserPressingKeys())
+    if (userOverride && isUserPressingKeys(input))
         return 0;
 
     // Handle mouse buttons separately
@@ -279,7 +2071,7 @@ unsigned int sendKey(std::string key, bool down, bool userOverride) {
         else if (key == "mouse down")
             button = 5;
 
-        s = XTestFakeButtonEvent(display, button, down, CurrentTime);
+        s = XTestFakeButtonEvent(context->display, button, down, CurrentTime);
 
     } else {
         unsigned int keySym;
@@ -289,11 +2081,12 @@ unsigned int sendKey(std::string key, bool down, bool userOverride) {
             return 0;
         }
 
-        unsigned int keyCode = XKeysymToKeycode(display, (KeySym)keySym);
+        unsigned int keyCode = XKeysymToKeycode(context->display,
+                                                (KeySym)keySym);
 
-        s = XTestFakeKeyEvent(display, keyCode, down, CurrentTime);
+        s = XTestFakeKeyEvent(context->display, keyCode, down, CurrentTime);
     }
-    XFlush(display);
+    XFlush(context->display);
 
     // Update expectedKeyDowns/Ups so we can ignore the input event caused
     // by the fake event we send
@@ -301,14 +2094,14 @@ unsigned int sendKey(std::string key, bool down, bool userOverride) {
     // Also update fakeKeysPressed so we can release this key if the user
     // overrides our input
     
-    std::lock_guard<std::mutex> lock(inputMutex);
+    std::lock_guard<std::mutex> lock(input.mutex);
 
     if (down) {
-        expectedKeyDowns.insert(key);
-        fakeKeysPressed.insert(key);
+        input.expectedKeyDowns.insert(key);
+        input.fakeKeysPressed.insert(key);
     } else {
-        expectedKeyUps.insert(key);
-        fakeKeysPressed.erase(key);
+        input.expectedKeyUps.insert(key);
+        input.fakeKeysPressed.erase(key);
     }
 
     return s;
@@ -318,16 +2111,17 @@ unsigned int sendKey(std::string key, bool down, bool userOverride) {
     Returns the contents of pressedKeys and removes keys that were released.
 */
 std::set<std::string> getKeys() {
-    std::lock_guard<std::mutex> lock(inputMutex);
+    InputState& input = context->input;
+    std::lock_guard<std::mutex> lock(input.mutex);
 
     // Return keys that were held down since last call
-    auto keysReturn = std::set<std::string>(pressedKeys);
+    auto keysReturn = std::set<std::string>(input.pressedKeys);
 
     // Remove released keys from pressedKeys
-    for (auto key : releasedKeys)
-        pressedKeys.erase(key);
+    for (auto key : input.releasedKeys)
+        input.pressedKeys.erase(key);
 
-    releasedKeys.clear();
+    input.releasedKeys.clear();
 
     return keysReturn;
 }
@@ -336,31 +2130,46 @@ std::set<std::string> getKeys() {
     Returns the value of mouseDelta and resets the value back to (0, 0).
 */
 std::pair<long, long> getMouse() {
-    std::lock_guard<std::mutex> lock(inputMutex);
+    InputState& input = context->input;
+    std::lock_guard<std::mutex> lock(input.mutex);
 
-    long xd = mouseDelta.first;
-    long yd = mouseDelta.second;
+    long xd = input.mouseDelta.first;
+    long yd = input.mouseDelta.second;
 
-    mouseDelta.first = 0;
-    mouseDelta.second = 0;
+    input.mouseDelta.first = 0;
+    input.mouseDelta.second = 0;
 
     return std::pair<long, long>(xd, yd);
 }
 
 /*
-    The thread that contains the X event loop
+    The thread that contains the X event loop of a display
 */
-void eventThread() {
+void eventThread(DisplayContext* displayContext) {
     XEvent event;
     XGenericEventCookie* cookie;
     XIRawEvent* rawEvent;
 
-    while (!stopThread) {
-        XNextEvent(eventDisplay, &event);
+    // Keys released by keyEvent are sent to this display
+    context = displayContext;
+    InputState& input = context->input;
+
+    while (!context->stopThread) {
+        XNextEvent(context->eventDisplay, &event);
+
+        if (context->hasXDamage
+            && event.type == context->damageEventBase + XDamageNotify) {
+            damageEvent((XDamageNotifyEvent*)&event);
+            continue;
+        }
+
+        if (windowIndexEvent(&event))
+            continue;
 
         // Get the event data
         cookie = &event.xcookie;
-        if (XGetEventData(eventDisplay, cookie) && cookie->type == GenericEvent) {
+        if (XGetEventData(context->eventDisplay, cookie)
+            && cookie->type == GenericEvent) {
             rawEvent = (XIRawEvent*)cookie->data;
 
             int keyCode;
@@ -377,7 +2186,7 @@ void eventThread() {
                     dx = rawEvent->raw_values[0];
                     dy = rawEvent->raw_values[1];
                     
-                    mouseEvent(dx, dy);
+                    mouseEvent(dx, dy, input);
                     break;
 
                 // Key press/release
@@ -386,13 +2195,14 @@ void eventThread() {
                     
                 case XI_RawKeyRelease:
                     keyCode = rawEvent->detail;
-                    keySym = XkbKeycodeToKeysym(eventDisplay, keyCode, 0, 0);
+                    keySym = XkbKeycodeToKeysym(context->eventDisplay,
+                                                keyCode, 0, 0);
                     keyName = getKeyName(keySym);
 
                     if (keyDown)
-                        keyEvent(keyName, true);
+                        keyEvent(keyName, true, input);
                     else
-                        keyEvent(keyName, false);
+                        keyEvent(keyName, false, input);
                         
                     break;
 
@@ -404,31 +2214,31 @@ void eventThread() {
                     keyCode = rawEvent->detail;
                     if (keyDown) {
                         if (keyCode == 1)
-                            keyEvent("mouse left", true);
+                            keyEvent("mouse left", true, input);
                         else if (keyCode == 2)
-                            keyEvent("mouse middle", true);
+                            keyEvent("mouse middle", true, input);
                         else if (keyCode == 3)
-                            keyEvent("mouse right", true);
+                            keyEvent("mouse right", true, input);
                         else if (keyCode == 4)
-                            keyEvent("mouse up", true);
+                            keyEvent("mouse up", true, input);
                         else if (keyCode == 5)
-                            keyEvent("mouse down", true);
+                            keyEvent("mouse down", true, input);
                     } else {
                         if (keyCode == 1)
-                            keyEvent("mouse left", false);
+                            keyEvent("mouse left", false, input);
                         else if (keyCode == 2)
-                            keyEvent("mouse middle", false);
+                            keyEvent("mouse middle", false, input);
                         else if (keyCode == 3)
-                            keyEvent("mouse right", false);
+                            keyEvent("mouse right", false, input);
                         else if (keyCode == 4)
-                            keyEvent("mouse up", false);
+                            keyEvent("mouse up", false, input);
                         else if (keyCode == 5)
-                            keyEvent("mouse down", false);
+                            keyEvent("mouse down", false, input);
                     }
                     break;
             }
         }
-        XFreeEventData(eventDisplay, cookie);
+        XFreeEventData(context->eventDisplay, cookie);
     }
     return;
-}
\ No newline at end of file
+}
\ No newline at end of file
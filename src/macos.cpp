@@ -2,6 +2,11 @@
 #include <string>
 #include <set>
 #include <thread>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
 
 #include <ApplicationServices/ApplicationServices.h>
 
@@ -20,6 +25,27 @@ void shutdown() {
     return;
 }
 
+void selectDisplay(const std::string& name) {
+    if (!name.empty())
+        throw std::invalid_argument("displays are not supported on macOS");
+}
+
+void setFramebufferDir(const std::string& dir) {
+    if (!dir.empty()) {
+        throw std::invalid_argument("framebuffer capture is not supported "
+                                    "on macOS");
+    }
+}
+
+size_t enableHugePages() {
+    throw std::invalid_argument("huge pages are not supported on macOS");
+}
+
+void lockMemory(const void* data, size_t bytes) {
+    if (mlock(data, bytes) != 0)
+        throw std::invalid_argument(strerror(errno));
+}
+
 bool findWindow(std::string* processName, CGWindowID* window) {
     // Get list of windows
     CFArrayRef list = CGWindowListCopyWindowInfo(kCGWindowListOptionAll,
@@ -55,10 +81,56 @@ bool findWindow(std::string* processName, CGWindowID* window) {
     return false;
 }
 
-unsigned long getJPGScreenshot(std::string* processName, char** imageBuffer,
-                               unsigned int quality) {
+unsigned long getScreenshot(std::string* processName, Frame* frame,
+                            const ImageOptions& options) {
     CGWindowID window = kCGNullWindowID;
     CGImageRef image;
+    ImageBuffer* imageBuffer = &frame->image;
+
+    if (options.format != FORMAT_JPEG)
+        throw std::invalid_argument("image format not supported on macOS");
+
+    if (options.tensor.enabled)
+        throw std::invalid_argument("tensors are not supported on macOS");
+
+    if (options.isScaled())
+        throw std::invalid_argument("scaling is not supported on macOS");
+
+    if (options.subsampling != SUBSAMPLING_420)
+        throw std::invalid_argument("subsampling is not supported on macOS");
+
+    if (options.region.width != 0 || options.region.height != 0
+        || options.monitor != 0)
+        throw std::invalid_argument("regions are not supported on macOS");
+
+    if (options.maxPool > 1)
+        throw std::invalid_argument("max-pooling is not supported on macOS");
+
+    if (options.tileSize != 0)
+        throw std::invalid_argument("tiles are not supported on macOS");
+
+    if (!options.rois.empty()) {
+        throw std::invalid_argument("regions of interest are not supported "
+                                    "on macOS");
+    }
+
+    if (!options.outputs.empty())
+        throw std::invalid_argument("outputs are not supported on macOS");
+
+    if (!options.windows.empty()) {
+        throw std::invalid_argument("multi-window capture is not supported "
+                                    "on macOS");
+    }
+
+    if (options.windowPid != 0 || !options.windowClass.empty()) {
+        throw std::invalid_argument("selecting windows by PID or class is "
+                                    "not supported on macOS");
+    }
+
+    if (options.captureBackend != CAPTURE_XSHM) {
+        throw std::invalid_argument("capture backends are not supported "
+                                    "on macOS");
+    }
 
     if (processName->length() > 0) {
         if (*processName == cachedName) {
@@ -91,7 +163,7 @@ unsigned long getJPGScreenshot(std::string* processName, char** imageBuffer,
     );
 
     // Set quality
-    double qualityDouble = 0.01 * quality;
+    double qualityDouble = 0.01 * options.quality;
     CFMutableDictionaryRef props = CFDictionaryCreateMutable(NULL, 1, NULL,
                                                              NULL);
     CFNumberRef qualityNumber = CFNumberCreate(NULL, kCFNumberDoubleType,
@@ -99,6 +171,9 @@ unsigned long getJPGScreenshot(std::string* processName, char** imageBuffer,
     CFDictionarySetValue(props, kCGImageDestinationLossyCompressionQuality,
                          qualityNumber);
 
+    unsigned int width = CGImageGetWidth(image);
+    unsigned int height = CGImageGetHeight(image);
+
     CGImageDestinationAddImage(dest, image, props);
     CGImageDestinationFinalize(dest);
     CGImageRelease(image);
@@ -106,16 +181,26 @@ unsigned long getJPGScreenshot(std::string* processName, char** imageBuffer,
     CFRelease(qualityNumber);
     CFRelease(props);
 
-    // Copy to a new buffer
+    // Copy to the image buffer
     unsigned long bufferLength = CFDataGetLength(data);
-    *imageBuffer = new char[bufferLength];
     CFDataGetBytes(data, CFRangeMake(0, bufferLength),
-                   (uint8*)*imageBuffer);
+                   (uint8*)imageBuffer->reserve(bufferLength));
+    imageBuffer->setSize(bufferLength);
+    imageBuffer->setInfo(FORMAT_JPEG, width, height);
     CFRelease(data);
 
     return bufferLength;
 }
 
+uint64_t getDamageGeneration() {
+    // Changes to windows are not tracked on macOS
+    return 0;
+}
+
+uint64_t waitForDamage(uint64_t generation, unsigned int timeout) {
+    return 0;
+}
+
 unsigned int moveMouse(long dx, long dy) {
     // Get current position
     CGEventRef posEvent =  CGEventCreate(NULL);
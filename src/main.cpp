@@ -1,10 +1,29 @@
 #include <iostream>
 #include <string>
+#include <map>
+#include <cmath>
+#include <stdexcept>
 
 #include "messages.pb.h"
 
 #include "socket.hpp"
 #include "platform.hpp"
+#include "capture.hpp"
+#include "history.hpp"
+#include "stack.hpp"
+#include "adaptive.hpp"
+#include "threadpool.hpp"
+#include "source.hpp"
+
+#ifdef __linux__
+    #include "synthetic.hpp"
+#endif
+
+// Maximum number of additional outputs, windows and stacked images in
+// one request
+const int MAX_OUTPUTS = 32;
+const int MAX_WINDOWS = 32;
+const unsigned int MAX_STACK_FRAMES = 32;
 
 #ifdef PROFILING
     #include "profiling.hpp"
@@ -13,11 +32,71 @@
     #define END_TIMER(desc)
 #endif
 
+// State of the session that is kept separately for each display, so that
+// requests for different displays don't disturb each other
+struct DisplaySession {
+    FrameStack stack;
+    AdaptiveState adaptive;
+};
+
+void setTensorSettings(const TensorOptions& tensorOptions,
+                       TensorSettings* settings) {
+    /*
+        Converts the tensor options of a request to tensor settings.
+        The mean and std can be given for all channels at once or separately.
+
+        Throws invalid_argument if a std is not a positive number, since
+        the values are divided by it.
+     */
+
+    settings->enabled = true;
+    settings->layout = tensorOptions.layout();
+    settings->type = tensorOptions.type();
+
+    for (int c = 0; c < 3; c++) {
+        if (tensorOptions.mean_size() == 1)
+            settings->mean[c] = tensorOptions.mean(0);
+        else if (tensorOptions.mean_size() == 3)
+            settings->mean[c] = tensorOptions.mean(c);
+
+        if (tensorOptions.std_size() == 1)
+            settings->std[c] = tensorOptions.std(0);
+        else if (tensorOptions.std_size() == 3)
+            settings->std[c] = tensorOptions.std(c);
+
+        if (!std::isfinite(settings->std[c]) || settings->std[c] <= 0)
+            throw std::invalid_argument("tensor std must be positive");
+    }
+}
+
+void addTensorShape(const TensorSettings& settings, const ImageBuffer* image,
+                    Response* respMsg) {
+    if (settings.layout == TENSOR_CHW)
+        respMsg->add_tensor_shape(3);
+
+    respMsg->add_tensor_shape(image->height());
+    respMsg->add_tensor_shape(image->width());
+
+    if (settings.layout == TENSOR_HWC)
+        respMsg->add_tensor_shape(3);
+}
+
 int main(int argc, char** argv) {
     GOOGLE_PROTOBUF_VERIFY_VERSION;
 
     std::string address = "localhost";
     int port = 12345;
+    bool captureThread = false;
+    unsigned int captureFps = 0;
+    size_t historyBytes = 0;
+    unsigned int threads = 0;
+    std::string framebufferDir;
+    unsigned int syntheticWidth = 0;
+    unsigned int syntheticHeight = 0;
+    unsigned int syntheticFps = 60;
+    bool hugePages = false;
+    size_t prefaultBytes = 0;
+    bool lockFrames = false;
 
     // Parse arguments
     for (int i = 1; i < argc; i++) {
@@ -30,21 +109,176 @@ int main(int argc, char** argv) {
             if ((i + 1) < argc)
                 port = std::stoi(argv[i + 1]);
         }
+        if (arg.compare("-c") == 0 || arg.compare("--capture-thread") == 0) {
+            captureThread = true;
+        }
+        if (arg.compare("--capture-fps") == 0) {
+            if ((i + 1) < argc)
+                captureFps = std::stoi(argv[i + 1]);
+        }
+        if (arg.compare("--history-bytes") == 0) {
+            if ((i + 1) < argc)
+                historyBytes = std::stoull(argv[i + 1]);
+        }
+        if (arg.compare("--threads") == 0) {
+            if ((i + 1) < argc)
+                threads = std::stoi(argv[i + 1]);
+        }
+        if (arg.compare("--xvfb-fbdir") == 0) {
+            if ((i + 1) < argc)
+                framebufferDir = argv[i + 1];
+        }
+        if (arg.compare("--synthetic") == 0) {
+            if ((i + 1) < argc) {
+                std::string size = argv[i + 1];
+                size_t separator = size.find('x');
+                if (separator != std::string::npos) {
+                    syntheticWidth = std::stoi(size.substr(0, separator));
+                    syntheticHeight = std::stoi(size.substr(separator + 1));
+                }
+            }
+        }
+        if (arg.compare("--synthetic-fps") == 0) {
+            if ((i + 1) < argc)
+                syntheticFps = std::stoi(argv[i + 1]);
+        }
+        if (arg.compare("--huge-pages") == 0) {
+            hugePages = true;
+        }
+        if (arg.compare("--prefault-bytes") == 0) {
+            if ((i + 1) < argc)
+                prefaultBytes = std::stoull(argv[i + 1]);
+        }
+        if (arg.compare("--lock-memory") == 0) {
+            lockFrames = true;
+        }
         if (arg.compare("-h") == 0 || arg.compare("--help") == 0) {
-            std::cout << "Usage: [-a ADDRESS] [-p PORT]" << std::endl;
+            std::cout << "Usage: [-a ADDRESS] [-p PORT] [-c] [--capture-fps FPS]"
+                      << " [--history-bytes BYTES] [--threads THREADS]"
+                      << " [--xvfb-fbdir DIR] [--synthetic WIDTHxHEIGHT]"
+                      << " [--synthetic-fps FPS] [--huge-pages]"
+                      << " [--prefault-bytes BYTES] [--lock-memory]"
+                      << std::endl;
             std::cout << "\t-a, --address \taddress to listen at, "
                       << "default: localhost, "
                       << "set to 0.0.0.0 to allow connections from other machines"
                       << std::endl;
             std::cout << "\t-p, --port \tport to listen at, default: 12345"
                       << std::endl;
+            std::cout << "\t-c, --capture-thread \tcapture screenshots "
+                      << "continuously in a background thread and reply with "
+                      << "the newest one"
+                      << std::endl;
+            std::cout << "\t--capture-fps \tmaximum frame rate of the "
+                      << "capture thread, default: 0 (no limit)"
+                      << std::endl;
+            std::cout << "\t--history-bytes \tmemory budget of the frame "
+                      << "history, default: 0 (history disabled)"
+                      << std::endl;
+            std::cout << "\t--threads \tnumber of threads used for "
+                      << "processing images, default: 0 (number of CPU cores)"
+                      << std::endl;
+            std::cout << "\t--xvfb-fbdir \t-fbdir directory of Xvfb, for "
+                      << "capturing from its framebuffer file, %d is "
+                      << "replaced by the display number"
+                      << std::endl;
+            std::cout << "\t--synthetic \tgenerate a moving test pattern "
+                      << "of this size instead of capturing the displays "
+                      << "(Linux only)"
+                      << std::endl;
+            std::cout << "\t--synthetic-fps \tframe rate of the test "
+                      << "pattern, default: 60, 0 = new frame on every capture"
+                      << std::endl;
+            std::cout << "\t--huge-pages \tallocate the shared memory "
+                      << "of captured images in huge pages (Linux only)"
+                      << std::endl;
+            std::cout << "\t--prefault-bytes \tallocate and touch the "
+                      << "frame buffers with room for images of this size "
+                      << "at startup, default: 0 (grow when needed)"
+                      << std::endl;
+            std::cout << "\t--lock-memory \tlock the frame buffers "
+                      << "allocated by --prefault-bytes in memory"
+                      << std::endl;
 
             return 0;
         }
     }
 
-    // Initialize platform-specific code
-    initialize();
+    // Read the framebuffer of Xvfb from memory if requested
+    try {
+        setFramebufferDir(framebufferDir);
+    } catch (const std::invalid_argument& e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+
+    // Generate test patterns instead of capturing the displays if requested
+    bool synthetic = syntheticWidth != 0 || syntheticHeight != 0;
+    if (synthetic) {
+#ifdef __linux__
+        try {
+            setCaptureSource(createSyntheticSource(syntheticWidth,
+                                                   syntheticHeight,
+                                                   syntheticFps));
+        } catch (const std::invalid_argument& e) {
+            std::cout << e.what() << std::endl;
+            return 1;
+        }
+#else
+        std::cout << "synthetic images are only supported on Linux"
+                  << std::endl;
+        return 1;
+#endif
+    }
+
+    CaptureSource* source = getCaptureSource();
+
+    // Allocate the captured images in huge pages if requested. The server
+    // runs with normal pages if they are not available.
+    if (hugePages) {
+        try {
+            size_t pageSize = enableHugePages();
+            std::cout << "Huge pages: enabled, " << pageSize / 1024
+                      << " kB pages" << std::endl;
+        } catch (const std::invalid_argument& e) {
+            std::cout << "Huge pages: disabled, " << e.what() << std::endl;
+        }
+    }
+
+    // Start the threads that process images in parallel
+    startThreadPool(threads);
+
+    // Initialize platform-specific code. The displays are not opened for
+    // synthetic images, so the server runs without a display.
+    if (!synthetic)
+        initialize();
+
+    // Keep a history of captured frames if requested
+    setHistoryBudget(historyBytes);
+
+    // Fault in (and lock) the frame buffers now instead of while capturing
+    if (prefaultBytes != 0) {
+        try {
+            reserveFrameBuffers(prefaultBytes, lockFrames);
+            std::cout << "Frame buffers: images prefaulted with "
+                      << prefaultBytes << " bytes"
+                      << (lockFrames ? " and locked" : "") << std::endl;
+        } catch (const std::invalid_argument& e) {
+            std::cout << "Frame buffers: images prefaulted with "
+                      << prefaultBytes << " bytes, locking failed: "
+                      << e.what() << std::endl;
+        }
+        std::cout << "Frame buffers: tensors, regions of interest, outputs, "
+                  << "window images and requests are not prefaulted"
+                  << std::endl;
+    } else if (lockFrames) {
+        std::cout << "Frame buffers: not locked, --lock-memory requires "
+                  << "--prefault-bytes" << std::endl;
+    }
+
+    // Start capturing in the background if requested
+    if (captureThread)
+        startCaptureThread(captureFps);
 
     // Initialize sockets
     initSocket();
@@ -61,87 +295,322 @@ int main(int argc, char** argv) {
     // Get the client socket for the first client to connect
     int clientSocket = getClientSocket(listenSocket);
     
+    // The messages are reused for every request, so that they can keep
+    // their allocated memory
+    Request reqMsg;
+    Response respMsg;
+    std::string processName;
+    std::string displayName;
+
+    // Damage generation of the image returned by the previous request
+    uint64_t lastGeneration = 0;
+
+    // Frame stacks and adaptive settings of the displays, by display name
+    std::map<std::string, DisplaySession> sessions;
+
     do {
         // Get a request from the client
-        Request reqMsg;
         try {
-            reqMsg = getRequest(clientSocket);
+            getRequest(clientSocket, &reqMsg);
         } catch (std::runtime_error e) {
             std::cout << e.what() << std::endl;
+            stopCaptureThread();
             shutdownSocket();
-            shutdown();
+            if (!synthetic)
+                shutdown();
+            stopThreadPool();
             return 1;
         } catch (std::invalid_argument e) {
             std::cout << e.what() << std::endl;
             continue;
         }
 
-        // Create a response message
-        Response respMsg;
+        // Clear the response message
+        respMsg.Clear();
+
+        // Buffers sent as part of the response without copying them
+        Attachment attachments[MAX_ATTACHMENTS];
+        int attachmentCount = 0;
+
+        // Inputs and images of the request are of this display
+        try {
+            source->selectDisplay(reqMsg.display());
+        } catch (const std::invalid_argument& e) {
+            std::cout << "Exception in selectDisplay: "
+                      << e.what() << std::endl;
+            respMsg.set_error(e.what());
+            respMsg.set_timestamp(getTimestamp());
+            sendResponse(respMsg, clientSocket, attachments, 0);
+            continue;
+        }
 
         bool userOverride = reqMsg.allow_user_override();
 
+        // Synthetic images have no inputs, so they are ignored
+        bool hasInputs = source->hasInputs();
+
         // Press/release requested keys
-        for (int i = 0; i < reqMsg.press_keys_size(); i++)
+        for (int i = 0; hasInputs && i < reqMsg.press_keys_size(); i++)
             sendKey(reqMsg.press_keys(i), true, userOverride);
 
-        for (int i = 0; i < reqMsg.release_keys_size(); i++)
+        for (int i = 0; hasInputs && i < reqMsg.release_keys_size(); i++)
             sendKey(reqMsg.release_keys(i), false, userOverride);
 
         // Move mouse cursor according to request
-        if (!(reqMsg.mouse().x() == 0 && reqMsg.mouse().y() == 0))
+        if (hasInputs && !(reqMsg.mouse().x() == 0 && reqMsg.mouse().y() == 0))
             moveMouse(reqMsg.mouse().x(), reqMsg.mouse().y());
 
         // If client requested an image
         if (reqMsg.get_image()) {
-            // Take screenshot
-            std::string processName = reqMsg.process_name();
-
-            char* imageBuffer = NULL;
+            // Take screenshot. The previous image doesn't count if it
+            // was of another window.
+            if (reqMsg.process_name() != processName
+                || reqMsg.display() != displayName) {
+                lastGeneration = 0;
+            }
+            processName = reqMsg.process_name();
+            displayName = reqMsg.display();
+            DisplaySession& session = sessions[displayName];
 
-            START_TIMER("getJPGScreenshot");
+            START_TIMER("getFrame");
 
             try {
-                unsigned long imageBytes = getJPGScreenshot(&processName,
-                                                            &imageBuffer,
-                                                            reqMsg.quality());
-                respMsg.set_image(imageBuffer, imageBytes);
+                ImageOptions options;
+                options.format = reqMsg.format();
+                options.quality = reqMsg.quality();
+                options.width = reqMsg.width();
+                options.height = reqMsg.height();
+                options.filter = reqMsg.resize_filter();
+                options.resizeBackend = reqMsg.resize_backend();
+                options.region.x = reqMsg.region().x();
+                options.region.y = reqMsg.region().y();
+                options.region.width = reqMsg.region().width();
+                options.region.height = reqMsg.region().height();
+                options.monitor = reqMsg.monitor();
+                options.maxPool = reqMsg.max_pool_frames();
+                options.tileSize = reqMsg.tile_size();
+                options.tilesOnly = reqMsg.tiles_only();
+                options.subsampling = reqMsg.subsampling();
+                options.jpegBands = reqMsg.jpeg_bands();
+
+                for (const RegionOfInterest& roi : reqMsg.rois()) {
+                    RoiSettings settings;
+                    settings.region.x = roi.rect().x();
+                    settings.region.y = roi.rect().y();
+                    settings.region.width = roi.rect().width();
+                    settings.region.height = roi.rect().height();
+                    settings.quality = roi.quality();
+                    options.rois.push_back(settings);
+                }
+
+                if (reqMsg.outputs_size() > MAX_OUTPUTS)
+                    throw std::invalid_argument("too many outputs");
+
+                for (const OutputSpec& spec : reqMsg.outputs()) {
+                    OutputSettings output;
+                    output.crop.x = spec.crop().x();
+                    output.crop.y = spec.crop().y();
+                    output.crop.width = spec.crop().width();
+                    output.crop.height = spec.crop().height();
+                    output.width = spec.width();
+                    output.height = spec.height();
+                    output.filter = spec.resize_filter();
+                    output.format = spec.format();
+                    output.quality = spec.quality();
+                    output.subsampling = spec.subsampling();
+                    options.outputs.push_back(output);
+                }
+
+                if (reqMsg.window_names_size() > MAX_WINDOWS)
+                    throw std::invalid_argument("too many windows");
+
+                for (const std::string& name : reqMsg.window_names())
+                    options.windows.push_back(name);
+
+                if (reqMsg.stack_frames() > MAX_STACK_FRAMES)
+                    throw std::invalid_argument("too many stack frames");
+
+                options.windowPid = reqMsg.window_pid();
+                options.windowClass = reqMsg.window_class();
+                options.captureBackend = reqMsg.capture_backend();
+
+                if (reqMsg.has_tensor())
+                    setTensorSettings(reqMsg.tensor(), &options.tensor);
+
+                // Wait for the window to change since the previous image
+                uint64_t minGeneration = 0;
+                if (reqMsg.damage_timeout() != 0) {
+                    minGeneration = source->waitForChange(
+                        lastGeneration, reqMsg.damage_timeout());
+                }
+
+                // Let the server choose the quality and scale
+                if (reqMsg.has_adaptive()) {
+                    setAdaptiveTarget(reqMsg.adaptive(), options,
+                                      &session.adaptive);
+                    applyAdaptiveSettings(&session.adaptive, &options);
+                }
+
+                uint64_t frameStart = getTimestamp();
+                Frame* frame = getFrame(displayName, &processName, options,
+                                        minGeneration);
+                lastGeneration = frame->damageGeneration;
+
+                if (reqMsg.has_adaptive()) {
+                    updateAdaptiveSettings(*frame, getTimestamp() - frameStart,
+                                           &session.adaptive);
+                    getAdaptiveSettings(*frame, respMsg.mutable_adaptive());
+                }
+
+                ImageBuffer* image = &frame->image;
+                respMsg.set_image_format(image->format());
+                respMsg.set_image_width(image->width());
+                respMsg.set_image_height(image->height());
+                attachments[attachmentCount++] = {
+                    Response::kImageFieldNumber, image
+                };
+
+                if (!frame->tensor.empty()) {
+                    addTensorShape(options.tensor, image, &respMsg);
+                    attachments[attachmentCount++] = {
+                        Response::kTensorFieldNumber, &frame->tensor
+                    };
+                }
+                respMsg.set_image_age(getTimestamp() - frame->timestamp);
+                respMsg.set_image_timestamp(frame->timestamp);
+                respMsg.set_encode_time(frame->encodeTime);
+                if (!image->empty()) {
+                    respMsg.set_compression_ratio(
+                        3.0 * image->width() * image->height() / image->size());
+                }
+
+                respMsg.set_damage_generation(frame->damageGeneration);
+
+                for (uint32_t offset : frame->bandOffsets)
+                    respMsg.add_jpeg_band_offsets(offset);
+                respMsg.set_jpeg_band_height(frame->bandHeight);
+
+                // Additional outputs are sent straight from their buffers
+                for (size_t i = 0; i < frame->options.outputs.size(); i++) {
+                    ImageBuffer* output = &frame->outputImages[i];
+
+                    OutputInfo* info = respMsg.add_outputs();
+                    info->set_format(output->format());
+                    info->set_width(output->width());
+                    info->set_height(output->height());
+                    attachments[attachmentCount++] = {
+                        Response::kOutputImagesFieldNumber, output
+                    };
+                }
+
+                for (size_t i = 0; i < frame->windowRegions.size(); i++) {
+                    const CaptureRegion& region = frame->windowRegions[i];
+                    ImageBuffer* windowImage = &frame->windowImages[i];
+
+                    WindowInfo* info = respMsg.add_windows();
+                    info->set_name(frame->options.windows[i]);
+                    info->mutable_rect()->set_x(region.x);
+                    info->mutable_rect()->set_y(region.y);
+                    info->mutable_rect()->set_width(region.width);
+                    info->mutable_rect()->set_height(region.height);
+                    info->set_format(windowImage->format());
+                    info->set_width(windowImage->width());
+                    info->set_height(windowImage->height());
+                    attachments[attachmentCount++] = {
+                        Response::kWindowImagesFieldNumber, windowImage
+                    };
+                }
+
+                // Regions of interest are small, so they are copied
+                for (size_t i = 0; i < frame->roiRegions.size(); i++) {
+                    const CaptureRegion& region = frame->roiRegions[i];
+                    const ImageBuffer& roiImage = frame->roiImages[i];
+
+                    RoiImage* roi = respMsg.add_rois();
+                    roi->mutable_rect()->set_x(region.x);
+                    roi->mutable_rect()->set_y(region.y);
+                    roi->mutable_rect()->set_width(region.width);
+                    roi->mutable_rect()->set_height(region.height);
+                    roi->set_image(roiImage.data(), roiImage.size());
+                }
+
+                if (frame->tiles.tile_size() != 0)
+                    *respMsg.mutable_tiles() = frame->tiles;
+
+                // Stack of the newest images returned to this client,
+                // sent straight from the buffers of the stack
+                FrameStack* stack = &session.stack;
+                if (reqMsg.stack_frames() != 0 && !options.tilesOnly
+                    && addToFrameStack(*frame, reqMsg.stack_frames(), stack)) {
+                    for (StackEntry& entry : stack->entries) {
+                        TimedImage* timedImage = respMsg.add_stack();
+                        timedImage->set_timestamp(entry.timestamp);
+                        timedImage->set_format(stack->format);
+                        timedImage->set_width(stack->width);
+                        timedImage->set_height(stack->height);
+                        attachments[attachmentCount++] = {
+                            Response::kStackImagesFieldNumber, &entry.image
+                        };
+                    }
+                }
             } catch (const std::invalid_argument& e) {
-                std::cout << "Exception in getJPGScreenshot: " 
+                std::cout << "Exception in getFrame: " 
                           << e.what() << std::endl;
+                respMsg.set_error(e.what());
             }
-            END_TIMER("getJPGScreenshot");
+            END_TIMER("getFrame");
+        }
+
+        // If client requested frames from the history
+        if (reqMsg.frame_at_time() != 0 || reqMsg.last_frames() != 0) {
+            if (getHistoryBudget() == 0)
+                respMsg.set_error("frame history is disabled");
+
+            if (reqMsg.frame_at_time() != 0)
+                getHistoryFrameAt(reqMsg.frame_at_time(), &respMsg);
 
-            delete[] imageBuffer;
+            if (reqMsg.last_frames() != 0)
+                getHistoryLastFrames(reqMsg.last_frames(), &respMsg);
         }
 
         // If client requested key states
-        if (reqMsg.get_keys()) {
+        if (reqMsg.get_keys() && hasInputs) {
             auto keys = getKeys();
             for (auto key : keys)
                 respMsg.add_pressed_keys(key);
         }
 
         // If client requested mouse position
-        if (reqMsg.get_mouse()) {
+        if (reqMsg.get_mouse() && hasInputs) {
             auto mouse = getMouse();
             respMsg.mutable_mouse()->set_x(mouse.first);
             respMsg.mutable_mouse()->set_y(mouse.second);
         }
 
+        respMsg.set_timestamp(getTimestamp());
+
         START_TIMER("sendResponse");
 
-        // Send the response
-        int bytesSent = sendResponse(respMsg, clientSocket);
+        // Send the response, the image and tensor are sent straight from
+        // the frame buffers
+        int bytesSent = sendResponse(respMsg, clientSocket, attachments,
+                                     attachmentCount);
 
         END_TIMER("sendResponse");
     } while (true);
 
+    // Stop the background capture thread
+    stopCaptureThread();
+
     // Shut down sockets
     shutdownSocket();
 
     // Shut down platform-specific code
-    shutdown();
+    if (!synthetic)
+        shutdown();
+
+    // Stop the image processing threads
+    stopThreadPool();
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,132 @@
+/*
+    Pixel-wise maximum over consecutive captures (flicker removal).
+
+    The previous captures are kept in a ring of tightly packed BGRX images.
+    Each row of a new capture is combined with the same row of the previous
+    captures and copied into the ring while it is still in the cache.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "maxpool.hpp"
+#include "cpu.hpp"
+#include "threadpool.hpp"
+
+// Minimum number of rows given to a thread at a time
+const unsigned int ROWS_PER_RANGE = 16;
+
+// Computes dst = max(dst, src) for bytes [x, count)
+inline void maxRowScalar(const unsigned char* src, unsigned char* dst,
+                         unsigned int x, unsigned int count) {
+    for (; x < count; x++) {
+        if (src[x] > dst[x])
+            dst[x] = src[x];
+    }
+}
+
+#ifdef __SSE2__
+// Computes the maximum 16 bytes at a time,
+// returns the index of the first byte left unprocessed
+unsigned int maxRowSSE2(const unsigned char* src, unsigned char* dst,
+                        unsigned int x, unsigned int count) {
+    for (; x + 16 <= count; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + x));
+        __m128i b = _mm_loadu_si128((const __m128i*)(dst + x));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_max_epu8(a, b));
+    }
+    return x;
+}
+#endif
+
+#ifdef X86_DISPATCH
+// Computes the maximum 32 bytes at a time,
+// returns the index of the first byte left unprocessed
+__attribute__((target("avx2")))
+unsigned int maxRowAVX2(const unsigned char* src, unsigned char* dst,
+                        unsigned int x, unsigned int count) {
+    for (; x + 32 <= count; x += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(src + x));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(dst + x));
+        _mm256_storeu_si256((__m256i*)(dst + x), _mm256_max_epu8(a, b));
+    }
+    return x;
+}
+#endif
+
+void maxRow(const unsigned char* src, unsigned char* dst, unsigned int count) {
+    unsigned int x = 0;
+
+    #ifdef X86_DISPATCH
+        if (cpuHasAVX2)
+            x = maxRowAVX2(src, dst, x, count);
+    #endif
+    #ifdef __SSE2__
+        x = maxRowSSE2(src, dst, x, count);
+    #endif
+
+    maxRowScalar(src, dst, x, count);
+}
+
+void resetMaxPool(MaxPool* pool) {
+    pool->ringCount = 0;
+    pool->ringStart = 0;
+}
+
+void maxPoolImage(RawImage* raw, unsigned int frames, MaxPool* pool) {
+    if (frames <= 1) {
+        resetMaxPool(pool);
+        return;
+    }
+
+    std::vector<std::vector<unsigned char>>& ring = pool->ring;
+    std::vector<unsigned char>& pooled = pool->pooled;
+
+    // Start over if the size of the images or the number of frames changed
+    if (raw->width != pool->width || raw->height != pool->height
+        || ring.size() != frames - 1) {
+        resetMaxPool(pool);
+        ring.resize(frames - 1);
+        pool->width = raw->width;
+        pool->height = raw->height;
+    }
+
+    unsigned int ringStart = pool->ringStart;
+    unsigned int ringCount = pool->ringCount;
+
+    size_t rowBytes = (size_t)raw->width * 4;
+    size_t imageBytes = rowBytes * raw->height;
+    pooled.resize(imageBytes);
+
+    // The new capture replaces the oldest one once the ring is full
+    unsigned int slot = (ringStart + ringCount) % ring.size();
+    ring[slot].resize(imageBytes);
+
+    parallelFor(raw->height, ROWS_PER_RANGE,
+                [&](unsigned int begin, unsigned int end) {
+        for (unsigned int y = begin; y < end; y++) {
+            const unsigned char* src = (const unsigned char*)raw->data
+                                       + (size_t)y * raw->stride;
+            unsigned char* dst = pooled.data() + y * rowBytes;
+            memcpy(dst, src, rowBytes);
+
+            for (unsigned int i = 0; i < ringCount; i++) {
+                unsigned int previous = (ringStart + i) % ring.size();
+                maxRow(ring[previous].data() + y * rowBytes, dst, rowBytes);
+            }
+
+            // When the ring is full, this overwrites the row of the oldest
+            // capture after it has been used
+            memcpy(ring[slot].data() + y * rowBytes, src, rowBytes);
+        }
+    });
+
+    if (ringCount < ring.size())
+        pool->ringCount++;
+    else
+        pool->ringStart = (ringStart + 1) % ring.size();
+
+    raw->data = (const char*)pooled.data();
+    raw->stride = rowBytes;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+
+#include "image.hpp"
+
+/*
+    The previous captures of one display (or other capture target) that
+    its next captures are max-pooled with (see maxPoolImage)
+ */
+struct MaxPool {
+    // Previous captures as tightly packed images, oldest one at ringStart
+    std::vector<std::vector<unsigned char>> ring;
+    unsigned int ringStart = 0;
+
+    // Number of captures in the ring and their size
+    unsigned int ringCount = 0;
+    unsigned int width = 0;
+    unsigned int height = 0;
+
+    // The pooled image
+    std::vector<unsigned char> pooled;
+};
+
+/*
+    Replaces the image with the pixel-wise maximum of it and the frames-1
+    images given to the previous calls with the same pool, and keeps a copy
+    of the image in the pool for the next calls. This removes the flicker
+    of sprites that are only drawn on every other frame. frames <= 1
+    disables max-pooling.
+
+    raw is changed to point to the pooled image, which stays valid until
+    the next call. The previous images are dropped when the size of the
+    image or the number of frames changes, or when resetMaxPool is called.
+ */
+void maxPoolImage(RawImage* raw, unsigned int frames, MaxPool* pool);
+
+/*
+    Drops the previous images, for example when another window is captured.
+ */
+void resetMaxPool(MaxPool* pool);
@@ -1,6 +1,8 @@
 #include <string>
 #include <set>
 
+#include "image.hpp"
+
 // Functions that are implemented by all platforms
 
 /*
@@ -16,25 +18,98 @@ void initialize();
 void shutdown();
 
 /*
-    Captures a JPG screenshot of the entire display or a specific window.
+    Selects the display that the calling thread captures and sends inputs
+    to with the other functions. The display is opened (with its own event
+    thread) the first time it is selected. An empty name selects the
+    default display, which initialize selects for the thread that calls it.
+
+    Throws invalid_argument if the display could not be opened.
+    Note: Only supported on Linux/X11, where the name is an X display name
+    (for example ":1"). Other platforms throw invalid_argument for any other
+    name than an empty one.
+ */
+void selectDisplay(const std::string& name);
+
+/*
+    Sets the directory that Xvfb writes its framebuffer to (the -fbdir
+    argument of Xvfb). Displays opened after this map the framebuffer file
+    into memory, and capture_backend CAPTURE_FRAMEBUFFER then reads the
+    pixels from it without asking the X server for them. "%d" in the
+    directory is replaced by the display number, so that every Xvfb can
+    have a directory of its own. Should be called before initialize.
+
+    Note: Only supported on Linux/X11. Other platforms throw
+    invalid_argument for any other directory than an empty one.
+ */
+void setFramebufferDir(const std::string& dir);
+
+/*
+    Makes the shared memory that images are captured into be allocated in
+    huge pages (SHM_HUGETLB), so that capturing large images touches fewer
+    pages. Segments fall back to normal pages when the reserved huge pages
+    run out. Should be called before initialize.
+    Returns the size of a huge page in bytes.
+
+    Throws invalid_argument if huge pages are not available, for example
+    because none are reserved in /proc/sys/vm/nr_hugepages.
+    Note: Only supported on Linux/X11. Other platforms always throw
+    invalid_argument.
+ */
+size_t enableHugePages();
+
+/*
+    Locks the given memory in RAM, so that it is never paged out.
+
+    Throws invalid_argument if the memory could not be locked, for example
+    because it would exceed the limit of locked memory (ulimit -l).
+ */
+void lockMemory(const void* data, size_t bytes);
+
+/*
+    Captures a screenshot of the entire display or a specific window.
 
     If processName is an empty string, the screenshot will be of the entire
     display. Otherwise a specific window will be captured.
     On Windows the name refers to the process that created the window.
-    On Linux/X11 the name refers to the WM_NAME property of the window.
+    On Linux/X11 the name refers to the WM_NAME property of the window,
+    and the window can also be selected by the PID and class in options.
+
+    The options parameter defines the format of the image and the encoding
+    quality of the JPG, which should be between 0 and 100.
+    Other formats than JPG and tensors are only supported on Linux/X11,
+    other platforms throw invalid_argument for them.
+
+    If windows are given in the options (only on Linux/X11), processName
+    has to be empty, and the windows are cropped from one capture of the
+    display into the window images of the frame instead.
+
+    The image is written to the image buffer of the given frame, which only
+    allocates memory if it is too small for the image. The format and size
+    of the image are stored in the buffer as well. If a tensor is enabled
+    in the options, it is written to the tensor buffer of the frame.
+    The function returns the size of the image in bytes.
+ */
+unsigned long getScreenshot(std::string* processName, Frame* frame,
+                            const ImageOptions& options);
 
-    The quality parameter is the encoding quality of the JPG, and should
-    be between 0 and 100.
+/*
+    Returns a counter that is incremented whenever the window captured by
+    the latest call to getScreenshot is drawn to, or when another window
+    is captured. Two captures of the same window with the same generation
+    have the same image.
 
-    The function will allocate memory for the screenshot and store its pointer
-    in the address given by the imageBuffer parameter. The function returns
-    the size of the image buffer in bytes.
+    Returns 0 if changes are not tracked.
+    Note: Only tracked on Linux/X11 (with the XDamage extension)
+ */
+uint64_t getDamageGeneration();
 
-    NOTE: The image buffer should be freed after it's no longer needed
-    by calling delete[] on it.
+/*
+    Waits until the damage generation is different from the given one,
+    or until timeout milliseconds have passed, and returns the current
+    generation. Returns immediately if changes are not tracked or if the
+    given generation is 0.
  */
-unsigned long getJPGScreenshot(std::string* processName, char** imageBuffer,
-                               unsigned int quality);
+uint64_t waitForDamage(uint64_t generation, unsigned int timeout);
 
 /*
     Moves the mouse cursor by the given amount of pixels.
@@ -99,7 +174,7 @@ std::pair<long, long> getMouse();
     // screen.cpp
     Gdiplus::Bitmap* takeScreenshot(HWND window);
 
-    ULONG bitmapToJPG(Gdiplus::Bitmap* bitmap, char** imageBuffer,
+    ULONG bitmapToJPG(Gdiplus::Bitmap* bitmap, ImageBuffer* imageBuffer,
                       unsigned int quality);
 
     bool CALLBACK enumWindowsCallback(HWND hwnd, LPARAM lParam);
@@ -114,11 +189,16 @@ std::pair<long, long> getMouse();
 #ifdef __linux__
     #include <X11/Xlib.h>
 
+    struct DisplayContext;
+
+    DisplayContext* openDisplay(const std::string& name);
+
     void initShm(Window window);
 
-    Window findWindowRecursive(Window window, std::string* name);
+    Window findWindow(const std::string& name, unsigned long pid,
+                      const std::string& windowClass);
 
-    void eventThread();
+    void eventThread(DisplayContext* displayContext);
 #endif
 #ifdef __APPLE__
     void eventThread();
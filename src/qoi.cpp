@@ -0,0 +1,182 @@
+/*
+    Lossless QOI encoder for captured BGRX images.
+
+    QOI encodes each pixel as a run of the previous pixel, a reference to
+    a recently seen pixel, a small difference to the previous pixel or the
+    full color. The encoder works on pixels as 32-bit integers with the
+    unused X byte masked out, so a pixel is compared with a single integer
+    comparison.
+*/
+
+#include <cstdint>
+#include <cstring>
+
+#include "qoi.hpp"
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+const unsigned char QOI_OP_INDEX = 0x00;
+const unsigned char QOI_OP_DIFF = 0x40;
+const unsigned char QOI_OP_LUMA = 0x80;
+const unsigned char QOI_OP_RUN = 0xc0;
+const unsigned char QOI_OP_RGB = 0xfe;
+
+// Longest run a single QOI_OP_RUN can encode
+const unsigned int QOI_MAX_RUN = 62;
+
+const size_t QOI_HEADER_SIZE = 14;
+const unsigned char QOI_END_MARKER[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+// Masks out the X byte of a BGRX pixel
+const uint32_t COLOR_MASK = 0x00ffffff;
+
+size_t getQOIMaxSize(unsigned int width, unsigned int height) {
+    // Worst case is QOI_OP_RGB (4 bytes) for every pixel
+    return (size_t)width * height * 4 + QOI_HEADER_SIZE
+           + sizeof(QOI_END_MARKER);
+}
+
+inline void writeBigEndian(unsigned char* dst, uint32_t value) {
+    dst[0] = value >> 24;
+    dst[1] = value >> 16;
+    dst[2] = value >> 8;
+    dst[3] = value;
+}
+
+// Position of a pixel in the index of recently seen pixels.
+// The hash includes the alpha channel, which is always 255.
+inline unsigned int qoiHash(uint32_t pixel) {
+    unsigned int b = pixel & 0xff;
+    unsigned int g = (pixel >> 8) & 0xff;
+    unsigned int r = (pixel >> 16) & 0xff;
+    return (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+}
+
+inline uint32_t loadPixel(const unsigned char* p) {
+    uint32_t pixel;
+    memcpy(&pixel, p, 4);
+    return pixel & COLOR_MASK;
+}
+
+/*
+    Returns how many pixels starting from x are equal to pixel,
+    counting at most until width.
+ */
+inline unsigned int countRun(const unsigned char* row, unsigned int x,
+                             unsigned int width, uint32_t pixel) {
+    unsigned int start = x;
+
+    #ifdef __SSE2__
+        // Compare 4 pixels at a time
+        __m128i mask = _mm_set1_epi32(COLOR_MASK);
+        __m128i reference = _mm_set1_epi32(pixel);
+        for (; x + 4 <= width; x += 4) {
+            __m128i pixels = _mm_loadu_si128((const __m128i*)(row + x * 4));
+            __m128i equal = _mm_cmpeq_epi32(_mm_and_si128(pixels, mask),
+                                            reference);
+            if (_mm_movemask_epi8(equal) != 0xffff)
+                break;
+        }
+    #endif
+
+    while (x < width && loadPixel(row + x * 4) == pixel)
+        x++;
+
+    return x - start;
+}
+
+size_t encodeQOI(const RawImage& src, char* dst) {
+    unsigned char* out = (unsigned char*)dst;
+
+    memcpy(out, "qoif", 4);
+    writeBigEndian(out + 4, src.width);
+    writeBigEndian(out + 8, src.height);
+    out[12] = 3;    // Channels (RGB)
+    out[13] = 0;    // Colorspace (sRGB with linear alpha)
+    out += QOI_HEADER_SIZE;
+
+    // Recently seen pixels, initialized to a value no masked pixel can have
+    uint32_t index[64];
+    for (int i = 0; i < 64; i++)
+        index[i] = 0xffffffff;
+
+    // The previous pixel is black at the start
+    uint32_t previous = 0;
+
+    // Length of the current run that hasn't been written yet
+    unsigned int run = 0;
+
+    for (unsigned int y = 0; y < src.height; y++) {
+        const unsigned char* row = (const unsigned char*)src.data
+                                   + (size_t)y * src.stride;
+        unsigned int x = 0;
+
+        while (x < src.width) {
+            uint32_t pixel = loadPixel(row + x * 4);
+
+            if (pixel == previous) {
+                // Runs continue over row boundaries
+                unsigned int length = countRun(row, x, src.width, pixel);
+                run += length;
+                x += length;
+
+                while (run >= QOI_MAX_RUN) {
+                    *out++ = QOI_OP_RUN | (QOI_MAX_RUN - 1);
+                    run -= QOI_MAX_RUN;
+                }
+                continue;
+            }
+
+            if (run > 0) {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            unsigned int hash = qoiHash(pixel);
+            if (index[hash] == pixel) {
+                *out++ = QOI_OP_INDEX | hash;
+            } else {
+                index[hash] = pixel;
+
+                int b = pixel & 0xff;
+                int g = (pixel >> 8) & 0xff;
+                int r = (pixel >> 16) & 0xff;
+
+                // Differences wrap around like in the QOI decoder
+                signed char dr = r - (int)((previous >> 16) & 0xff);
+                signed char dg = g - (int)((previous >> 8) & 0xff);
+                signed char db = b - (int)(previous & 0xff);
+                signed char drg = dr - dg;
+                signed char dbg = db - dg;
+
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1
+                    && db >= -2 && db <= 1) {
+                    *out++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2
+                             | (db + 2);
+                } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7
+                           && dbg >= -8 && dbg <= 7) {
+                    *out++ = QOI_OP_LUMA | (dg + 32);
+                    *out++ = (drg + 8) << 4 | (dbg + 8);
+                } else {
+                    *out++ = QOI_OP_RGB;
+                    *out++ = r;
+                    *out++ = g;
+                    *out++ = b;
+                }
+            }
+
+            previous = pixel;
+            x++;
+        }
+    }
+
+    if (run > 0)
+        *out++ = QOI_OP_RUN | (run - 1);
+
+    memcpy(out, QOI_END_MARKER, sizeof(QOI_END_MARKER));
+    out += sizeof(QOI_END_MARKER);
+
+    return out - (unsigned char*)dst;
+}
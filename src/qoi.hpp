@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+#include "image.hpp"
+
+/*
+    Returns the largest possible size of a QOI image of the given size.
+ */
+size_t getQOIMaxSize(unsigned int width, unsigned int height);
+
+/*
+    Encodes a BGRX image losslessly as a QOI image (https://qoiformat.org)
+    with 3 channels, and writes it to dst, which must have room for
+    getQOIMaxSize bytes. Returns the size of the encoded image.
+
+    The output is a standard QOI file, so it can be decoded by any QOI
+    decoder (for example Pillow). Long runs of identical pixels, which are
+    common in game screens, are detected with SSE2.
+ */
+size_t encodeQOI(const RawImage& src, char* dst);
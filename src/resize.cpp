@@ -0,0 +1,582 @@
+/*
+    Scales captured BGRX images to a smaller (or larger) size before they
+    are encoded.
+
+    The filters read the source pixels straight from the captured image, so
+    cropping is free: the source can be any rectangle of the capture.
+    The output rows are split between the threads of the thread pool.
+
+    Area averaging is done in two passes per output row: the source rows
+    covered by the output row are summed into a row of 32-bit values with
+    vertical weights and rounded to 16 bits, and the columns of that row
+    are then summed with horizontal weights. Both passes use integer
+    weights, and the SSE2/AVX2 kernels produce exactly the same output as
+    the plain C++ code.
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "resize.hpp"
+#include "cpu.hpp"
+#include "threadpool.hpp"
+
+// Sum of the vertical area weights. The weights of large downscales are
+// small, so they need the precision of the 32-bit vertical sums.
+const int VERTICAL_ONE = 1 << 14;
+
+// The vertical sums are shifted down by this for the horizontal pass, so
+// that a byte times the remaining weight fits in a signed 16-bit integer,
+// which the SSE2 multiply-add needs
+const int VERTICAL_SHIFT = 7;
+
+// Sum of the horizontal area weights
+const int HORIZONTAL_ONE = 1 << 14;
+const int AREA_SHIFT = 21;
+
+// Bilinear weights in both directions
+const int BILINEAR_ONE = 128;
+const int BILINEAR_SHIFT = 14;
+
+// Minimum number of output rows given to a thread at a time
+const unsigned int ROWS_PER_RANGE = 4;
+
+/*
+    Source pixels and weights that make up each output pixel along one axis.
+    Output pixel i is the weighted sum of count[i] source pixels starting
+    from first[i], with weights starting from weights[offset[i]].
+ */
+struct FilterTaps {
+    std::vector<unsigned int> first;
+    std::vector<unsigned int> count;
+    std::vector<unsigned int> offset;
+    std::vector<int16_t> weights;
+};
+
+/*
+    Taps of one axis, kept by the thread that resizes between calls, since
+    the source and output sizes rarely change from one frame to the next
+ */
+template <typename Taps>
+struct CachedTaps {
+    unsigned int srcSize = 0;
+    unsigned int dstSize = 0;
+    Taps taps;
+};
+
+// Returns true if the cached taps are for the given sizes. Otherwise the
+// sizes are stored, and the caller computes the taps for them.
+template <typename Taps>
+bool isCached(unsigned int srcSize, unsigned int dstSize,
+              CachedTaps<Taps>* cached) {
+    if (cached->srcSize == srcSize && cached->dstSize == dstSize)
+        return true;
+
+    cached->srcSize = srcSize;
+    cached->dstSize = dstSize;
+    return false;
+}
+
+/*
+    Computes the area averaging weights for scaling srcSize pixels to
+    dstSize pixels. The weights of each output pixel sum to exactly total,
+    so flat areas keep their exact color.
+
+    Each weight is the difference of the rounded running sums of the exact
+    weights, so the rounding errors don't add up and no weight is negative
+    however many source pixels an output pixel covers.
+
+    If pairs is set, the number of taps of every output pixel is rounded up
+    to an even number with zero weights, so taps can be processed in pairs.
+ */
+void getAreaTaps(unsigned int srcSize, unsigned int dstSize, int total,
+                 bool pairs, FilterTaps* taps) {
+    taps->first.resize(dstSize);
+    taps->count.resize(dstSize);
+    taps->offset.resize(dstSize);
+    taps->weights.clear();
+
+    for (unsigned int i = 0; i < dstSize; i++) {
+        // Output pixel i covers [start, end) in units of 1 / dstSize
+        // source pixels, and source pixel s covers [s, s + 1) * dstSize
+        uint64_t start = (uint64_t)i * srcSize;
+        uint64_t end = start + srcSize;
+        unsigned int first = start / dstSize;
+        unsigned int last = (end - 1) / dstSize;
+
+        taps->first[i] = first;
+        taps->count[i] = last - first + 1;
+        taps->offset[i] = taps->weights.size();
+
+        // Rounded sum of the weights of the previous taps
+        int sum = 0;
+        for (unsigned int s = first; s <= last; s++) {
+            uint64_t overlapEnd = (uint64_t)(s + 1) * dstSize;
+            if (overlapEnd > end)
+                overlapEnd = end;
+
+            int next = ((overlapEnd - start) * total + srcSize / 2) / srcSize;
+            taps->weights.push_back(next - sum);
+            sum = next;
+        }
+
+        if (pairs && taps->count[i] % 2 == 1) {
+            taps->weights.push_back(0);
+            taps->count[i]++;
+        }
+    }
+}
+
+/*
+    Area averaging, vertical pass
+*/
+
+// Adds the bytes [x, count) of the row times weight to the sums
+inline void accumulateRowScalar(const unsigned char* row, uint32_t* sums,
+                                unsigned int x, unsigned int count,
+                                int weight, bool first) {
+    if (first) {
+        for (; x < count; x++)
+            sums[x] = row[x] * weight;
+    } else {
+        for (; x < count; x++)
+            sums[x] += row[x] * weight;
+    }
+}
+
+#ifdef __SSE2__
+// Multiplies 8 16-bit values by the weight into 8 32-bit products and
+// adds them to the sums (or stores them if first is set)
+inline void accumulateProductsSSE2(__m128i values, __m128i w, __m128i* out,
+                                   bool first) {
+    // The values and weights are non-negative, so the products are the
+    // unsigned high and low halves put back together
+    __m128i low = _mm_mullo_epi16(values, w);
+    __m128i high = _mm_mulhi_epu16(values, w);
+    __m128i lo = _mm_unpacklo_epi16(low, high);
+    __m128i hi = _mm_unpackhi_epi16(low, high);
+
+    if (!first) {
+        lo = _mm_add_epi32(lo, _mm_loadu_si128(out));
+        hi = _mm_add_epi32(hi, _mm_loadu_si128(out + 1));
+    }
+    _mm_storeu_si128(out, lo);
+    _mm_storeu_si128(out + 1, hi);
+}
+
+// Adds the row to the sums 16 bytes at a time,
+// returns the index of the first byte left unprocessed
+unsigned int accumulateRowSSE2(const unsigned char* row, uint32_t* sums,
+                               unsigned int x, unsigned int count,
+                               int weight, bool first) {
+    __m128i w = _mm_set1_epi16(weight);
+    __m128i zero = _mm_setzero_si128();
+
+    for (; x + 16 <= count; x += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)(row + x));
+        __m128i* out = (__m128i*)(sums + x);
+        accumulateProductsSSE2(_mm_unpacklo_epi8(bytes, zero), w, out, first);
+        accumulateProductsSSE2(_mm_unpackhi_epi8(bytes, zero), w, out + 2,
+                               first);
+    }
+    return x;
+}
+#endif
+
+#ifdef X86_DISPATCH
+// Adds the row to the sums 32 bytes at a time,
+// returns the index of the first byte left unprocessed
+__attribute__((target("avx2")))
+unsigned int accumulateRowAVX2(const unsigned char* row, uint32_t* sums,
+                               unsigned int x, unsigned int count,
+                               int weight, bool first) {
+    __m256i w = _mm256_set1_epi32(weight);
+
+    for (; x + 32 <= count; x += 32) {
+        for (int part = 0; part < 4; part++) {
+            __m128i bytes = _mm_loadl_epi64(
+                (const __m128i*)(row + x + part * 8));
+            __m256i products = _mm256_mullo_epi32(
+                _mm256_cvtepu8_epi32(bytes), w);
+
+            __m256i* out = (__m256i*)(sums + x + part * 8);
+            if (!first)
+                products = _mm256_add_epi32(products, _mm256_loadu_si256(out));
+            _mm256_storeu_si256(out, products);
+        }
+    }
+    return x;
+}
+#endif
+
+void accumulateRow(const unsigned char* row, uint32_t* sums,
+                   unsigned int count, int weight, bool first) {
+    unsigned int x = 0;
+
+    #ifdef X86_DISPATCH
+        if (cpuHasAVX2)
+            x = accumulateRowAVX2(row, sums, x, count, weight, first);
+    #endif
+    #ifdef __SSE2__
+        x = accumulateRowSSE2(row, sums, x, count, weight, first);
+    #endif
+
+    accumulateRowScalar(row, sums, x, count, weight, first);
+}
+
+// Rounds the vertical sums to the precision of the horizontal pass
+void narrowSums(const uint32_t* sums, uint16_t* narrow, unsigned int count) {
+    unsigned int x = 0;
+
+    #ifdef __SSE2__
+        __m128i round = _mm_set1_epi32(1 << (VERTICAL_SHIFT - 1));
+
+        for (; x + 8 <= count; x += 8) {
+            const __m128i* p = (const __m128i*)(sums + x);
+            __m128i lo = _mm_srli_epi32(
+                _mm_add_epi32(_mm_loadu_si128(p), round), VERTICAL_SHIFT);
+            __m128i hi = _mm_srli_epi32(
+                _mm_add_epi32(_mm_loadu_si128(p + 1), round), VERTICAL_SHIFT);
+
+            // The results fit in a signed 16-bit integer,
+            // so the saturation never happens
+            _mm_storeu_si128((__m128i*)(narrow + x), _mm_packs_epi32(lo, hi));
+        }
+    #endif
+
+    for (; x < count; x++)
+        narrow[x] = (sums[x] + (1 << (VERTICAL_SHIFT - 1))) >> VERTICAL_SHIFT;
+}
+
+/*
+    Area averaging, horizontal pass
+*/
+
+// Sums the pixels [x, width) of the output row from the vertical sums
+inline void areaColumnsScalar(const uint16_t* sums, unsigned char* dst,
+                              unsigned int x, unsigned int width,
+                              const FilterTaps& taps) {
+    for (; x < width; x++) {
+        const uint16_t* p = sums + taps.first[x] * 4;
+        const int16_t* w = &taps.weights[taps.offset[x]];
+
+        for (int c = 0; c < 4; c++) {
+            int sum = 0;
+            for (unsigned int i = 0; i < taps.count[x]; i++)
+                sum += p[i * 4 + c] * w[i];
+
+            dst[x * 4 + c] = (sum + (1 << (AREA_SHIFT - 1))) >> AREA_SHIFT;
+        }
+    }
+}
+
+#ifdef __SSE2__
+// Sums the pixels of the output row from the vertical sums, two source
+// pixels at a time (taps were computed with pairs set)
+unsigned int areaColumnsSSE2(const uint16_t* sums, unsigned char* dst,
+                             unsigned int x, unsigned int width,
+                             const FilterTaps& taps) {
+    __m128i round = _mm_set1_epi32(1 << (AREA_SHIFT - 1));
+
+    for (; x < width; x++) {
+        const uint16_t* p = sums + taps.first[x] * 4;
+        const int16_t* w = &taps.weights[taps.offset[x]];
+        __m128i sum = _mm_setzero_si128();
+
+        for (unsigned int i = 0; i < taps.count[x]; i += 2) {
+            // Interleave the channels of the two pixels and multiply-add
+            // them with their weights
+            __m128i pair = _mm_loadu_si128((const __m128i*)(p + i * 4));
+            pair = _mm_unpacklo_epi16(pair, _mm_srli_si128(pair, 8));
+
+            __m128i weights = _mm_set1_epi32(
+                (uint16_t)w[i] | ((uint32_t)(uint16_t)w[i + 1] << 16));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, weights));
+        }
+
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), AREA_SHIFT);
+        sum = _mm_packs_epi32(sum, sum);
+        sum = _mm_packus_epi16(sum, sum);
+        *(int32_t*)(dst + x * 4) = _mm_cvtsi128_si32(sum);
+    }
+    return x;
+}
+#endif
+
+void resizeArea(const RawImage& src, unsigned int width, unsigned int height,
+                char* dst) {
+    thread_local CachedTaps<FilterTaps> cachedRows, cachedColumns;
+    if (!isCached(src.height, height, &cachedRows))
+        getAreaTaps(src.height, height, VERTICAL_ONE, false, &cachedRows.taps);
+    if (!isCached(src.width, width, &cachedColumns))
+        getAreaTaps(src.width, width, HORIZONTAL_ONE, true,
+                    &cachedColumns.taps);
+
+    // The workers see their own thread_local variables, so they are given
+    // the taps of this thread by reference
+    const FilterTaps& rowTaps = cachedRows.taps;
+    const FilterTaps& columnTaps = cachedColumns.taps;
+
+    parallelFor(height, ROWS_PER_RANGE,
+                [&](unsigned int begin, unsigned int end) {
+        // Vertical sums of one output row, and the sums rounded for the
+        // horizontal pass. The padding covers the zero weight tap that may
+        // follow the last source pixel.
+        thread_local std::vector<uint32_t> wideSums;
+        thread_local std::vector<uint16_t> sums;
+        wideSums.resize(src.width * 4);
+        sums.resize(src.width * 4 + 8);
+
+        for (unsigned int y = begin; y < end; y++) {
+            const int16_t* w = &rowTaps.weights[rowTaps.offset[y]];
+
+            for (unsigned int i = 0; i < rowTaps.count[y]; i++) {
+                const unsigned char* row = (const unsigned char*)src.data
+                    + (size_t)(rowTaps.first[y] + i) * src.stride;
+                accumulateRow(row, wideSums.data(), src.width * 4, w[i],
+                              i == 0);
+            }
+            narrowSums(wideSums.data(), sums.data(), src.width * 4);
+
+            unsigned char* out = (unsigned char*)dst + (size_t)y * width * 4;
+            unsigned int x = 0;
+
+            #ifdef __SSE2__
+                x = areaColumnsSSE2(sums.data(), out, x, width, columnTaps);
+            #endif
+
+            areaColumnsScalar(sums.data(), out, x, width, columnTaps);
+        }
+    });
+}
+
+/*
+    Nearest neighbour
+*/
+
+// Index of the source pixel nearest to the center of each output pixel
+void getNearestPixels(unsigned int srcSize, unsigned int dstSize,
+                      std::vector<int32_t>* pixels) {
+    pixels->resize(dstSize);
+
+    for (unsigned int i = 0; i < dstSize; i++)
+        (*pixels)[i] = ((uint64_t)(2 * i + 1) * srcSize) / (2 * dstSize);
+}
+
+inline void nearestRowScalar(const unsigned char* row, uint32_t* dst,
+                             unsigned int x, unsigned int width,
+                             const int32_t* columns) {
+    for (; x < width; x++)
+        memcpy(dst + x, row + columns[x] * 4, 4);
+}
+
+#ifdef X86_DISPATCH
+// Gathers the row 8 pixels at a time,
+// returns the index of the first pixel left unprocessed
+__attribute__((target("avx2")))
+unsigned int nearestRowAVX2(const unsigned char* row, uint32_t* dst,
+                            unsigned int x, unsigned int width,
+                            const int32_t* columns) {
+    for (; x + 8 <= width; x += 8) {
+        __m256i index = _mm256_loadu_si256((const __m256i*)(columns + x));
+        __m256i pixels = _mm256_i32gather_epi32((const int*)row, index, 4);
+        _mm256_storeu_si256((__m256i*)(dst + x), pixels);
+    }
+    return x;
+}
+#endif
+
+void resizeNearest(const RawImage& src, unsigned int width,
+                   unsigned int height, char* dst) {
+    thread_local CachedTaps<std::vector<int32_t>> cachedRows, cachedColumns;
+    if (!isCached(src.height, height, &cachedRows))
+        getNearestPixels(src.height, height, &cachedRows.taps);
+    if (!isCached(src.width, width, &cachedColumns))
+        getNearestPixels(src.width, width, &cachedColumns.taps);
+
+    const std::vector<int32_t>& rows = cachedRows.taps;
+    const std::vector<int32_t>& columns = cachedColumns.taps;
+
+    parallelFor(height, ROWS_PER_RANGE,
+                [&](unsigned int begin, unsigned int end) {
+        for (unsigned int y = begin; y < end; y++) {
+            const unsigned char* row = (const unsigned char*)src.data
+                                       + (size_t)rows[y] * src.stride;
+            uint32_t* out = (uint32_t*)(dst + (size_t)y * width * 4);
+            unsigned int x = 0;
+
+            #ifdef X86_DISPATCH
+                if (cpuHasAVX2)
+                    x = nearestRowAVX2(row, out, x, width, columns.data());
+            #endif
+
+            nearestRowScalar(row, out, x, width, columns.data());
+        }
+    });
+}
+
+/*
+    Bilinear
+*/
+
+// The two source pixels around the center of an output pixel and the
+// weight of the second one
+struct BilinearTap {
+    unsigned int first;
+    unsigned int second;
+    int weight;
+};
+
+void getBilinearTaps(unsigned int srcSize, unsigned int dstSize,
+                     std::vector<BilinearTap>* taps) {
+    taps->resize(dstSize);
+
+    for (unsigned int i = 0; i < dstSize; i++) {
+        // The center of output pixel i is at (i + 0.5) * srcSize / dstSize
+        // source pixels, minus 0.5 to get the position between pixel centers.
+        // Computed in units of 1 / (2 * dstSize).
+        int64_t position = (int64_t)(2 * i + 1) * srcSize - dstSize;
+        if (position < 0)
+            position = 0;
+
+        uint64_t unit = 2 * (uint64_t)dstSize;
+        unsigned int first = position / unit;
+        int weight = ((position % unit) * BILINEAR_ONE + unit / 2) / unit;
+        if (weight == BILINEAR_ONE) {
+            first++;
+            weight = 0;
+        }
+
+        BilinearTap& tap = (*taps)[i];
+        if (first >= srcSize - 1) {
+            tap.first = tap.second = srcSize - 1;
+            tap.weight = 0;
+        } else {
+            tap.first = first;
+            tap.second = first + 1;
+            tap.weight = weight;
+        }
+    }
+}
+
+inline void bilinearRowScalar(const unsigned char* row0,
+                              const unsigned char* row1, int rowWeight,
+                              unsigned char* dst, unsigned int x,
+                              unsigned int width,
+                              const BilinearTap* columns) {
+    for (; x < width; x++) {
+        const BilinearTap& tap = columns[x];
+
+        for (int c = 0; c < 4; c++) {
+            int left = row0[tap.first * 4 + c] * (BILINEAR_ONE - rowWeight)
+                       + row1[tap.first * 4 + c] * rowWeight;
+            int right = row0[tap.second * 4 + c] * (BILINEAR_ONE - rowWeight)
+                        + row1[tap.second * 4 + c] * rowWeight;
+            int sum = left * (BILINEAR_ONE - tap.weight) + right * tap.weight;
+
+            dst[x * 4 + c] = (sum + (1 << (BILINEAR_SHIFT - 1)))
+                             >> BILINEAR_SHIFT;
+        }
+    }
+}
+
+#ifdef __SSE2__
+// Interpolates the row one pixel at a time with all channels in parallel,
+// returns the index of the first pixel left unprocessed
+unsigned int bilinearRowSSE2(const unsigned char* row0,
+                             const unsigned char* row1, int rowWeight,
+                             unsigned char* dst, unsigned int x,
+                             unsigned int width,
+                             const BilinearTap* columns) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i wy = _mm_set1_epi32((BILINEAR_ONE - rowWeight) | (rowWeight << 16));
+    __m128i round = _mm_set1_epi32(1 << (BILINEAR_SHIFT - 1));
+
+    for (; x < width; x++) {
+        const BilinearTap& tap = columns[x];
+
+        // Channels of the top and bottom pixels interleaved,
+        // left column in the low half and right column in the high half
+        __m128i left = _mm_unpacklo_epi8(
+            _mm_cvtsi32_si128(*(const int32_t*)(row0 + tap.first * 4)),
+            _mm_cvtsi32_si128(*(const int32_t*)(row1 + tap.first * 4)));
+        __m128i right = _mm_unpacklo_epi8(
+            _mm_cvtsi32_si128(*(const int32_t*)(row0 + tap.second * 4)),
+            _mm_cvtsi32_si128(*(const int32_t*)(row1 + tap.second * 4)));
+        __m128i both = _mm_unpacklo_epi64(left, right);
+
+        // Vertical interpolation of both columns
+        __m128i l = _mm_madd_epi16(_mm_unpacklo_epi8(both, zero), wy);
+        __m128i r = _mm_madd_epi16(_mm_unpackhi_epi8(both, zero), wy);
+
+        // Horizontal interpolation between the columns
+        __m128i lr = _mm_packs_epi32(l, r);
+        lr = _mm_unpacklo_epi16(lr, _mm_srli_si128(lr, 8));
+        __m128i wx = _mm_set1_epi32((BILINEAR_ONE - tap.weight)
+                                    | (tap.weight << 16));
+        __m128i sum = _mm_madd_epi16(lr, wx);
+
+        sum = _mm_srai_epi32(_mm_add_epi32(sum, round), BILINEAR_SHIFT);
+        sum = _mm_packs_epi32(sum, sum);
+        sum = _mm_packus_epi16(sum, sum);
+        *(int32_t*)(dst + x * 4) = _mm_cvtsi128_si32(sum);
+    }
+    return x;
+}
+#endif
+
+void resizeBilinear(const RawImage& src, unsigned int width,
+                    unsigned int height, char* dst) {
+    thread_local CachedTaps<std::vector<BilinearTap>> cachedRows,
+                                                      cachedColumns;
+    if (!isCached(src.height, height, &cachedRows))
+        getBilinearTaps(src.height, height, &cachedRows.taps);
+    if (!isCached(src.width, width, &cachedColumns))
+        getBilinearTaps(src.width, width, &cachedColumns.taps);
+
+    const std::vector<BilinearTap>& rows = cachedRows.taps;
+    const std::vector<BilinearTap>& columns = cachedColumns.taps;
+
+    parallelFor(height, ROWS_PER_RANGE,
+                [&](unsigned int begin, unsigned int end) {
+        for (unsigned int y = begin; y < end; y++) {
+            const BilinearTap& tap = rows[y];
+            const unsigned char* row0 = (const unsigned char*)src.data
+                                        + (size_t)tap.first * src.stride;
+            const unsigned char* row1 = (const unsigned char*)src.data
+                                        + (size_t)tap.second * src.stride;
+            unsigned char* out = (unsigned char*)dst + (size_t)y * width * 4;
+            unsigned int x = 0;
+
+            #ifdef __SSE2__
+                x = bilinearRowSSE2(row0, row1, tap.weight, out, x, width,
+                                    columns.data());
+            #endif
+
+            bilinearRowScalar(row0, row1, tap.weight, out, x, width,
+                              columns.data());
+        }
+    });
+}
+
+void resizeImage(const RawImage& src, unsigned int width, unsigned int height,
+                 ResizeFilter filter, char* dst) {
+    if (width == 0 || height == 0 || src.width == 0 || src.height == 0)
+        throw std::invalid_argument("cannot resize an empty image");
+
+    switch (filter) {
+        case RESIZE_AREA:
+            resizeArea(src, width, height, dst);
+            break;
+        case RESIZE_NEAREST:
+            resizeNearest(src, width, height, dst);
+            break;
+        case RESIZE_BILINEAR:
+            resizeBilinear(src, width, height, dst);
+            break;
+        default:
+            throw std::invalid_argument("unknown resize filter");
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "image.hpp"
+
+/*
+    Scales a BGRX image to width x height pixels with the given filter and
+    writes it to dst as a BGRX image with tightly packed rows
+    (width * height * 4 bytes).
+
+    The source can be any rectangle of a larger image (see RawImage),
+    so cropping and scaling happen in the same pass over the pixels.
+
+    Filters:
+        RESIZE_AREA:     average of the source pixels covered by each
+                         output pixel, best quality for downscaling
+        RESIZE_NEAREST:  nearest source pixel, fastest
+        RESIZE_BILINEAR: bilinear interpolation of the 4 nearest pixels
+
+    The rows are split between the threads of the thread pool, and SSE2/AVX2
+    kernels are used when the CPU supports them.
+ */
+void resizeImage(const RawImage& src, unsigned int width, unsigned int height,
+                 ResizeFilter filter, char* dst);
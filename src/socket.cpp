@@ -1,5 +1,7 @@
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cstring>
 #ifdef _WIN32
     #include <winsock2.h>
     #include <ws2tcpip.h>
@@ -9,9 +11,15 @@
     #include <netinet/in.h>
     #include <netinet/tcp.h>
     #include <netdb.h>
+    #include <sys/uio.h>
 #endif
 
 #include "messages.pb.h"
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include "image.hpp"
+#include "socket.hpp"
 
 #ifdef PROFILING
     #include "profiling.hpp"
@@ -22,6 +30,14 @@
 
 using namespace google::protobuf;
 
+// Largest request that is accepted. Requests are small, so a larger
+// length can only come from a broken or malicious client.
+const uint32_t MAX_REQUEST_BYTES = 16 << 20;
+
+// Buffers that are reused for every message to avoid allocating memory
+std::vector<char> receiveBuffer;
+std::string responseBuffer;
+
 int initSocket() {
     #ifdef _WIN32
         WSADATA wsa_data;
@@ -76,13 +92,13 @@ int getClientSocket(int listenSocket) {
     return socket;
 }
 
-Request getRequest(int clientSocket) {
-    int bytesReceived = 0;
+void getRequest(int clientSocket, Request* reqMsg) {
+    uint32_t bytesReceived = 0;
 
     // Receive message length
     uint32_t netLen;
     while (bytesReceived < sizeof(netLen)) {
-        int received = recv(clientSocket, (char*)((&netLen) + bytesReceived),
+        int received = recv(clientSocket, (char*)&netLen + bytesReceived,
                             sizeof(netLen) - bytesReceived, 0);
 
         if (received == 0)
@@ -92,9 +108,18 @@ Request getRequest(int clientSocket) {
 
         bytesReceived += received;
     }
-    int msgLen = ntohl(netLen);
+    uint32_t msgLen = ntohl(netLen);
+
+    // The rest of the stream can't be parsed after a bad length,
+    // so the connection is treated as broken
+    if (msgLen > MAX_REQUEST_BYTES)
+        throw std::runtime_error("Request is too large");
+
+    // Only grows when a request is larger than any of the previous ones
+    if (receiveBuffer.size() < msgLen)
+        receiveBuffer.resize(msgLen);
 
-    char* clientInput = new char[msgLen];
+    char* clientInput = receiveBuffer.data();
 
     START_TIMER("Recv message contents");
 
@@ -114,46 +139,127 @@ Request getRequest(int clientSocket) {
 
     END_TIMER("Recv message contents");
 
-    Request reqMsg;
-    if (!reqMsg.ParseFromArray(clientInput, msgLen))
+    if (!reqMsg->ParseFromArray(clientInput, msgLen))
         throw std::invalid_argument("Could not parse received bytes");
-
-    delete[] clientInput;
-
-    return reqMsg;
 }
 
-int sendResponse(Response respMsg, int clientSocket) {
-    int msgLen = respMsg.ByteSize();
-    char* responseBuffer = new char[msgLen];
-    respMsg.SerializeWithCachedSizesToArray((uint8*)responseBuffer);
-    
-    int sentBytes = 0;
-
-    // Send message length
-    uint32_t netLen = htonl(msgLen);
-    while (sentBytes < sizeof(netLen)) {
-        int sent = send(clientSocket, (char*)((&netLen) + sentBytes), 
-                        sizeof(netLen) - sentBytes, 0);
-
-        if (sent < 0)
-            throw std::runtime_error("Socket error");
+// Maximum number of buffers sent with one call to sendBuffers
+const int MAX_SEND_BUFFERS = 2 + 2 * MAX_ATTACHMENTS;
+
+struct SendBuffer {
+    const char* data;
+    size_t length;
+};
+
+int sendBuffers(int clientSocket, const SendBuffer* buffers, int count) {
+    /*
+        Sends the contents of the buffers to the socket with as few
+        system calls as possible, without copying them into one buffer.
+        Returns the number of bytes sent.
+     */
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += buffers[i].length;
+
+    size_t sentBytes = 0;
+
+    while (sentBytes < total) {
+        #ifdef _WIN32
+            WSABUF parts[MAX_SEND_BUFFERS];
+        #else
+            iovec parts[MAX_SEND_BUFFERS];
+        #endif
+        int partCount = 0;
+
+        // Skip the part that has already been sent
+        size_t skip = sentBytes;
+        for (int i = 0; i < count; i++) {
+            if (skip >= buffers[i].length) {
+                skip -= buffers[i].length;
+                continue;
+            }
+
+            #ifdef _WIN32
+                parts[partCount].buf = (char*)buffers[i].data + skip;
+                parts[partCount].len = buffers[i].length - skip;
+            #else
+                parts[partCount].iov_base = (char*)buffers[i].data + skip;
+                parts[partCount].iov_len = buffers[i].length - skip;
+            #endif
+            partCount++;
+            skip = 0;
+        }
+
+        #ifdef _WIN32
+            DWORD sent;
+            if (WSASend(clientSocket, parts, partCount, &sent, 0,
+                        NULL, NULL) != 0)
+                throw std::runtime_error("Socket error");
+        #else
+            msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = parts;
+            message.msg_iovlen = partCount;
+
+            ssize_t sent = sendmsg(clientSocket, &message, 0);
+            if (sent < 0)
+                throw std::runtime_error("Socket error");
+        #endif
 
         sentBytes += sent;
     }
 
-    // Send message contents
-    sentBytes = 0;
-    while (sentBytes < msgLen) {
-        int sent = send(clientSocket, responseBuffer + sentBytes,
-                        msgLen - sentBytes, 0);
+    return sentBytes;
+}
 
-        if (sent < 0)
-            throw std::runtime_error("Socket error");
+int sendResponse(const Response& respMsg, int clientSocket,
+                 const Attachment* attachments, int attachmentCount) {
+    // Serialize everything except the attachments. Reuses the memory of the
+    // previous response.
+    respMsg.SerializeToString(&responseBuffer);
 
-        sentBytes += sent;
+    SendBuffer buffers[MAX_SEND_BUFFERS];
+    int count = 0;
+
+    // The length of the message is sent first
+    uint32_t netLen;
+    buffers[count++] = { (const char*)&netLen, sizeof(netLen) };
+    size_t msgLen = responseBuffer.size();
+
+    /*
+        Each attachment is sent as a bytes field of the Response message.
+        The field header (tag and length) is written into the space reserved
+        in front of the data, so the field can be sent straight from the
+        attachment buffer.
+        Protobuf parsers accept fields in any order, so the rest of the
+        message can follow the attachments.
+     */
+    for (int i = 0; i < attachmentCount && i < MAX_ATTACHMENTS; i++) {
+        ImageBuffer* buffer = attachments[i].buffer;
+        if (buffer == NULL || buffer->empty())
+            continue;
+
+        uint8 fieldHeader[ImageBuffer::HEADROOM];
+        uint8* end = io::CodedOutputStream::WriteTagToArray(
+            internal::WireFormatLite::MakeTag(
+                attachments[i].fieldNumber,
+                internal::WireFormatLite::WIRETYPE_LENGTH_DELIMITED
+            ),
+            fieldHeader
+        );
+        end = io::CodedOutputStream::WriteVarint32ToArray(buffer->size(), end);
+        size_t fieldHeaderLen = end - fieldHeader;
+
+        char* header = buffer->header(fieldHeaderLen);
+        memcpy(header, fieldHeader, fieldHeaderLen);
+
+        buffers[count++] = { header, fieldHeaderLen + buffer->size() };
+        msgLen += fieldHeaderLen + buffer->size();
     }
-    
-    delete[] responseBuffer;
-    return sentBytes;
-}
\ No newline at end of file
+
+    buffers[count++] = { responseBuffer.data(), responseBuffer.size() };
+    netLen = htonl(msgLen);
+
+    return sendBuffers(clientSocket, buffers, count);
+}
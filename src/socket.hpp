@@ -7,6 +7,7 @@
     #include <sys/socket.h>
 #endif
 #include "messages.pb.h"
+#include "image.hpp"
 
 /*
     Initializes the socket API (if needed). Should be called before using
@@ -39,17 +40,40 @@ int getClientSocket(int listenSocket);
 /*
     Waits for and parses incoming requests to the given socket.
     Attempts to parse the message as a protobuf Request message
-    and if successful, returns it.
+    and if successful, stores it in reqMsg.
 
-    Throws runtime_error if the connection was closed or there was
-    a socket error.
+    Throws runtime_error if the connection was closed, there was a socket
+    error or the length of the request was too large.
     Throws invalid_argument if the received bytes could not be parsed
     as a protobuf message.
 */
-Request getRequest(int clientSocket);
+void getRequest(int clientSocket, Request* reqMsg);
+
+// Maximum number of attachments sent with one response
+// (the image, the tensor, the additional outputs, the windows and the
+// stack)
+const int MAX_ATTACHMENTS = 104;
+
+/*
+    A bytes field of the Response message that is sent straight from
+    its buffer instead of being copied into the message.
+*/
+struct Attachment {
+    int fieldNumber;
+    ImageBuffer* buffer;
+};
 
 /*
     Sends the given protobuf Response message to the given socket.
     Returns the number of bytes sent to the socket.
+
+    The given attachments (for example the image field) are sent as part of
+    the message directly from their buffers, without copying them into the
+    message. The corresponding fields of respMsg should be empty.
+    Empty attachments are skipped.
+
+    Throws runtime_error if there was a socket error.
 */
-int sendResponse(Response respMsg, int clientSocket);
\ No newline at end of file
+int sendResponse(const Response& respMsg, int clientSocket,
+                 const Attachment* attachments = NULL,
+                 int attachmentCount = 0);
\ No newline at end of file
@@ -0,0 +1,45 @@
+/*
+    The platform capture backend, and the backend that is in use.
+*/
+
+#include "source.hpp"
+#include "platform.hpp"
+
+/*
+    Captures the displays with the functions of the current platform
+ */
+class PlatformSource : public CaptureSource {
+public:
+    void selectDisplay(const std::string& name) override {
+        ::selectDisplay(name);
+    }
+
+    bool hasInputs() const override {
+        return true;
+    }
+
+    unsigned long capture(std::string* processName, Frame* frame,
+                          const ImageOptions& options) override {
+        return getScreenshot(processName, frame, options);
+    }
+
+    uint64_t getGeneration() override {
+        return getDamageGeneration();
+    }
+
+    uint64_t waitForChange(uint64_t generation,
+                           unsigned int timeout) override {
+        return waitForDamage(generation, timeout);
+    }
+};
+
+PlatformSource platformSource;
+CaptureSource* captureSource = &platformSource;
+
+CaptureSource* getCaptureSource() {
+    return captureSource;
+}
+
+void setCaptureSource(CaptureSource* source) {
+    captureSource = source;
+}
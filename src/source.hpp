@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include "image.hpp"
+
+/*
+    A backend that captures the images that are returned to the clients.
+
+    The platform backend captures displays with the functions of
+    platform.hpp (which on Linux/X11 has its own XShm, XComposite, XCB and
+    Xvfb framebuffer backends, see Request.capture_backend). The synthetic
+    backend generates test patterns instead (see synthetic.hpp), so that
+    processing, encoding and sending images can be measured and tested
+    without a display.
+ */
+class CaptureSource {
+public:
+    virtual ~CaptureSource() {}
+
+    /*
+        Selects the display the calling thread captures (see selectDisplay).
+        Throws invalid_argument if the display could not be opened.
+     */
+    virtual void selectDisplay(const std::string& name) = 0;
+
+    /*
+        Returns true if inputs can be sent to and read from the displays
+        with the functions of platform.hpp.
+     */
+    virtual bool hasInputs() const = 0;
+
+    /*
+        Grabs an image of the given window of the selected display and
+        processes and encodes it into the frame (see getScreenshot).
+        Grabbing and encoding are one call, because what is grabbed
+        decides how it is encoded: the X11 backend can scale the image on
+        the server and then encodes it without scaling, captures several
+        windows into separate images, and resets the max-pooling and tile
+        state of the display when the window changes. The backends encode
+        with encodeFrame and the other functions of encode.hpp.
+        The grabbed image is 32-bit BGRX (see RawImage), and its size is
+        stored in the image buffer of the frame. The generation of the
+        image is stored in the frame, and the timestamp, which is set to
+        the current time before the call, can be replaced with the time
+        the image was drawn.
+        Returns the size of the encoded image in bytes.
+
+        Displays can be captured at the same time from different threads,
+        but one display is only captured by one thread at a time.
+
+        Throws invalid_argument if the window could not be captured.
+     */
+    virtual unsigned long capture(std::string* processName, Frame* frame,
+                                  const ImageOptions& options) = 0;
+
+    /*
+        Returns a counter that changes whenever the image of the window of
+        the latest capture changes, or 0 if changes are not tracked
+        (see getDamageGeneration).
+     */
+    virtual uint64_t getGeneration() = 0;
+
+    /*
+        Waits until the generation is different from the given one, or
+        until timeout milliseconds have passed, and returns the current
+        generation (see waitForDamage).
+     */
+    virtual uint64_t waitForChange(uint64_t generation,
+                                   unsigned int timeout) = 0;
+};
+
+/*
+    Returns the backend that images are captured with. This is the
+    platform backend unless another one has been set.
+ */
+CaptureSource* getCaptureSource();
+
+/*
+    Makes images be captured with the given backend instead of the platform
+    backend. Should be called before anything is captured, and the backend
+    has to stay valid while images are captured.
+ */
+void setCaptureSource(CaptureSource* source);
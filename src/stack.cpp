@@ -0,0 +1,47 @@
+/*
+    Keeps the newest images returned to the client, so that a request can
+    get a stack of consecutive observations in one response.
+*/
+
+#include <cstring>
+#include <utility>
+
+#include "stack.hpp"
+
+void pushEntry(const Frame& frame, StackEntry entry, FrameStack* stack) {
+    const ImageBuffer& image = frame.image;
+    memcpy(entry.image.reserve(image.size()), image.data(), image.size());
+    entry.image.setSize(image.size());
+    entry.image.setInfo(image.format(), image.width(), image.height());
+    entry.timestamp = frame.timestamp;
+
+    stack->entries.push_back(std::move(entry));
+}
+
+bool addToFrameStack(const Frame& frame, unsigned int size,
+                     FrameStack* stack) {
+    const ImageBuffer& image = frame.image;
+    if (size == 0 || image.empty())
+        return false;
+
+    std::deque<StackEntry>& entries = stack->entries;
+    if (entries.size() != size || image.format() != stack->format
+        || image.width() != stack->width || image.height() != stack->height) {
+        entries.clear();
+        stack->format = image.format();
+        stack->width = image.width();
+        stack->height = image.height();
+    }
+
+    if (entries.empty()) {
+        // Fill the new stack with the first image
+        for (unsigned int i = 0; i < size; i++)
+            pushEntry(frame, StackEntry(), stack);
+    } else {
+        // The buffer of the oldest image is reused for the new one
+        StackEntry oldest = std::move(entries.front());
+        entries.pop_front();
+        pushEntry(frame, std::move(oldest), stack);
+    }
+    return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <deque>
+
+#include "image.hpp"
+
+struct StackEntry {
+    ImageBuffer image;
+    uint64_t timestamp;
+};
+
+/*
+    The newest images of one display returned to the client in a session
+ */
+struct FrameStack {
+    // Images in the order they were returned
+    std::deque<StackEntry> entries;
+
+    // Format and dimensions of the images in the stack
+    ImageFormat format = FORMAT_JPEG;
+    unsigned int width = 0;
+    unsigned int height = 0;
+};
+
+/*
+    Adds a copy of the image of the frame to the frame stack, dropping the
+    oldest image, so that the stack has the size newest images returned
+    to the client, oldest first. The newest image is the one of the frame.
+    Only the returned frames are stacked: frames that the capture thread
+    captured between two requests are not.
+
+    When the stack is empty (or was reset), it is filled with copies of the
+    first image, so it always has exactly size images.
+    The stack is reset when the size, format or dimensions of the images
+    change.
+
+    Returns false if the frame has no image, in which case the stack is
+    not changed.
+ */
+bool addToFrameStack(const Frame& frame, unsigned int size, FrameStack* stack);
@@ -0,0 +1,207 @@
+/*
+    Capture backend that generates test patterns (see synthetic.hpp)
+*/
+
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+
+#include "synthetic.hpp"
+#include "capture.hpp"
+#include "encode.hpp"
+#include "threadpool.hpp"
+
+// Size of the blocks of the frame number
+const unsigned int COUNTER_BLOCK = 8;
+const unsigned int COUNTER_BITS = 32;
+
+unsigned int bounce(uint64_t position, unsigned int range) {
+    /*
+        Moves back and forth between 0 and range as position increases
+     */
+
+    if (range == 0)
+        return 0;
+
+    uint64_t phase = position % (2 * (uint64_t)range);
+    return phase < range ? phase : 2 * range - phase;
+}
+
+class SyntheticSource : public CaptureSource {
+public:
+    SyntheticSource(unsigned int width, unsigned int height, unsigned int fps)
+        : width(width), height(height), fps(fps),
+          start(getTimestamp()), pixels((size_t)width * height * 4) {
+        initEncoder(&encodeState);
+    }
+
+    ~SyntheticSource() override {
+        shutdownEncoder(&encodeState);
+    }
+
+    void selectDisplay(const std::string& /*name*/) override {}
+
+    bool hasInputs() const override {
+        return false;
+    }
+
+    unsigned long capture(std::string* /*processName*/, Frame* frame,
+                          const ImageOptions& options) override {
+        if (!options.windows.empty()) {
+            throw std::invalid_argument("multi-window capture is not "
+                                        "supported by the synthetic backend");
+        }
+        if (options.monitor != 0) {
+            throw std::invalid_argument("monitors are not supported by the "
+                                        "synthetic backend");
+        }
+
+        // The displays share the pattern and the encoder
+        std::lock_guard<std::mutex> lock(captureMutex);
+
+        uint64_t number = getFrameNumber();
+        if (fps == 0)
+            captureCount++;
+
+        if (!rendered || number != renderedNumber) {
+            render(number);
+            renderedNumber = number;
+            rendered = true;
+        }
+
+        RawImage raw;
+        raw.data = pixels.data();
+        raw.width = width;
+        raw.height = height;
+        raw.stride = width * 4;
+
+        // Only the requested region, clipped to the image
+        const CaptureRegion& region = options.region;
+        if (region.width != 0 && region.height != 0) {
+            long left = std::max<long>(region.x, 0);
+            long top = std::max<long>(region.y, 0);
+            long right = std::min<long>((long)region.x + region.width, width);
+            long bottom = std::min<long>((long)region.y + region.height,
+                                         height);
+
+            if (right <= left || bottom <= top)
+                throw std::invalid_argument("region is outside the window");
+
+            raw.data += top * raw.stride + left * 4;
+            raw.width = right - left;
+            raw.height = bottom - top;
+        }
+
+        if (fps != 0) {
+            frame->timestamp = start + number * 1000000 / fps;
+            frame->damageGeneration = number + 1;
+        }
+
+        return encodeFrame(raw, options, &encodeState, frame);
+    }
+
+    uint64_t getGeneration() override {
+        if (fps == 0)
+            return 0;
+
+        return getFrameNumber() + 1;
+    }
+
+    uint64_t waitForChange(uint64_t generation,
+                           unsigned int timeout) override {
+        if (fps == 0 || generation == 0)
+            return getGeneration();
+
+        // Frame number generation is drawn when the generation changes
+        uint64_t next = start + generation * 1000000 / fps;
+        uint64_t deadline = getTimestamp() + (uint64_t)timeout * 1000;
+        uint64_t now = getTimestamp();
+        uint64_t wake = std::min(next, deadline);
+        if (wake > now)
+            std::this_thread::sleep_for(std::chrono::microseconds(wake - now));
+
+        return getGeneration();
+    }
+
+private:
+    uint64_t getFrameNumber() const {
+        if (fps == 0)
+            return captureCount;
+
+        return (getTimestamp() - start) * fps / 1000000;
+    }
+
+    void render(uint64_t number) {
+        /*
+            Draws the given frame of the pattern: gradients that scroll
+            in different directions, a bouncing white square and the
+            frame number
+         */
+
+        unsigned int size = std::max(std::min(width, height) / 8, 1u);
+        unsigned int squareX = bounce(number * 5, width - size);
+        unsigned int squareY = bounce(number * 3, height - size);
+        bool counter = width >= COUNTER_BLOCK * COUNTER_BITS
+                       && height >= COUNTER_BLOCK;
+
+        parallelFor(height, 16, [&](unsigned int begin, unsigned int end) {
+            for (unsigned int y = begin; y < end; y++) {
+                unsigned char* row = (unsigned char*)&pixels[(size_t)y
+                                                             * width * 4];
+
+                for (unsigned int x = 0; x < width; x++) {
+                    unsigned char* pixel = row + x * 4;
+                    pixel[0] = x + number * 4;
+                    pixel[1] = y + number * 2;
+                    pixel[2] = ((x / 32) ^ (y / 32)) * 32 + number;
+                    pixel[3] = 0;
+                }
+
+                if (y >= squareY && y < squareY + size)
+                    std::fill(row + squareX * 4, row + (squareX + size) * 4,
+                              (unsigned char)255);
+
+                if (counter && y < COUNTER_BLOCK) {
+                    for (unsigned int bit = 0; bit < COUNTER_BITS; bit++) {
+                        unsigned char value = (number >> bit) & 1 ? 255 : 0;
+                        std::fill(row + bit * COUNTER_BLOCK * 4,
+                                  row + (bit + 1) * COUNTER_BLOCK * 4, value);
+                    }
+                }
+            }
+        });
+    }
+
+    unsigned int width;
+    unsigned int height;
+    unsigned int fps;
+
+    // Time of the first frame
+    uint64_t start;
+
+    // The newest rendered frame
+    std::vector<char> pixels;
+    uint64_t renderedNumber = 0;
+    bool rendered = false;
+
+    // Number of captures, which is the frame number if fps is 0
+    std::atomic<uint64_t> captureCount{0};
+
+    // Encoder with the max-pooling and tile state. Every display has the
+    // same pattern, so they share it, and captureMutex is held while it
+    // is used.
+    EncodeState encodeState;
+    std::mutex captureMutex;
+};
+
+CaptureSource* createSyntheticSource(unsigned int width, unsigned int height,
+                                     unsigned int fps) {
+    if (width == 0 || height == 0)
+        throw std::invalid_argument("synthetic image size can't be 0");
+
+    return new SyntheticSource(width, height, fps);
+}
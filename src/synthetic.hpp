@@ -0,0 +1,20 @@
+#pragma once
+
+#include "source.hpp"
+
+/*
+    Creates a capture backend that generates a deterministic moving test
+    pattern of the given size instead of capturing a display.
+
+    The pattern advances by one frame every 1/fps seconds, and the frames
+    are timestamped and numbered (as their generation) as if they had been
+    drawn at exactly that rate. If fps is 0, every capture gets the next
+    frame and changes are not tracked. The number of the frame is drawn as
+    32 black and white blocks along the top edge of the image, least
+    significant bit first, if the image is at least 256 pixels wide.
+
+    The window name is ignored, and every display has the same pattern.
+    Multi-window captures and monitors are not supported.
+ */
+CaptureSource* createSyntheticSource(unsigned int width, unsigned int height,
+                                     unsigned int fps);
@@ -0,0 +1,349 @@
+/*
+    Converts captured BGRX images to RGB tensors for neural networks.
+
+    Each row is converted with one pass over the source pixels: the channels
+    are picked out, normalized and written in the requested layout at once.
+    Half precision tensors are first written as floats to a buffer that holds
+    one row, which stays in the cache until it is converted to halves.
+*/
+
+#include <cstring>
+#include <cstdint>
+#include <vector>
+
+#include "tensor.hpp"
+#include "cpu.hpp"
+#include "convert.hpp"
+
+size_t getTensorSize(TensorType type, unsigned int width,
+                     unsigned int height) {
+    size_t values = (size_t)width * height * 3;
+
+    switch (type) {
+        case TENSOR_FLOAT32:
+            return values * sizeof(float);
+        case TENSOR_FLOAT16:
+            return values * sizeof(uint16_t);
+        default:
+            return values;
+    }
+}
+
+/*
+    uint8, CHW (uint8 HWC is the same as FORMAT_RGB24)
+*/
+
+inline void planarRowScalar(const unsigned char* src, unsigned char** planes,
+                            unsigned int x, unsigned int width) {
+    for (; x < width; x++) {
+        planes[0][x] = src[x * 4 + 2];
+        planes[1][x] = src[x * 4 + 1];
+        planes[2][x] = src[x * 4];
+    }
+}
+
+#ifdef __SSE2__
+// Returns the given channel of 16 pixels
+inline __m128i channelSSE2(const __m128i* p, int shift) {
+    __m128i mask = _mm_set1_epi32(0xff);
+    __m128i c0 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(p), shift), mask);
+    __m128i c1 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(p + 1), shift),
+                               mask);
+    __m128i c2 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(p + 2), shift),
+                               mask);
+    __m128i c3 = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128(p + 3), shift),
+                               mask);
+
+    return _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+}
+
+// Converts the row from x onwards 16 pixels at a time,
+// returns the index of the first pixel left unconverted
+unsigned int planarRowSSE2(const unsigned char* src, unsigned char** planes,
+                           unsigned int x, unsigned int width) {
+    for (; x + 16 <= width; x += 16) {
+        const __m128i* p = (const __m128i*)(src + x * 4);
+        _mm_storeu_si128((__m128i*)(planes[0] + x), channelSSE2(p, 16));
+        _mm_storeu_si128((__m128i*)(planes[1] + x), channelSSE2(p, 8));
+        _mm_storeu_si128((__m128i*)(planes[2] + x), channelSSE2(p, 0));
+    }
+    return x;
+}
+#endif
+
+/*
+    float, CHW
+*/
+
+inline void floatPlanarRowScalar(const unsigned char* src, float** planes,
+                                 unsigned int x, unsigned int width,
+                                 const float* scale, const float* bias) {
+    for (; x < width; x++) {
+        planes[0][x] = src[x * 4 + 2] * scale[0] + bias[0];
+        planes[1][x] = src[x * 4 + 1] * scale[1] + bias[1];
+        planes[2][x] = src[x * 4] * scale[2] + bias[2];
+    }
+}
+
+#ifdef __SSE2__
+// Converts the row from x onwards 4 pixels at a time,
+// returns the index of the first pixel left unconverted
+unsigned int floatPlanarRowSSE2(const unsigned char* src, float** planes,
+                                unsigned int x, unsigned int width,
+                                const float* scale, const float* bias) {
+    __m128i mask = _mm_set1_epi32(0xff);
+    __m128 scaleR = _mm_set1_ps(scale[0]);
+    __m128 scaleG = _mm_set1_ps(scale[1]);
+    __m128 scaleB = _mm_set1_ps(scale[2]);
+    __m128 biasR = _mm_set1_ps(bias[0]);
+    __m128 biasG = _mm_set1_ps(bias[1]);
+    __m128 biasB = _mm_set1_ps(bias[2]);
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i*)(src + x * 4));
+        __m128 r = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), mask));
+        __m128 g = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), mask));
+        __m128 b = _mm_cvtepi32_ps(_mm_and_si128(px, mask));
+
+        _mm_storeu_ps(planes[0] + x, _mm_add_ps(_mm_mul_ps(r, scaleR), biasR));
+        _mm_storeu_ps(planes[1] + x, _mm_add_ps(_mm_mul_ps(g, scaleG), biasG));
+        _mm_storeu_ps(planes[2] + x, _mm_add_ps(_mm_mul_ps(b, scaleB), biasB));
+    }
+    return x;
+}
+#endif
+
+/*
+    float, HWC
+*/
+
+inline void floatRowScalar(const unsigned char* src, float* dst,
+                           unsigned int x, unsigned int width,
+                           const float* scale, const float* bias) {
+    for (; x < width; x++) {
+        dst[x * 3] = src[x * 4 + 2] * scale[0] + bias[0];
+        dst[x * 3 + 1] = src[x * 4 + 1] * scale[1] + bias[1];
+        dst[x * 3 + 2] = src[x * 4] * scale[2] + bias[2];
+    }
+}
+
+#ifdef X86_DISPATCH
+// Converts the row from x onwards 4 pixels at a time,
+// returns the index of the first pixel left unconverted
+__attribute__((target("ssse3")))
+unsigned int floatRowSSSE3(const unsigned char* src, float* dst,
+                           unsigned int x, unsigned int width,
+                           const float* scale, const float* bias) {
+    // The 12 values of 4 pixels as three vectors of 32-bit integers:
+    // R0 G0 B0 R1, G1 B1 R2 G2, B2 R3 G3 B3
+    __m128i pick0 = _mm_setr_epi8(2, -1, -1, -1, 1, -1, -1, -1,
+                                  0, -1, -1, -1, 6, -1, -1, -1);
+    __m128i pick1 = _mm_setr_epi8(5, -1, -1, -1, 4, -1, -1, -1,
+                                  10, -1, -1, -1, 9, -1, -1, -1);
+    __m128i pick2 = _mm_setr_epi8(8, -1, -1, -1, 14, -1, -1, -1,
+                                  13, -1, -1, -1, 12, -1, -1, -1);
+
+    __m128 scale0 = _mm_setr_ps(scale[0], scale[1], scale[2], scale[0]);
+    __m128 scale1 = _mm_setr_ps(scale[1], scale[2], scale[0], scale[1]);
+    __m128 scale2 = _mm_setr_ps(scale[2], scale[0], scale[1], scale[2]);
+    __m128 bias0 = _mm_setr_ps(bias[0], bias[1], bias[2], bias[0]);
+    __m128 bias1 = _mm_setr_ps(bias[1], bias[2], bias[0], bias[1]);
+    __m128 bias2 = _mm_setr_ps(bias[2], bias[0], bias[1], bias[2]);
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i px = _mm_loadu_si128((const __m128i*)(src + x * 4));
+        __m128 v0 = _mm_cvtepi32_ps(_mm_shuffle_epi8(px, pick0));
+        __m128 v1 = _mm_cvtepi32_ps(_mm_shuffle_epi8(px, pick1));
+        __m128 v2 = _mm_cvtepi32_ps(_mm_shuffle_epi8(px, pick2));
+
+        float* out = dst + x * 3;
+        _mm_storeu_ps(out, _mm_add_ps(_mm_mul_ps(v0, scale0), bias0));
+        _mm_storeu_ps(out + 4, _mm_add_ps(_mm_mul_ps(v1, scale1), bias1));
+        _mm_storeu_ps(out + 8, _mm_add_ps(_mm_mul_ps(v2, scale2), bias2));
+    }
+    return x;
+}
+#endif
+
+/*
+    Half precision
+*/
+
+// Converts a float to IEEE half precision, rounding to nearest even
+uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint16_t sign = (bits >> 16) & 0x8000;
+    int floatExponent = (bits >> 23) & 0xff;
+    int exponent = floatExponent - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    // Infinity and NaN
+    if (floatExponent == 0xff)
+        return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+
+    // Too large, becomes infinity
+    if (exponent >= 31)
+        return sign | 0x7c00;
+
+    // Too small even for a subnormal half, becomes zero
+    if (exponent < -10)
+        return sign;
+
+    int shift = 13;
+    uint32_t half;
+    if (exponent <= 0) {
+        // Subnormal half, the implicit leading one becomes explicit
+        mantissa |= 0x800000;
+        shift = 14 - exponent;
+        half = mantissa >> shift;
+    } else {
+        half = (exponent << 10) | (mantissa >> shift);
+    }
+
+    // Round to nearest even. A carry into the exponent is correct.
+    uint32_t rest = mantissa & ((1u << shift) - 1);
+    uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1)))
+        half++;
+
+    return sign | half;
+}
+
+inline void halfRowScalar(const float* src, uint16_t* dst,
+                          unsigned int i, unsigned int count) {
+    for (; i < count; i++)
+        dst[i] = floatToHalf(src[i]);
+}
+
+#ifdef X86_DISPATCH
+// Converts the values from i onwards 4 at a time,
+// returns the index of the first value left unconverted
+__attribute__((target("f16c")))
+unsigned int halfRowF16C(const float* src, uint16_t* dst,
+                         unsigned int i, unsigned int count) {
+    for (; i + 4 <= count; i += 4) {
+        __m128i halves = _mm_cvtps_ph(_mm_loadu_ps(src + i),
+                                      _MM_FROUND_TO_NEAREST_INT);
+        _mm_storel_epi64((__m128i*)(dst + i), halves);
+    }
+    return i;
+}
+#endif
+
+void floatsToHalves(const float* src, uint16_t* dst, unsigned int count) {
+    unsigned int i = 0;
+
+    #ifdef X86_DISPATCH
+        if (cpuHasF16C)
+            i = halfRowF16C(src, dst, i, count);
+    #endif
+
+    halfRowScalar(src, dst, i, count);
+}
+
+/*
+    Rows
+*/
+
+void floatRow(const unsigned char* row, float* dst, unsigned int width,
+              const float* scale, const float* bias) {
+    unsigned int x = 0;
+
+    #ifdef X86_DISPATCH
+        if (cpuHasSSSE3)
+            x = floatRowSSSE3(row, dst, x, width, scale, bias);
+    #endif
+
+    floatRowScalar(row, dst, x, width, scale, bias);
+}
+
+void floatPlanarRow(const unsigned char* row, float** planes,
+                    unsigned int width, const float* scale,
+                    const float* bias) {
+    unsigned int x = 0;
+
+    #ifdef __SSE2__
+        x = floatPlanarRowSSE2(row, planes, x, width, scale, bias);
+    #endif
+
+    floatPlanarRowScalar(row, planes, x, width, scale, bias);
+}
+
+void convertToTensor(const RawImage& src, const TensorSettings& settings,
+                     char* dst) {
+    unsigned int width = src.width;
+    size_t planeSize = (size_t)width * src.height;
+
+    if (settings.type == TENSOR_UINT8 && settings.layout == TENSOR_HWC) {
+        convertBGRXtoRGB24(src, dst);
+        return;
+    }
+
+    // value = pixel * scale + bias = (pixel / 255 - mean) / std
+    float scale[3];
+    float bias[3];
+    for (int c = 0; c < 3; c++) {
+        scale[c] = 1.0f / (255.0f * settings.std[c]);
+        bias[c] = -settings.mean[c] / settings.std[c];
+    }
+
+    // Holds one row of floats before it is converted to halves
+    static thread_local std::vector<float> rowBuffer;
+    if (settings.type == TENSOR_FLOAT16 && rowBuffer.size() < width * 3)
+        rowBuffer.resize(width * 3);
+
+    for (unsigned int y = 0; y < src.height; y++) {
+        const unsigned char* row =
+            (const unsigned char*)src.data + (size_t)y * src.stride;
+        size_t offset = (size_t)y * width;
+
+        if (settings.type == TENSOR_UINT8) {
+            unsigned char* base = (unsigned char*)dst;
+            unsigned char* planes[3] = {
+                base + offset, base + planeSize + offset,
+                base + 2 * planeSize + offset
+            };
+            unsigned int x = 0;
+
+            #ifdef __SSE2__
+                x = planarRowSSE2(row, planes, x, width);
+            #endif
+
+            planarRowScalar(row, planes, x, width);
+
+        } else if (settings.type == TENSOR_FLOAT32) {
+            float* base = (float*)dst;
+
+            if (settings.layout == TENSOR_HWC) {
+                floatRow(row, base + offset * 3, width, scale, bias);
+            } else {
+                float* planes[3] = {
+                    base + offset, base + planeSize + offset,
+                    base + 2 * planeSize + offset
+                };
+                floatPlanarRow(row, planes, width, scale, bias);
+            }
+
+        } else {
+            uint16_t* base = (uint16_t*)dst;
+            float* buffer = rowBuffer.data();
+
+            if (settings.layout == TENSOR_HWC) {
+                floatRow(row, buffer, width, scale, bias);
+                floatsToHalves(buffer, base + offset * 3, width * 3);
+            } else {
+                float* planes[3] = {
+                    buffer, buffer + width, buffer + 2 * width
+                };
+                floatPlanarRow(row, planes, width, scale, bias);
+
+                for (int c = 0; c < 3; c++) {
+                    floatsToHalves(planes[c], base + c * planeSize + offset,
+                                   width);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+
+#include "image.hpp"
+
+/*
+    Returns the number of bytes in an RGB tensor of the given type and size.
+ */
+size_t getTensorSize(TensorType type, unsigned int width, unsigned int height);
+
+/*
+    Converts a BGRX image to an RGB tensor with the layout, data type and
+    normalization given in settings, and writes it to dst, which must have
+    room for getTensorSize bytes.
+
+    The channels are extracted, normalized and converted in a single pass
+    over the image, using SSE2/SSSE3/F16C kernels when the CPU supports them.
+ */
+void convertToTensor(const RawImage& src, const TensorSettings& settings,
+                     char* dst);
@@ -0,0 +1,173 @@
+/*
+    A small pool of worker threads for splitting image processing work
+    (for example the rows of an image) between CPU cores.
+
+    Every call to parallelFor adds a job to a shared list. Workers and the
+    calling thread take ranges from the oldest job that still has work left,
+    and the calling thread waits until all ranges of its job are done.
+    Because the calling thread also works on its own job, nested and
+    concurrent calls always make progress.
+*/
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "threadpool.hpp"
+
+// Number of ranges each thread gets per job, more ranges balance the work
+// better when some threads are slower (for example busy with another job)
+const unsigned int RANGES_PER_THREAD = 4;
+
+struct ParallelJob {
+    const std::function<void(unsigned int, unsigned int)>* body;
+    unsigned int count;
+    unsigned int rangeSize;
+
+    // First item that hasn't been taken by any thread yet
+    unsigned int next;
+
+    // Number of items that have been processed
+    unsigned int done;
+};
+
+std::mutex poolMutex;
+
+// Notified when a job is added or the pool is stopped
+std::condition_variable workAvailable;
+
+// Notified when a range of a job is finished
+std::condition_variable workFinished;
+
+// Jobs that have unclaimed ranges left
+std::deque<ParallelJob*> jobs;
+
+std::vector<std::thread> workers;
+bool stopWorkers = false;
+
+/*
+    Claims the next range of the job. Removes the job from the list
+    when its last range is taken, so no thread can access the job
+    after its last range has been finished.
+
+    Should be called with poolMutex locked.
+ */
+void claimRange(ParallelJob* job, unsigned int* begin, unsigned int* end) {
+    *begin = job->next;
+    *end = job->count - *begin > job->rangeSize ? *begin + job->rangeSize
+                                                : job->count;
+    job->next = *end;
+
+    if (job->next == job->count) {
+        for (auto it = jobs.begin(); it != jobs.end(); ++it) {
+            if (*it == job) {
+                jobs.erase(it);
+                break;
+            }
+        }
+    }
+}
+
+/*
+    Processes a claimed range with the lock released.
+ */
+void runRange(ParallelJob* job, unsigned int begin, unsigned int end,
+              std::unique_lock<std::mutex>& lock) {
+    lock.unlock();
+    (*job->body)(begin, end);
+    lock.lock();
+
+    job->done += end - begin;
+    if (job->done == job->count)
+        workFinished.notify_all();
+}
+
+void workerLoop() {
+    std::unique_lock<std::mutex> lock(poolMutex);
+
+    while (true) {
+        workAvailable.wait(lock, [] { return stopWorkers || !jobs.empty(); });
+        if (stopWorkers)
+            return;
+
+        ParallelJob* job = jobs.front();
+        unsigned int begin, end;
+        claimRange(job, &begin, &end);
+        runRange(job, begin, end, lock);
+    }
+}
+
+void startThreadPool(unsigned int threads) {
+    stopThreadPool();
+
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+
+    std::lock_guard<std::mutex> lock(poolMutex);
+    stopWorkers = false;
+
+    // The thread that calls parallelFor works on the job too
+    for (unsigned int i = 1; i < threads; i++)
+        workers.push_back(std::thread(workerLoop));
+}
+
+void stopThreadPool() {
+    std::vector<std::thread> stopped;
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        stopWorkers = true;
+        stopped.swap(workers);
+    }
+    workAvailable.notify_all();
+
+    for (std::thread& worker : stopped)
+        worker.join();
+}
+
+unsigned int getThreadPoolSize() {
+    std::lock_guard<std::mutex> lock(poolMutex);
+    return workers.size() + 1;
+}
+
+void parallelFor(unsigned int count, unsigned int grain,
+                 const std::function<void(unsigned int, unsigned int)>& body) {
+    if (count == 0)
+        return;
+
+    std::unique_lock<std::mutex> lock(poolMutex);
+
+    unsigned int threads = workers.size() + 1;
+    if (grain == 0)
+        grain = 1;
+
+    // Too small for splitting, or no workers to split it with
+    if (threads == 1 || count <= grain) {
+        lock.unlock();
+        body(0, count);
+        return;
+    }
+
+    ParallelJob job;
+    job.body = &body;
+    job.count = count;
+    job.rangeSize = count / (threads * RANGES_PER_THREAD);
+    if (job.rangeSize < grain)
+        job.rangeSize = grain;
+    job.next = 0;
+    job.done = 0;
+
+    jobs.push_back(&job);
+    workAvailable.notify_all();
+
+    // Work on the job until all of its ranges have been taken
+    while (job.next < job.count) {
+        unsigned int begin, end;
+        claimRange(&job, &begin, &end);
+        runRange(&job, begin, end, lock);
+    }
+
+    // Wait for the ranges that are still being processed by the workers
+    workFinished.wait(lock, [&job] { return job.done == job.count; });
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <functional>
+
+/*
+    Starts a pool of worker threads that is shared by all parallel image
+    processing. threads is the total number of threads that work on each
+    job, including the calling thread (0 = number of CPU cores).
+ */
+void startThreadPool(unsigned int threads);
+
+/*
+    Stops the worker threads. parallelFor runs jobs on the calling thread
+    after this.
+ */
+void stopThreadPool();
+
+/*
+    Returns the number of threads that work on each job, including the
+    calling thread.
+ */
+unsigned int getThreadPoolSize();
+
+/*
+    Calls body(begin, end) for consecutive ranges that together cover
+    [0, count), in parallel on the calling thread and the worker threads.
+    Each range has at least grain items (except possibly the last one).
+    Returns after all ranges have been processed.
+
+    parallelFor can be called from several threads at the same time and
+    from inside another parallelFor. The body must not throw.
+ */
+void parallelFor(unsigned int count, unsigned int grain,
+                 const std::function<void(unsigned int, unsigned int)>& body);
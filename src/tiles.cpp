@@ -0,0 +1,324 @@
+/*
+    Finds the tiles of a capture that changed since the previous capture.
+
+    A copy of the previous capture is kept, and each tile of a new capture
+    is compared with it row by row with SSE2/AVX2 until the first difference.
+    Only the changed tiles are copied into the previous capture and hashed
+    again, so the work after the comparison scales with the changed area.
+    The fingerprint of a capture is computed from the hashes of its tiles.
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "tiles.hpp"
+#include "cpu.hpp"
+#include "threadpool.hpp"
+
+// Tiles have to line up with the 16x16 blocks of JPG images, so that
+// the tiles of a mosaic don't affect each other when it is compressed
+const unsigned int TILE_ALIGNMENT = 16;
+const unsigned int MAX_TILE_SIZE = 256;
+
+// Masks out the unused X bytes of two BGRX pixels
+const uint64_t COLOR_MASK = 0x00ffffff00ffffffULL;
+
+const uint64_t HASH_MULTIPLIER = 0x9e3779b97f4a7c15ULL;
+
+inline uint64_t mixHash(uint64_t hash) {
+    hash ^= hash >> 32;
+    hash *= HASH_MULTIPLIER;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+/*
+    Row comparison, ignoring the X bytes
+*/
+
+// Compares bytes [x, count), returns true if they are equal
+inline bool rowEqualScalar(const unsigned char* a, const unsigned char* b,
+                           unsigned int x, unsigned int count) {
+    for (; x < count; x++) {
+        if (x % 4 != 3 && a[x] != b[x])
+            return false;
+    }
+    return true;
+}
+
+#ifdef __SSE2__
+// Compares 16 bytes at a time. Sets equal to false if a difference was
+// found, and returns the index of the first byte left uncompared.
+unsigned int rowEqualSSE2(const unsigned char* a, const unsigned char* b,
+                          unsigned int x, unsigned int count, bool* equal) {
+    __m128i mask = _mm_set1_epi32(0x00ffffff);
+
+    for (; x + 16 <= count; x += 16) {
+        __m128i diff = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(a + x)),
+                                     _mm_loadu_si128((const __m128i*)(b + x)));
+        diff = _mm_and_si128(diff, mask);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128()))
+            != 0xffff) {
+            *equal = false;
+            return x;
+        }
+    }
+    return x;
+}
+#endif
+
+#ifdef X86_DISPATCH
+// Compares 32 bytes at a time. Sets equal to false if a difference was
+// found, and returns the index of the first byte left uncompared.
+__attribute__((target("avx2")))
+unsigned int rowEqualAVX2(const unsigned char* a, const unsigned char* b,
+                          unsigned int x, unsigned int count, bool* equal) {
+    __m256i mask = _mm256_set1_epi32(0x00ffffff);
+
+    for (; x + 32 <= count; x += 32) {
+        __m256i diff = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*)(a + x)),
+            _mm256_loadu_si256((const __m256i*)(b + x)));
+        if (!_mm256_testz_si256(diff, mask)) {
+            *equal = false;
+            return x;
+        }
+    }
+    return x;
+}
+#endif
+
+bool rowEqual(const unsigned char* a, const unsigned char* b,
+              unsigned int count) {
+    unsigned int x = 0;
+    bool equal = true;
+
+    #ifdef X86_DISPATCH
+        if (cpuHasAVX2)
+            x = rowEqualAVX2(a, b, x, count, &equal);
+    #endif
+    #ifdef __SSE2__
+        if (equal)
+            x = rowEqualSSE2(a, b, x, count, &equal);
+    #endif
+
+    return equal && rowEqualScalar(a, b, x, count);
+}
+
+/*
+    Tiles
+*/
+
+// Pixel rectangle of a tile
+struct TileRect {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+};
+
+inline TileRect getTileRect(unsigned int column, unsigned int row,
+                            unsigned int tileSize, unsigned int width,
+                            unsigned int height) {
+    TileRect rect;
+    rect.x = column * tileSize;
+    rect.y = row * tileSize;
+    rect.width = std::min(tileSize, width - rect.x);
+    rect.height = std::min(tileSize, height - rect.y);
+    return rect;
+}
+
+bool tileEqual(const RawImage& raw, const TileRect& rect,
+               const std::vector<unsigned char>& previousImage) {
+    size_t previousStride = (size_t)raw.width * 4;
+
+    for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+        const unsigned char* current = (const unsigned char*)raw.data
+                                       + (size_t)y * raw.stride + rect.x * 4;
+        const unsigned char* previous = previousImage.data()
+                                        + y * previousStride + rect.x * 4;
+        if (!rowEqual(current, previous, rect.width * 4))
+            return false;
+    }
+    return true;
+}
+
+// Copies the tile to the previous capture and returns its hash
+uint64_t copyAndHashTile(const RawImage& raw, const TileRect& rect,
+                         std::vector<unsigned char>* previousImage) {
+    size_t previousStride = (size_t)raw.width * 4;
+    uint64_t hash = 0;
+
+    for (unsigned int y = rect.y; y < rect.y + rect.height; y++) {
+        const unsigned char* current = (const unsigned char*)raw.data
+                                       + (size_t)y * raw.stride + rect.x * 4;
+        unsigned char* previous = previousImage->data()
+                                  + y * previousStride + rect.x * 4;
+        memcpy(previous, current, rect.width * 4);
+
+        // Hash two pixels at a time, an odd pixel at the end on its own
+        unsigned int bytes = rect.width * 4;
+        unsigned int x = 0;
+        for (; x + 8 <= bytes; x += 8) {
+            uint64_t word;
+            memcpy(&word, previous + x, 8);
+            hash = (hash ^ (word & COLOR_MASK)) * HASH_MULTIPLIER;
+        }
+        if (x < bytes) {
+            uint32_t word;
+            memcpy(&word, previous + x, 4);
+            hash = (hash ^ (word & 0x00ffffff)) * HASH_MULTIPLIER;
+        }
+    }
+    return mixHash(hash);
+}
+
+void resetTileMap(TileHistory* history) {
+    history->previousWidth = 0;
+    history->previousHeight = 0;
+    history->previousTileSize = 0;
+    history->previousFingerprint = 0;
+}
+
+void updateTileMap(const RawImage& raw, unsigned int tileSize,
+                   TileMap* tiles, TileHistory* history) {
+    if (tileSize == 0 || tileSize % TILE_ALIGNMENT != 0
+        || tileSize > MAX_TILE_SIZE) {
+        throw std::invalid_argument("tile size must be a multiple of 16 "
+                                    "between 16 and 256");
+    }
+
+    unsigned int columns = (raw.width + tileSize - 1) / tileSize;
+    unsigned int rows = (raw.height + tileSize - 1) / tileSize;
+
+    std::vector<unsigned char>& previousImage = history->previousImage;
+    std::vector<uint64_t>& tileHashes = history->tileHashes;
+
+    // Without a previous capture of the same size every tile has changed
+    bool changedAll = raw.width != history->previousWidth
+                      || raw.height != history->previousHeight
+                      || tileSize != history->previousTileSize;
+    if (changedAll) {
+        previousImage.resize((size_t)raw.width * raw.height * 4);
+        tileHashes.assign((size_t)columns * rows, 0);
+        history->previousFingerprint = 0;
+    }
+
+    // One byte per tile while comparing, so threads don't share bytes
+    std::vector<unsigned char>& changed = history->changed;
+    changed.assign((size_t)columns * rows, 0);
+
+    parallelFor(rows, 1, [&](unsigned int begin, unsigned int end) {
+        for (unsigned int row = begin; row < end; row++) {
+            for (unsigned int column = 0; column < columns; column++) {
+                TileRect rect = getTileRect(column, row, tileSize,
+                                            raw.width, raw.height);
+                size_t tile = (size_t)row * columns + column;
+
+                if (changedAll || !tileEqual(raw, rect, previousImage)) {
+                    changed[tile] = 1;
+                    tileHashes[tile] = copyAndHashTile(raw, rect,
+                                                       &previousImage);
+                }
+            }
+        }
+    });
+
+    // Bitmap of the changed tiles, least significant bit first
+    std::string* bitmap = tiles->mutable_changed();
+    bitmap->assign((changed.size() + 7) / 8, 0);
+    unsigned int changedCount = 0;
+    for (size_t tile = 0; tile < changed.size(); tile++) {
+        if (changed[tile]) {
+            (*bitmap)[tile / 8] |= 1 << (tile % 8);
+            changedCount++;
+        }
+    }
+
+    // The fingerprint depends on the hashes and positions of all tiles
+    uint64_t fingerprint = mixHash(((uint64_t)raw.width << 32) | raw.height);
+    for (size_t tile = 0; tile < tileHashes.size(); tile++)
+        fingerprint ^= mixHash(tileHashes[tile] + tile * HASH_MULTIPLIER);
+
+    tiles->set_tile_size(tileSize);
+    tiles->set_columns(columns);
+    tiles->set_rows(rows);
+    tiles->set_changed_count(changedCount);
+    tiles->set_fingerprint(fingerprint);
+    tiles->set_previous_fingerprint(history->previousFingerprint);
+
+    history->previousWidth = raw.width;
+    history->previousHeight = raw.height;
+    history->previousTileSize = tileSize;
+    history->previousFingerprint = fingerprint;
+}
+
+// Returns the top left pixel of the tile with the given index in the mosaic
+inline unsigned char* getMosaicTile(std::vector<unsigned char>& mosaic,
+                                    unsigned int index, unsigned int columns,
+                                    unsigned int tileSize, size_t stride) {
+    return mosaic.data() + (size_t)(index / columns) * tileSize * stride
+           + (size_t)(index % columns) * tileSize * 4;
+}
+
+void packChangedTiles(const RawImage& raw, const TileMap& tiles,
+                      RawImage* packed, TileHistory* history) {
+    std::vector<unsigned char>& mosaic = history->mosaic;
+    unsigned int tileSize = tiles.tile_size();
+    unsigned int columns = tiles.columns();
+    unsigned int count = tiles.changed_count();
+
+    packed->data = NULL;
+    packed->width = 0;
+    packed->height = 0;
+    packed->stride = 0;
+    if (count == 0)
+        return;
+
+    unsigned int mosaicColumns = std::min(count, columns);
+    unsigned int mosaicRows = (count + mosaicColumns - 1) / mosaicColumns;
+    packed->width = mosaicColumns * tileSize;
+    packed->height = mosaicRows * tileSize;
+    packed->stride = packed->width * 4;
+    mosaic.resize((size_t)packed->stride * packed->height);
+
+    const std::string& bitmap = tiles.changed();
+    unsigned int index = 0;
+
+    for (size_t tile = 0; tile < (size_t)columns * tiles.rows(); tile++) {
+        if (!(bitmap[tile / 8] & (1 << (tile % 8))))
+            continue;
+
+        TileRect rect = getTileRect(tile % columns, tile / columns, tileSize,
+                                    raw.width, raw.height);
+        unsigned char* dst = getMosaicTile(mosaic, index, mosaicColumns,
+                                           tileSize, packed->stride);
+
+        for (unsigned int y = 0; y < tileSize; y++) {
+            // Rows below the image repeat the last row
+            unsigned int sourceY = rect.y + std::min(y, rect.height - 1);
+            const unsigned char* src = (const unsigned char*)raw.data
+                                       + (size_t)sourceY * raw.stride
+                                       + rect.x * 4;
+            unsigned char* out = dst + (size_t)y * packed->stride;
+            memcpy(out, src, rect.width * 4);
+
+            // Columns right of the image repeat the last pixel
+            for (unsigned int x = rect.width; x < tileSize; x++)
+                memcpy(out + x * 4, src + (rect.width - 1) * 4, 4);
+        }
+        index++;
+    }
+
+    // Unused tiles at the end of the last mosaic row
+    for (; index < mosaicColumns * mosaicRows; index++) {
+        unsigned char* dst = getMosaicTile(mosaic, index, mosaicColumns,
+                                           tileSize, packed->stride);
+        for (unsigned int y = 0; y < tileSize; y++)
+            memset(dst + (size_t)y * packed->stride, 0, tileSize * 4);
+    }
+
+    packed->data = (const char*)mosaic.data();
+}
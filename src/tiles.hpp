@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "messages.pb.h"
+#include "image.hpp"
+
+/*
+    The previous capture of one display (or other capture target) that its
+    next capture is compared with (see updateTileMap)
+ */
+struct TileHistory {
+    // The previous capture (tightly packed) and the hashes of its tiles
+    std::vector<unsigned char> previousImage;
+    std::vector<uint64_t> tileHashes;
+    unsigned int previousWidth = 0;
+    unsigned int previousHeight = 0;
+    unsigned int previousTileSize = 0;
+    uint64_t previousFingerprint = 0;
+
+    // Whether each tile changed, one byte per tile
+    std::vector<unsigned char> changed;
+
+    // Mosaic of the changed tiles
+    std::vector<unsigned char> mosaic;
+};
+
+/*
+    Compares the image with the image given to the previous call with the
+    same history in tiles of tileSize x tileSize pixels, and stores the
+    bitmap of changed tiles and the fingerprints of both images in tiles
+    (see TileMap in messages.proto).
+
+    All tiles are marked as changed when the size of the image or the
+    tile size changes, or after resetTileMap.
+ */
+void updateTileMap(const RawImage& raw, unsigned int tileSize,
+                   TileMap* tiles, TileHistory* history);
+
+/*
+    Copies the changed tiles of the image into a mosaic image and points
+    packed to it. The mosaic has at most as many tiles per row as the image
+    and the tiles are in the same order as in the bitmap. Parts of edge tiles
+    that are outside the image are filled by repeating the edge pixels.
+
+    The mosaic is kept in the history and stays valid until the next call.
+    If no tiles changed, packed is set to an empty image.
+ */
+void packChangedTiles(const RawImage& raw, const TileMap& tiles,
+                      RawImage* packed, TileHistory* history);
+
+/*
+    Forgets the previous image, for example when another window is captured.
+ */
+void resetTileMap(TileHistory* history);
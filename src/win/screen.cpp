@@ -27,11 +27,56 @@ struct WindowEnumParams {
 std::string cachedProcessName;
 HWND cachedWindow;
 
-unsigned long getJPGScreenshot(std::string* processName, char** imageBuffer,
-                               unsigned int quality) {
+unsigned long getScreenshot(std::string* processName, Frame* frame,
+                            const ImageOptions& options) {
 
     Bitmap* screenshot;
 
+    if (options.format != FORMAT_JPEG)
+        throw std::invalid_argument("image format not supported on Windows");
+
+    if (options.tensor.enabled)
+        throw std::invalid_argument("tensors are not supported on Windows");
+
+    if (options.isScaled())
+        throw std::invalid_argument("scaling is not supported on Windows");
+
+    if (options.subsampling != SUBSAMPLING_420)
+        throw std::invalid_argument("subsampling is not supported on Windows");
+
+    if (options.region.width != 0 || options.region.height != 0
+        || options.monitor != 0)
+        throw std::invalid_argument("regions are not supported on Windows");
+
+    if (options.maxPool > 1)
+        throw std::invalid_argument("max-pooling is not supported on Windows");
+
+    if (options.tileSize != 0)
+        throw std::invalid_argument("tiles are not supported on Windows");
+
+    if (!options.rois.empty()) {
+        throw std::invalid_argument("regions of interest are not supported "
+                                    "on Windows");
+    }
+
+    if (!options.outputs.empty())
+        throw std::invalid_argument("outputs are not supported on Windows");
+
+    if (!options.windows.empty()) {
+        throw std::invalid_argument("multi-window capture is not supported "
+                                    "on Windows");
+    }
+
+    if (options.windowPid != 0 || !options.windowClass.empty()) {
+        throw std::invalid_argument("selecting windows by PID or class is "
+                                    "not supported on Windows");
+    }
+
+    if (options.captureBackend != CAPTURE_XSHM) {
+        throw std::invalid_argument("capture backends are not supported "
+                                    "on Windows");
+    }
+
     // Parameters for EnumWindows callback
     WindowEnumParams params;      
     params.processName = processName;
@@ -63,13 +108,23 @@ unsigned long getJPGScreenshot(std::string* processName, char** imageBuffer,
     START_TIMER("bitmapToJPG");
 
     // Convert to JPG
-    unsigned long bytes = bitmapToJPG(params.screenshot, imageBuffer, quality);
+    unsigned long bytes = bitmapToJPG(params.screenshot, &frame->image,
+                                      options.quality);
 
     END_TIMER("bitmapToJPG");
 
     return bytes;
 }
 
+uint64_t getDamageGeneration() {
+    // Changes to windows are not tracked on Windows
+    return 0;
+}
+
+uint64_t waitForDamage(uint64_t generation, unsigned int timeout) {
+    return 0;
+}
+
 Bitmap* takeScreenshot(HWND window) {
     /*
         Takes a screenshot of the screen and
@@ -132,13 +187,14 @@ Bitmap* takeScreenshot(HWND window) {
     return bitmap;
 }
 
-ULONG bitmapToJPG(Bitmap* bitmap, char** imageBuffer, unsigned int quality) {
+ULONG bitmapToJPG(Bitmap* bitmap, ImageBuffer* imageBuffer,
+                  unsigned int quality) {
     /*
         Encodes a GDI+ bitmap as JPG.
 
         Parameters:
             bitmap: Pointer to the GDI+ Bitmap that is being encoded.
-            imageBuffer: address of the pointer that will receive the new image
+            imageBuffer: buffer that will receive the new image
             quality: quality of the compressed jpg (0-100)
     */
 
@@ -161,17 +217,20 @@ ULONG bitmapToJPG(Bitmap* bitmap, char** imageBuffer, unsigned int quality) {
     // Save compressed bitmap to the IStream
     Status stat = bitmap->Save(istream, &encoderClsid, &params);
 
+    UINT width = bitmap->GetWidth();
+    UINT height = bitmap->GetHeight();
+
     // Delete Bitmap object to free memory
     delete bitmap;
 
     if (stat != Ok)
         std::cout << "Saving image failed" << std::endl;
 
-    // Allocate memory for the image
+    // Make sure the image buffer is large enough
     STATSTG statstg;
     istream->Stat(&statstg, 0);
     ULONGLONG bufferLength = statstg.cbSize.QuadPart;
-    *imageBuffer = new char[bufferLength];
+    char* buffer = imageBuffer->reserve(bufferLength);
 
     // Copy data from IStream to the allocated byte array
     LARGE_INTEGER seekPosition;
@@ -179,10 +238,13 @@ ULONG bitmapToJPG(Bitmap* bitmap, char** imageBuffer, unsigned int quality) {
     istream->Seek(seekPosition, STREAM_SEEK_SET, NULL);
 
     ULONG bytesRead;
-    HRESULT readResult = istream->Read(*imageBuffer, bufferLength, &bytesRead);
+    HRESULT readResult = istream->Read(buffer, bufferLength, &bytesRead);
     if (readResult != S_OK)
         std::cout << "Reading from IStream failed" << std::endl;
 
+    imageBuffer->setSize(bytesRead);
+    imageBuffer->setInfo(FORMAT_JPEG, width, height);
+
     istream->Release();
 
     return bytesRead;
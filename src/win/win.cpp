@@ -7,6 +7,7 @@
 #include <string>
 #include <set>
 #include <deque>
+#include <stdexcept>
 
 #include <windows.h>
 #include <gdiplus.h>
@@ -42,6 +43,40 @@ void shutdown() {
     GdiplusShutdown(gdiplusToken);
 }
 
+void selectDisplay(const std::string& name) {
+    if (!name.empty())
+        throw std::invalid_argument("displays are not supported on Windows");
+}
+
+void setFramebufferDir(const std::string& dir) {
+    if (!dir.empty()) {
+        throw std::invalid_argument("framebuffer capture is not supported "
+                                    "on Windows");
+    }
+}
+
+size_t enableHugePages() {
+    throw std::invalid_argument("huge pages are not supported on Windows");
+}
+
+void lockMemory(const void* data, size_t bytes) {
+    /*
+        Locks the memory with VirtualLock. The process can only lock a
+        small part of its minimum working set by default, so the working
+        set is grown to fit the memory first.
+     */
+
+    HANDLE process = GetCurrentProcess();
+    SIZE_T minSize, maxSize;
+    if (GetProcessWorkingSetSize(process, &minSize, &maxSize))
+        SetProcessWorkingSetSize(process, minSize + bytes, maxSize + bytes);
+
+    if (!VirtualLock((LPVOID)data, bytes)) {
+        throw std::invalid_argument("VirtualLock failed with error "
+                                    + std::to_string(GetLastError()));
+    }
+}
+
 /*
     A thread that calls GetMessage in a loop. This is required for the
     mouse and keyboard hooks to work.
@@ -0,0 +1,165 @@
+/*
+    Checks the order in which the adaptive controller lowers and raises the
+    settings, and when it holds them. The check program is only built on
+    Linux, where the subsampling and the scale are adjusted too.
+*/
+
+#include <cmath>
+#include <cstdint>
+
+#include "check.hpp"
+#include "../src/adaptive.hpp"
+
+// Encoding time limit of the frames in milliseconds
+const float MAX_ENCODE_MS = 10;
+
+// The best settings
+const unsigned int QUALITY = 35;
+const float MIN_SCALE = 0.5f;
+
+struct AdaptiveCheck {
+    AdaptiveState state;
+    AdaptiveTarget target;
+    ImageOptions options;
+    uint64_t timestamp = 0;
+
+    AdaptiveCheck() {
+        target.set_max_encode_ms(MAX_ENCODE_MS);
+        target.set_min_scale(MIN_SCALE);
+        options.quality = QUALITY;
+        options.subsampling = SUBSAMPLING_444;
+        setAdaptiveTarget(target, options, &state);
+    }
+
+    void measure(float load) {
+        /*
+            Measures a new frame made with the current settings, which took
+            the given part of the encoding time limit
+         */
+
+        Frame frame;
+        frame.options = options;
+        applyAdaptiveSettings(&state, &frame.options);
+        frame.timestamp = ++timestamp;
+        frame.encodeTime = (uint64_t)(load * MAX_ENCODE_MS * 1000);
+        updateAdaptiveSettings(frame, frame.encodeTime, &state);
+    }
+
+    bool measureUntilChanged(float load, unsigned int maxFrames) {
+        /*
+            Measures frames with the given load until the settings change,
+            returns false if they didn't change within maxFrames frames
+         */
+
+        AdaptiveState previous = state;
+        for (unsigned int i = 0; i < maxFrames; i++) {
+            measure(load);
+            if (state.quality != previous.quality
+                || state.subsampling != previous.subsampling
+                || state.scale != previous.scale) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool has(unsigned int quality, ChromaSubsampling subsampling,
+             float scale) const {
+        return state.quality == quality && state.subsampling == subsampling
+               && std::fabs(state.scale - scale) < 1e-4f;
+    }
+};
+
+void checkAdaptive() {
+    AdaptiveCheck check;
+    CHECK(check.has(QUALITY, SUBSAMPLING_444, 1));
+
+    // Too slow: first the quality down to 20, then the subsampling,
+    // then the scale down to the minimum, one step per frame
+    check.measure(2);
+    CHECK(check.has(30, SUBSAMPLING_444, 1));
+    check.measure(2);
+    check.measure(2);
+    CHECK(check.has(20, SUBSAMPLING_444, 1));
+    check.measure(2);
+    CHECK(check.has(20, SUBSAMPLING_422, 1));
+    check.measure(2);
+    CHECK(check.has(20, SUBSAMPLING_420, 1));
+    check.measure(2);
+    CHECK(check.has(20, SUBSAMPLING_420, 0.75f));
+    check.measure(2);
+    check.measure(2);
+    CHECK(check.has(20, SUBSAMPLING_420, MIN_SCALE));
+    check.measure(2);
+    CHECK(check.has(20, SUBSAMPLING_420, MIN_SCALE));
+
+    ImageOptions options = check.options;
+    applyAdaptiveSettings(&check.state, &options);
+    CHECK(options.quality == 20 && options.subsampling == SUBSAMPLING_420
+          && options.scale == MIN_SCALE);
+
+    // Room again: once the smoothed load of the slow frames has come down,
+    // back up in the opposite order
+    CHECK(check.measureUntilChanged(0.1f, 10));
+    CHECK(check.has(20, SUBSAMPLING_420, MIN_SCALE / 0.75f));
+    check.measure(0.1f);
+    check.measure(0.1f);
+    CHECK(check.has(20, SUBSAMPLING_420, 1));
+    check.measure(0.1f);
+    CHECK(check.has(20, SUBSAMPLING_422, 1));
+    check.measure(0.1f);
+    CHECK(check.has(20, SUBSAMPLING_444, 1));
+    check.measure(0.1f);
+    CHECK(check.has(25, SUBSAMPLING_444, 1));
+    check.measure(0.1f);
+    check.measure(0.1f);
+    CHECK(check.has(QUALITY, SUBSAMPLING_444, 1));
+    check.measure(0.1f);
+    CHECK(check.has(QUALITY, SUBSAMPLING_444, 1));
+
+    // A single slow frame is smoothed out, slow frames in a row are not
+    check = AdaptiveCheck();
+    check.measure(0.9f);
+    check.measure(1.2f);
+    CHECK(check.has(QUALITY, SUBSAMPLING_444, 1));
+    check.measure(1.2f);
+    CHECK(check.has(30, SUBSAMPLING_444, 1));
+
+    // Not raised when the load after the step would be too close to the
+    // limit, which would make the settings go back and forth
+    check.measure(0.8f);
+    CHECK(check.has(30, SUBSAMPLING_444, 1));
+    check.measure(0.5f);
+    CHECK(check.has(QUALITY, SUBSAMPLING_444, 1));
+
+    // Frames made with other settings, or measured already, are ignored
+    check.measure(2);
+    CHECK(check.has(30, SUBSAMPLING_444, 1));
+    Frame stale;
+    stale.options = check.options;
+    stale.timestamp = ++check.timestamp;
+    stale.encodeTime = 100 * 1000;
+    updateAdaptiveSettings(stale, stale.encodeTime, &check.state);
+    CHECK(check.has(30, SUBSAMPLING_444, 1));
+
+    Frame measured;
+    applyAdaptiveSettings(&check.state, &measured.options);
+    measured.timestamp = check.timestamp - 1;
+    measured.encodeTime = 100 * 1000;
+    updateAdaptiveSettings(measured, measured.encodeTime, &check.state);
+    CHECK(check.has(30, SUBSAMPLING_444, 1));
+
+    // The same target keeps the settings, another one starts over
+    setAdaptiveTarget(check.target, check.options, &check.state);
+    CHECK(check.has(30, SUBSAMPLING_444, 1));
+    check.target.set_max_encode_ms(MAX_ENCODE_MS * 2);
+    setAdaptiveTarget(check.target, check.options, &check.state);
+    CHECK(check.has(QUALITY, SUBSAMPLING_444, 1));
+
+    // Below the minimum quality only the subsampling and scale change
+    AdaptiveCheck low;
+    low.options.quality = 15;
+    setAdaptiveTarget(low.target, low.options, &low.state);
+    low.measure(2);
+    CHECK(low.has(15, SUBSAMPLING_422, 1));
+}
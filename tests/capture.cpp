@@ -0,0 +1,180 @@
+/*
+    Checks the handoff of frames from the background capture thread to the
+    request loop, with a capture backend that numbers its images
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "check.hpp"
+#include "../src/capture.hpp"
+#include "../src/platform.hpp"
+#include "../src/source.hpp"
+
+// Number of 32-bit words in each image
+const size_t IMAGE_WORDS = 16384;
+
+/*
+    Fills every word of each image with the number of the capture, so that
+    an image that is written while it is read has mixed numbers
+ */
+class CountingSource : public CaptureSource {
+public:
+    void selectDisplay(const std::string& /*name*/) override {}
+
+    bool hasInputs() const override {
+        return false;
+    }
+
+    unsigned long capture(std::string* /*processName*/, Frame* frame,
+                          const ImageOptions& /*options*/) override {
+        int running = ++active;
+        int most = mostActive;
+        while (running > most && !mostActive.compare_exchange_weak(most,
+                                                                   running)) {}
+
+        uint32_t number = ++captures;
+        size_t bytes = IMAGE_WORDS * 4;
+
+        char* data = frame->image.reserve(bytes);
+        for (size_t i = 0; i < IMAGE_WORDS; i++)
+            memcpy(data + i * 4, &number, 4);
+
+        frame->image.setSize(bytes);
+        frame->image.setInfo(FORMAT_BGRX, IMAGE_WORDS, 1);
+
+        if (slow)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        active--;
+        return bytes;
+    }
+
+    uint64_t getGeneration() override {
+        return 0;
+    }
+
+    uint64_t waitForChange(uint64_t /*generation*/,
+                           unsigned int /*timeout*/) override {
+        return 0;
+    }
+
+    std::atomic<uint32_t> captures{0};
+
+    // Captures in progress, and the most there have been at the same time
+    std::atomic<int> active{0};
+    std::atomic<int> mostActive{0};
+
+    // Whether captures take a while, so that they overlap
+    std::atomic<bool> slow{false};
+};
+
+uint32_t getFrameNumber(const Frame& frame) {
+    /*
+        Returns the number of the capture the frame has, or 0 if its words
+        are not all the same
+     */
+
+    const ImageBuffer& image = frame.image;
+    if (image.size() != IMAGE_WORDS * 4)
+        return 0;
+
+    uint32_t first;
+    memcpy(&first, image.data(), 4);
+    for (size_t i = 1; i < IMAGE_WORDS; i++) {
+        uint32_t number;
+        memcpy(&number, image.data() + i * 4, 4);
+        if (number != first)
+            return 0;
+    }
+    return first;
+}
+
+void checkCapture() {
+    CountingSource source;
+    setCaptureSource(&source);
+
+    std::string name;
+    ImageOptions options;
+    options.format = FORMAT_BGRX;
+
+    // Without the capture thread, every request captures a new image,
+    // since the backend doesn't track changes
+    Frame* frame = getFrame("", &name, options, 0);
+    uint32_t first = getFrameNumber(*frame);
+    CHECK(first != 0);
+
+    frame = getFrame("", &name, options, 0);
+    CHECK(getFrameNumber(*frame) == first + 1);
+
+    // With the capture thread, the request loop gets the newest published
+    // frame, which is never written to while the request loop has it
+    startCaptureThread(0);
+    frame = getFrame("", &name, options, 0);
+    CHECK(getFrameNumber(*frame) != 0);
+
+    // Wait until the thread has published frames newer than the ones
+    // captured by the request loop
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    uint32_t previous = 0;
+    uint32_t start = 0;
+    bool consistent = true;
+    bool ordered = true;
+    for (int i = 0; i < 200; i++) {
+        frame = getFrame("", &name, options, 0);
+        uint32_t number = getFrameNumber(*frame);
+
+        // The thread keeps capturing while the frame is read
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        consistent = consistent && number != 0
+                     && getFrameNumber(*frame) == number;
+        ordered = ordered && number >= previous;
+
+        if (start == 0)
+            start = number;
+        previous = number;
+    }
+    CHECK(consistent);
+    CHECK(ordered);
+
+    // The thread delivered new frames during the loop
+    CHECK(previous > start);
+
+    // Another display is captured by its own thread at the same time,
+    // but each display only captures one frame at a time
+    source.slow = true;
+    source.mostActive = 0;
+    frame = getFrame(":1", &name, options, 0);
+    CHECK(getFrameNumber(*frame) != 0);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    CHECK(source.mostActive == 2);
+
+    stopCaptureThread();
+}
+
+/*
+    The platform functions are only called through the platform backend,
+    which the checks replace, so they don't need a display
+ */
+void selectDisplay(const std::string& /*name*/) {}
+
+void lockMemory(const void* /*data*/, size_t /*bytes*/) {}
+
+unsigned long getScreenshot(std::string* /*processName*/, Frame* /*frame*/,
+                            const ImageOptions& /*options*/) {
+    return 0;
+}
+
+uint64_t getDamageGeneration() {
+    return 0;
+}
+
+uint64_t waitForDamage(uint64_t /*generation*/, unsigned int /*timeout*/) {
+    return 0;
+}
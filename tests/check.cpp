@@ -0,0 +1,46 @@
+/*
+    Self-checks of the image processing and the frame handling code that
+    don't need a display. Run with make check.
+*/
+
+#include <iostream>
+
+#include "check.hpp"
+#include "../src/threadpool.hpp"
+
+int checkFailures = 0;
+
+void fillNoise(TestImage* image, uint32_t seed) {
+    uint32_t state = seed;
+    for (char& value : image->pixels) {
+        state = state * 1664525 + 1013904223;
+        value = state >> 24;
+    }
+}
+
+int main() {
+    // The kernels split their work between the threads like in the server,
+    // with enough threads that jpg images are encoded in bands on any CPU
+    startThreadPool(4);
+
+    checkResize();
+    checkConvert();
+    checkTensor();
+    checkTiles();
+    checkMaxPool();
+    checkQOI();
+    checkJPEG();
+    checkCapture();
+    checkHistory();
+    checkAdaptive();
+
+    stopThreadPool();
+
+    if (checkFailures != 0) {
+        std::cout << checkFailures << " checks failed" << std::endl;
+        return 1;
+    }
+
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
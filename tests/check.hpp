@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "../src/image.hpp"
+
+/*
+    Checks of the self-check program (see make check). A failed check is
+    printed and makes the program exit with an error, but the remaining
+    checks are still run.
+ */
+extern int checkFailures;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cout << __FILE__ << ":" << __LINE__ \
+                      << ": check failed: " #condition << std::endl; \
+            checkFailures++; \
+        } \
+    } while (0)
+
+// Source image of the checks, rows are tightly packed
+struct TestImage {
+    std::vector<char> pixels;
+    unsigned int width;
+    unsigned int height;
+
+    TestImage(unsigned int width, unsigned int height)
+        : pixels((size_t)width * height * 4), width(width), height(height) {}
+
+    unsigned char* pixel(unsigned int x, unsigned int y) {
+        return (unsigned char*)&pixels[((size_t)y * width + x) * 4];
+    }
+
+    RawImage raw() const {
+        return { pixels.data(), width, height, width * 4 };
+    }
+};
+
+/*
+    Fills the image with pseudo-random bytes, which are the same for the
+    same seed on every run
+ */
+void fillNoise(TestImage* image, uint32_t seed);
+
+// Groups of checks, one per file
+void checkResize();
+void checkConvert();
+void checkTensor();
+void checkTiles();
+void checkMaxPool();
+void checkQOI();
+void checkJPEG();
+void checkCapture();
+void checkHistory();
+void checkAdaptive();
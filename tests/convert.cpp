@@ -0,0 +1,146 @@
+/*
+    Compares the pixel format converters with per-pixel reference
+    implementations, for sizes that end in every part of the SIMD kernels
+*/
+
+#include <cstdint>
+#include <vector>
+
+#include "check.hpp"
+#include "../src/convert.hpp"
+
+// Extra pixels at the end of each source row, and the value of the
+// guard bytes after the converted image
+const unsigned int ROW_PADDING = 3;
+const char GUARD = 0x5a;
+const size_t GUARD_BYTES = 64;
+
+inline unsigned char getLuma(const unsigned char* p, int b, int g, int r,
+                             int offset) {
+    return ((b * p[0] + g * p[1] + r * p[2] + 128) >> 8) + offset;
+}
+
+std::vector<unsigned char> convertReference(const RawImage& src,
+                                            ImageFormat format) {
+    /*
+        Converts the image one pixel at a time with the formulas of
+        convert.hpp
+     */
+
+    unsigned int width = src.width;
+    unsigned int height = src.height;
+    std::vector<unsigned char> dst(getRawImageSize(format, width, height));
+
+    auto pixel = [&](unsigned int x, unsigned int y) {
+        return (const unsigned char*)src.data + (size_t)y * src.stride + x * 4;
+    };
+
+    for (unsigned int y = 0; y < height; y++) {
+        for (unsigned int x = 0; x < width; x++) {
+            const unsigned char* p = pixel(x, y);
+            size_t i = (size_t)y * width + x;
+
+            if (format == FORMAT_BGRX) {
+                for (int c = 0; c < 4; c++)
+                    dst[i * 4 + c] = p[c];
+            } else if (format == FORMAT_RGB24) {
+                for (int c = 0; c < 3; c++)
+                    dst[i * 3 + c] = p[2 - c];
+            } else if (format == FORMAT_GRAY8) {
+                dst[i] = getLuma(p, 29, 150, 77, 0);
+            } else if (format == FORMAT_I420) {
+                dst[i] = getLuma(p, 25, 129, 66, 16);
+            }
+        }
+    }
+
+    if (format != FORMAT_I420)
+        return dst;
+
+    // Chroma of 2x2 blocks, odd edges are paired with themselves
+    unsigned int chromaWidth = (width + 1) / 2;
+    unsigned int chromaHeight = (height + 1) / 2;
+    unsigned char* u = dst.data() + (size_t)width * height;
+    unsigned char* v = u + (size_t)chromaWidth * chromaHeight;
+
+    for (unsigned int y = 0; y < chromaHeight; y++) {
+        for (unsigned int x = 0; x < chromaWidth; x++) {
+            unsigned int left = x * 2;
+            unsigned int right = left + 1 < width ? left + 1 : left;
+            unsigned int top = y * 2;
+            unsigned int bottom = top + 1 < height ? top + 1 : top;
+
+            int avg[3];
+            for (int c = 0; c < 3; c++) {
+                int sum = pixel(left, top)[c] + pixel(right, top)[c]
+                          + pixel(left, bottom)[c] + pixel(right, bottom)[c];
+                avg[c] = (sum + 2) >> 2;
+            }
+
+            int us = 112 * avg[0] - 74 * avg[1] - 38 * avg[2];
+            int vs = -18 * avg[0] - 94 * avg[1] + 112 * avg[2];
+            size_t i = (size_t)y * chromaWidth + x;
+            u[i] = ((us + 128) >> 8) + 128;
+            v[i] = ((vs + 128) >> 8) + 128;
+        }
+    }
+    return dst;
+}
+
+bool convertsLikeReference(const RawImage& src, ImageFormat format) {
+    /*
+        Returns true if convertImage gives the same bytes as the reference
+        and doesn't write past the size given by getRawImageSize
+     */
+
+    size_t bytes = getRawImageSize(format, src.width, src.height);
+    std::vector<char> dst(bytes + GUARD_BYTES, GUARD);
+    convertImage(src, format, dst.data());
+
+    std::vector<unsigned char> expected = convertReference(src, format);
+    for (size_t i = 0; i < bytes; i++) {
+        if ((unsigned char)dst[i] != expected[i])
+            return false;
+    }
+    for (size_t i = bytes; i < dst.size(); i++) {
+        if (dst[i] != GUARD)
+            return false;
+    }
+    return true;
+}
+
+void checkConvert() {
+    const ImageFormat formats[] = {
+        FORMAT_BGRX, FORMAT_RGB24, FORMAT_GRAY8, FORMAT_I420
+    };
+    const unsigned int sizes[][2] = {
+        { 1, 1 }, { 2, 2 }, { 3, 5 }, { 15, 4 }, { 16, 2 }, { 33, 7 },
+        { 67, 3 }, { 128, 6 }, { 257, 9 }
+    };
+
+    for (const unsigned int* size : sizes) {
+        // The padding at the end of the rows is not part of the image
+        TestImage image(size[0] + ROW_PADDING, size[1]);
+        fillNoise(&image, size[0] * 1000 + size[1]);
+
+        RawImage raw = image.raw();
+        raw.width = size[0];
+
+        for (ImageFormat format : formats)
+            CHECK(convertsLikeReference(raw, format));
+    }
+
+    // Extreme colors, which saturate the intermediate values the most
+    TestImage extremes(40, 4);
+    for (unsigned int y = 0; y < extremes.height; y++) {
+        for (unsigned int x = 0; x < extremes.width; x++) {
+            for (int c = 0; c < 4; c++)
+                extremes.pixel(x, y)[c] = (x + y) >> c & 1 ? 255 : 0;
+        }
+    }
+    for (ImageFormat format : formats)
+        CHECK(convertsLikeReference(extremes.raw(), format));
+
+    CHECK(getRawImageSize(FORMAT_I420, 5, 3) == 15 + 2 * 3 * 2);
+    CHECK(getRawImageSize(FORMAT_JPEG, 5, 3) == 0);
+}
@@ -0,0 +1,113 @@
+/*
+    Checks the lookups and the byte budget of the frame history
+*/
+
+#include <cstdint>
+
+#include "check.hpp"
+#include "../src/history.hpp"
+
+// Size of the images added to the history
+const size_t IMAGE_BYTES = 100;
+
+void addImage(uint64_t timestamp, size_t bytes = IMAGE_BYTES) {
+    /*
+        Adds an image whose bytes are all the low byte of its timestamp
+     */
+
+    ImageBuffer image;
+    char* data = image.reserve(bytes);
+    for (size_t i = 0; i < bytes; i++)
+        data[i] = (char)timestamp;
+
+    image.setSize(bytes);
+    image.setInfo(FORMAT_GRAY8, bytes, 1);
+    addToHistory(image, timestamp);
+}
+
+bool isImageOf(const TimedImage& timed, uint64_t timestamp) {
+    /*
+        Returns true if the history image is the one added with the given
+        timestamp (see addImage)
+     */
+
+    if (timed.timestamp() != timestamp || timed.format() != FORMAT_GRAY8
+        || timed.image().size() != IMAGE_BYTES
+        || timed.width() != IMAGE_BYTES || timed.height() != 1) {
+        return false;
+    }
+
+    for (char value : timed.image()) {
+        if (value != (char)timestamp)
+            return false;
+    }
+    return true;
+}
+
+uint64_t getFrameAt(uint64_t timestamp) {
+    /*
+        Returns the timestamp of the one frame found for the given time,
+        or 0 if there was none
+     */
+
+    Response respMsg;
+    if (!getHistoryFrameAt(timestamp, &respMsg) || respMsg.history_size() != 1)
+        return 0;
+
+    return respMsg.history(0).timestamp();
+}
+
+void checkHistory() {
+    Response respMsg;
+
+    // The history is disabled by default
+    setHistoryBudget(0);
+    addImage(10);
+    CHECK(getHistoryLastFrames(5, &respMsg) == 0);
+    CHECK(getFrameAt(10) == 0);
+
+    // Room for three images
+    setHistoryBudget(3 * IMAGE_BYTES);
+    addImage(10);
+    addImage(20);
+    addImage(30);
+
+    // The newest frame at or before the time
+    CHECK(getFrameAt(5) == 0);
+    CHECK(getFrameAt(10) == 10);
+    CHECK(getFrameAt(25) == 20);
+    CHECK(getFrameAt(30) == 30);
+    CHECK(getFrameAt(1000) == 30);
+
+    respMsg.Clear();
+    CHECK(getHistoryFrameAt(25, &respMsg));
+    CHECK(respMsg.history_size() == 1 && isImageOf(respMsg.history(0), 20));
+
+    // A fourth image drops the oldest one
+    addImage(40);
+    CHECK(getFrameAt(15) == 0);
+    CHECK(getFrameAt(20) == 20);
+
+    // The newest frames, oldest first
+    respMsg.Clear();
+    CHECK(getHistoryLastFrames(2, &respMsg) == 2);
+    CHECK(respMsg.history_size() == 2 && isImageOf(respMsg.history(0), 30)
+          && isImageOf(respMsg.history(1), 40));
+
+    respMsg.Clear();
+    CHECK(getHistoryLastFrames(10, &respMsg) == 3);
+    CHECK(respMsg.history_size() == 3 && isImageOf(respMsg.history(0), 20));
+
+    // Images larger than the whole budget are not kept
+    addImage(50, 4 * IMAGE_BYTES);
+    CHECK(getFrameAt(50) == 40);
+
+    // A smaller budget drops the oldest frames right away
+    setHistoryBudget(IMAGE_BYTES + IMAGE_BYTES / 2);
+    respMsg.Clear();
+    CHECK(getHistoryLastFrames(10, &respMsg) == 1);
+    CHECK(respMsg.history_size() == 1 && isImageOf(respMsg.history(0), 40));
+
+    setHistoryBudget(0);
+    CHECK(getFrameAt(40) == 0);
+}
@@ -0,0 +1,156 @@
+/*
+    Checks that jpg images encoded in parallel bands are valid and decode
+    to the same pixels as the image encoded in one piece, and that images
+    are only split into bands when requested
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <turbojpeg.h>
+
+#include "check.hpp"
+#include "../src/encode.hpp"
+
+// Size of the image, which doesn't end on an MCU boundary
+const unsigned int IMAGE_WIDTH = 630;
+const unsigned int IMAGE_HEIGHT = 470;
+
+const unsigned int QUALITY = 90;
+
+bool decodeJPEG(const unsigned char* jpeg, unsigned long size,
+                std::vector<unsigned char>* pixels) {
+    /*
+        Decodes a jpg image of IMAGE_WIDTH x IMAGE_HEIGHT pixels into BGRX
+        pixels. Returns false if it is not a valid image of that size.
+     */
+
+    tjhandle instance = tjInitDecompress();
+    int width, height, subsamp, colorspace;
+    bool valid = tjDecompressHeader3(instance, jpeg, size, &width, &height,
+                                     &subsamp, &colorspace) == 0
+                 && width == (int)IMAGE_WIDTH && height == (int)IMAGE_HEIGHT;
+
+    if (valid) {
+        pixels->resize((size_t)width * height * 4);
+        valid = tjDecompress2(instance, jpeg, size, pixels->data(), width,
+                              width * 4, height, TJPF_BGRX, 0) == 0;
+    }
+
+    tjDestroy(instance);
+    return valid;
+}
+
+bool encodeWhole(const TestImage& image, int subsamp,
+                 std::vector<unsigned char>* jpeg) {
+    /*
+        Encodes the image in one piece with libjpeg-turbo
+     */
+
+    tjhandle instance = tjInitCompress();
+    unsigned long size = tjBufSize(IMAGE_WIDTH, IMAGE_HEIGHT, subsamp);
+    jpeg->resize(size);
+    unsigned char* buffer = jpeg->data();
+    bool encoded = tjCompress2(instance, (const unsigned char*)image.raw().data,
+                               IMAGE_WIDTH, IMAGE_WIDTH * 4, IMAGE_HEIGHT,
+                               TJPF_BGRX, &buffer, &size, subsamp, QUALITY,
+                               TJFLAG_NOREALLOC) == 0;
+    tjDestroy(instance);
+
+    jpeg->resize(size);
+    return encoded;
+}
+
+void encodeWithFrame(const TestImage& image, ChromaSubsampling subsampling,
+                     bool bands, Frame* frame) {
+    ImageOptions options;
+    options.format = FORMAT_JPEG;
+    options.quality = QUALITY;
+    options.subsampling = subsampling;
+    options.jpegBands = bands;
+
+    EncodeState state;
+    initEncoder(&state);
+    encodeFrame(image.raw(), options, &state, frame);
+    shutdownEncoder(&state);
+}
+
+bool bandsMatchWholeImage(const TestImage& image,
+                          ChromaSubsampling subsampling, int subsamp) {
+    /*
+        Encodes the image with encodeFrame, which splits it into bands, and
+        returns true if the result decodes to the same pixels as the image
+        encoded in one piece, and the band offsets follow restart markers
+     */
+
+    Frame frame;
+    encodeWithFrame(image, subsampling, true, &frame);
+
+    const unsigned char* jpeg = (const unsigned char*)frame.image.data();
+    if (frame.bandOffsets.size() < 2 || frame.bandHeight == 0
+        || frame.bandHeight % tjMCUHeight[subsamp] != 0) {
+        return false;
+    }
+
+    // Every band but the first starts right after a restart marker
+    for (size_t band = 1; band < frame.bandOffsets.size(); band++) {
+        uint32_t offset = frame.bandOffsets[band];
+        if (offset < 2 || offset >= frame.image.size()
+            || jpeg[offset - 2] != 0xff
+            || jpeg[offset - 1] != 0xd0 + (band - 1) % 8) {
+            return false;
+        }
+    }
+
+    std::vector<unsigned char> banded;
+    if (!decodeJPEG(jpeg, frame.image.size(), &banded))
+        return false;
+
+    std::vector<unsigned char> whole;
+    std::vector<unsigned char> expected;
+    return encodeWhole(image, subsamp, &whole)
+           && decodeJPEG(whole.data(), whole.size(), &expected)
+           && banded == expected;
+}
+
+bool isWholeImage(const TestImage& image, ChromaSubsampling subsampling,
+                  int subsamp) {
+    /*
+        Returns true if encodeFrame without bands makes the same bytes as
+        libjpeg-turbo makes of the whole image
+     */
+
+    Frame frame;
+    encodeWithFrame(image, subsampling, false, &frame);
+
+    std::vector<unsigned char> whole;
+    return encodeWhole(image, subsamp, &whole) && frame.bandOffsets.empty()
+           && frame.bandHeight == 0 && frame.image.size() == whole.size()
+           && memcmp(frame.image.data(), whole.data(), whole.size()) == 0;
+}
+
+void checkJPEG() {
+    // Smooth gradients with a noisy block, like a game screen
+    TestImage image(IMAGE_WIDTH, IMAGE_HEIGHT);
+    fillNoise(&image, 5);
+    for (unsigned int y = 0; y < image.height; y++) {
+        for (unsigned int x = 0; x < image.width; x++) {
+            if (x > 200 && x < 300 && y > 100 && y < 400)
+                continue;
+
+            unsigned char* p = image.pixel(x, y);
+            p[0] = x / 3;
+            p[1] = y / 2;
+            p[2] = (x + y) / 5;
+        }
+    }
+
+    CHECK(bandsMatchWholeImage(image, SUBSAMPLING_420, TJSAMP_420));
+    CHECK(bandsMatchWholeImage(image, SUBSAMPLING_422, TJSAMP_422));
+    CHECK(bandsMatchWholeImage(image, SUBSAMPLING_444, TJSAMP_444));
+
+    // Without bands the image is exactly what libjpeg-turbo makes
+    CHECK(isWholeImage(image, SUBSAMPLING_420, TJSAMP_420));
+    CHECK(isWholeImage(image, SUBSAMPLING_444, TJSAMP_444));
+}
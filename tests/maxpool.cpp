@@ -0,0 +1,162 @@
+/*
+    Checks the pixel-wise maximum of the max-pooled captures against the
+    captures in the pool, and the images kept in the frame stack
+*/
+
+#include <cstring>
+#include <initializer_list>
+
+#include "check.hpp"
+#include "../src/maxpool.hpp"
+#include "../src/stack.hpp"
+
+// Size of the captures, which ends in every part of the SIMD kernels
+const unsigned int IMAGE_WIDTH = 37;
+const unsigned int IMAGE_HEIGHT = 21;
+
+// Extra pixels at the end of each source row
+const unsigned int ROW_PADDING = 3;
+
+RawImage getCapture(const TestImage& image) {
+    // The padding at the end of the rows is not part of the capture
+    RawImage raw = image.raw();
+    raw.width -= ROW_PADDING;
+    return raw;
+}
+
+bool poolsTo(const TestImage& image, unsigned int frames, MaxPool* pool,
+             std::initializer_list<const TestImage*> expected) {
+    /*
+        Max-pools the image and returns true if each byte of the result is
+        the maximum of the same byte in the expected images
+     */
+
+    RawImage raw = getCapture(image);
+    maxPoolImage(&raw, frames, pool);
+    if (raw.width != image.width - ROW_PADDING || raw.height != image.height
+        || raw.stride != raw.width * 4) {
+        return false;
+    }
+
+    for (unsigned int y = 0; y < raw.height; y++) {
+        for (unsigned int x = 0; x < raw.width * 4; x++) {
+            unsigned char maximum = 0;
+            for (const TestImage* source : expected) {
+                unsigned char value = source->raw().data[
+                    (size_t)y * source->width * 4 + x];
+                if (value > maximum)
+                    maximum = value;
+            }
+
+            unsigned char value = raw.data[(size_t)y * raw.stride + x];
+            if (value != maximum)
+                return false;
+        }
+    }
+    return true;
+}
+
+void addFrame(const TestImage& image, uint64_t timestamp, unsigned int size,
+              FrameStack* stack) {
+    Frame frame;
+    memcpy(frame.image.reserve(image.pixels.size()), image.pixels.data(),
+           image.pixels.size());
+    frame.image.setSize(image.pixels.size());
+    frame.image.setInfo(FORMAT_BGRX, image.width, image.height);
+    frame.timestamp = timestamp;
+    CHECK(addToFrameStack(frame, size, stack));
+}
+
+bool stackHas(const FrameStack& stack,
+              std::initializer_list<uint64_t> timestamps) {
+    /*
+        Returns true if the stack has the images with the given timestamps,
+        oldest first
+     */
+
+    if (stack.entries.size() != timestamps.size())
+        return false;
+
+    size_t i = 0;
+    for (uint64_t timestamp : timestamps) {
+        if (stack.entries[i++].timestamp != timestamp)
+            return false;
+    }
+    return true;
+}
+
+void checkMaxPool() {
+    TestImage images[5] = {
+        TestImage(IMAGE_WIDTH + ROW_PADDING, IMAGE_HEIGHT),
+        TestImage(IMAGE_WIDTH + ROW_PADDING, IMAGE_HEIGHT),
+        TestImage(IMAGE_WIDTH + ROW_PADDING, IMAGE_HEIGHT),
+        TestImage(IMAGE_WIDTH + ROW_PADDING, IMAGE_HEIGHT),
+        TestImage(IMAGE_WIDTH + ROW_PADDING, IMAGE_HEIGHT)
+    };
+    for (unsigned int i = 0; i < 5; i++)
+        fillNoise(&images[i], 20 + i);
+
+    const TestImage* a = &images[0];
+    const TestImage* b = &images[1];
+    const TestImage* c = &images[2];
+    const TestImage* d = &images[3];
+    const TestImage* e = &images[4];
+    MaxPool pool;
+
+    // The pool fills up, then the oldest capture is dropped
+    CHECK(poolsTo(*a, 3, &pool, { a }));
+    CHECK(poolsTo(*b, 3, &pool, { a, b }));
+    CHECK(poolsTo(*c, 3, &pool, { a, b, c }));
+    CHECK(poolsTo(*d, 3, &pool, { b, c, d }));
+    CHECK(poolsTo(*e, 3, &pool, { c, d, e }));
+
+    // One frame leaves the capture as it is and empties the pool
+    RawImage raw = getCapture(*a);
+    RawImage original = raw;
+    maxPoolImage(&raw, 1, &pool);
+    CHECK(raw.data == original.data && raw.stride == original.stride);
+    CHECK(poolsTo(*b, 3, &pool, { b }));
+
+    // Another number of frames, a reset or another size starts over
+    CHECK(poolsTo(*c, 2, &pool, { c }));
+    CHECK(poolsTo(*d, 2, &pool, { c, d }));
+    CHECK(poolsTo(*e, 2, &pool, { d, e }));
+
+    resetMaxPool(&pool);
+    CHECK(poolsTo(*a, 2, &pool, { a }));
+
+    TestImage smaller(IMAGE_WIDTH, IMAGE_HEIGHT - 1);
+    fillNoise(&smaller, 30);
+    CHECK(poolsTo(smaller, 2, &pool, { &smaller }));
+
+    // A new stack is filled with the first image
+    FrameStack stack;
+    addFrame(*a, 10, 3, &stack);
+    CHECK(stackHas(stack, { 10, 10, 10 }));
+    CHECK(stack.entries.back().image.size() == a->pixels.size()
+          && memcmp(stack.entries.back().image.data(), a->pixels.data(),
+                    a->pixels.size()) == 0);
+
+    // The buffer of the oldest image is reused for the newest one
+    const char* oldest = stack.entries.front().image.data();
+    addFrame(*b, 20, 3, &stack);
+    CHECK(stackHas(stack, { 10, 10, 20 }));
+    CHECK(stack.entries.back().image.data() == oldest);
+    CHECK(memcmp(oldest, b->pixels.data(), b->pixels.size()) == 0);
+
+    addFrame(*c, 30, 3, &stack);
+    addFrame(*d, 40, 3, &stack);
+    CHECK(stackHas(stack, { 20, 30, 40 }));
+
+    // Another size of stack or of image starts over
+    addFrame(*e, 50, 2, &stack);
+    CHECK(stackHas(stack, { 50, 50 }));
+    addFrame(*a, 60, 2, &stack);
+    addFrame(smaller, 70, 2, &stack);
+    CHECK(stackHas(stack, { 70, 70 }) && stack.height == IMAGE_HEIGHT - 1);
+
+    // Frames without an image are not stacked
+    Frame empty;
+    CHECK(!addToFrameStack(empty, 2, &stack));
+    CHECK(stackHas(stack, { 70, 70 }));
+}
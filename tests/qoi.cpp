@@ -0,0 +1,179 @@
+/*
+    Decodes the output of the QOI encoder with a decoder written from the
+    specification (https://qoiformat.org/qoi-specification.pdf) and
+    compares it with the source image
+*/
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "check.hpp"
+#include "../src/qoi.hpp"
+
+inline uint32_t readBigEndian(const unsigned char* p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+bool decodeQOI(const unsigned char* data, size_t size, unsigned int width,
+               unsigned int height, std::vector<unsigned char>* rgb) {
+    /*
+        Decodes a 3-channel QOI image of the given size into RGB pixels.
+        Returns false if the header, the end marker or the size of the
+        data don't match.
+     */
+
+    const unsigned char end[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    if (size < 14 + 8 || data[0] != 'q' || data[1] != 'o' || data[2] != 'i'
+        || data[3] != 'f' || readBigEndian(data + 4) != width
+        || readBigEndian(data + 8) != height || data[12] != 3
+        || memcmp(data + size - 8, end, 8) != 0) {
+        return false;
+    }
+
+    unsigned char index[64][4] = {};
+    unsigned char px[4] = { 0, 0, 0, 255 };
+    size_t pixels = (size_t)width * height;
+    size_t p = 14;
+    size_t chunksEnd = size - 8;
+    unsigned int run = 0;
+
+    rgb->clear();
+    while (rgb->size() < pixels * 3) {
+        if (run > 0) {
+            run--;
+        } else {
+            if (p >= chunksEnd)
+                return false;
+
+            unsigned char b1 = data[p++];
+            if (b1 == 0xfe) {
+                if (p + 3 > chunksEnd)
+                    return false;
+                px[0] = data[p];
+                px[1] = data[p + 1];
+                px[2] = data[p + 2];
+                p += 3;
+            } else if (b1 == 0xff) {
+                // RGBA is never written for 3 channels
+                return false;
+            } else if ((b1 & 0xc0) == 0x00) {
+                memcpy(px, index[b1], 4);
+            } else if ((b1 & 0xc0) == 0x40) {
+                px[0] += ((b1 >> 4) & 3) - 2;
+                px[1] += ((b1 >> 2) & 3) - 2;
+                px[2] += (b1 & 3) - 2;
+            } else if ((b1 & 0xc0) == 0x80) {
+                if (p >= chunksEnd)
+                    return false;
+                unsigned char b2 = data[p++];
+                int dg = (b1 & 0x3f) - 32;
+                px[0] += dg - 8 + ((b2 >> 4) & 0x0f);
+                px[1] += dg;
+                px[2] += dg - 8 + (b2 & 0x0f);
+            } else {
+                run = b1 & 0x3f;
+            }
+
+            int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+            memcpy(index[hash], px, 4);
+        }
+
+        rgb->insert(rgb->end(), px, px + 3);
+    }
+
+    // All chunks were used
+    return run == 0 && p == chunksEnd;
+}
+
+bool roundTrips(const RawImage& raw) {
+    /*
+        Returns true if the encoded image decodes to the RGB values of the
+        source and fits in getQOIMaxSize
+     */
+
+    size_t maxBytes = getQOIMaxSize(raw.width, raw.height);
+    std::vector<char> encoded(maxBytes);
+    size_t bytes = encodeQOI(raw, encoded.data());
+    if (bytes > maxBytes)
+        return false;
+
+    std::vector<unsigned char> rgb;
+    if (!decodeQOI((const unsigned char*)encoded.data(), bytes, raw.width,
+                   raw.height, &rgb)) {
+        return false;
+    }
+
+    for (unsigned int y = 0; y < raw.height; y++) {
+        for (unsigned int x = 0; x < raw.width; x++) {
+            const unsigned char* bgrx = (const unsigned char*)raw.data
+                                        + (size_t)y * raw.stride + x * 4;
+            const unsigned char* decoded =
+                &rgb[((size_t)y * raw.width + x) * 3];
+
+            if (decoded[0] != bgrx[2] || decoded[1] != bgrx[1]
+                || decoded[2] != bgrx[0]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void checkQOI() {
+    // Every pixel needs a full color, and the X bytes are noise too
+    TestImage noise(97, 31);
+    fillNoise(&noise, 7);
+    CHECK(roundTrips(noise.raw()));
+
+    // Padding at the end of the rows is not part of the image
+    RawImage cropped = noise.raw();
+    cropped.width = 90;
+    CHECK(roundTrips(cropped));
+
+    // Runs longer than one QOI_OP_RUN that continue on the next row,
+    // with X bytes that differ but must not break the runs
+    TestImage flat(200, 9);
+    for (unsigned int y = 0; y < flat.height; y++) {
+        for (unsigned int x = 0; x < flat.width; x++) {
+            unsigned char* p = flat.pixel(x, y);
+            p[0] = 10;
+            p[1] = 20;
+            p[2] = y < 5 ? 30 : 31;
+            p[3] = x;
+        }
+    }
+    CHECK(roundTrips(flat.raw()));
+
+    // Small and larger steps between neighbors, which use the DIFF and
+    // LUMA ops, wrapping around 0 and 255
+    TestImage gradient(256, 6);
+    for (unsigned int y = 0; y < gradient.height; y++) {
+        for (unsigned int x = 0; x < gradient.width; x++) {
+            unsigned char* p = gradient.pixel(x, y);
+            p[0] = x * (y + 1);
+            p[1] = x * y * 3;
+            p[2] = 255 - x;
+            p[3] = 0;
+        }
+    }
+    CHECK(roundTrips(gradient.raw()));
+
+    // A few colors that repeat, which are found in the index
+    TestImage palette(64, 16);
+    const unsigned char colors[4][3] = {
+        { 0, 0, 0 }, { 255, 255, 255 }, { 0, 128, 255 }, { 90, 3, 200 }
+    };
+    for (unsigned int y = 0; y < palette.height; y++) {
+        for (unsigned int x = 0; x < palette.width; x++) {
+            const unsigned char* color = colors[(x * 7 + y * 3) / 5 % 4];
+            memcpy(palette.pixel(x, y), color, 3);
+        }
+    }
+    CHECK(roundTrips(palette.raw()));
+
+    // A single pixel
+    TestImage single(1, 1);
+    fillNoise(&single, 3);
+    CHECK(roundTrips(single.raw()));
+}
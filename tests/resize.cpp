@@ -0,0 +1,105 @@
+/*
+    Compares the scaling filters with reference implementations
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "check.hpp"
+#include "../src/resize.hpp"
+
+std::vector<double> getBoxWeights(unsigned int srcSize, unsigned int dstSize,
+                                  unsigned int i, unsigned int* first) {
+    /*
+        Returns the exact weights of the source pixels covered by output
+        pixel i, starting from the source pixel first
+     */
+
+    double scale = (double)srcSize / dstSize;
+    double start = i * scale;
+    double end = start + scale;
+    *first = (unsigned int)start;
+
+    std::vector<double> weights;
+    for (unsigned int s = *first; s < end && s < srcSize; s++) {
+        double overlap = std::min<double>(s + 1, end) - std::max<double>(s, start);
+        weights.push_back(overlap / scale);
+    }
+    return weights;
+}
+
+int maxAreaError(const TestImage& src, unsigned int width,
+                 unsigned int height) {
+    /*
+        Returns the largest difference between RESIZE_AREA and a box filter
+        computed in floating point
+     */
+
+    std::vector<char> dst((size_t)width * height * 4);
+    resizeImage(src.raw(), width, height, RESIZE_AREA, dst.data());
+
+    int maxError = 0;
+    for (unsigned int y = 0; y < height; y++) {
+        unsigned int firstRow;
+        std::vector<double> rowWeights = getBoxWeights(src.height, height, y,
+                                                       &firstRow);
+
+        for (unsigned int x = 0; x < width; x++) {
+            unsigned int firstColumn;
+            std::vector<double> columnWeights = getBoxWeights(
+                src.width, width, x, &firstColumn);
+
+            for (int c = 0; c < 4; c++) {
+                double sum = 0;
+                for (size_t i = 0; i < rowWeights.size(); i++) {
+                    for (size_t j = 0; j < columnWeights.size(); j++) {
+                        unsigned char value = ((TestImage&)src).pixel(
+                            firstColumn + j, firstRow + i)[c];
+                        sum += value * rowWeights[i] * columnWeights[j];
+                    }
+                }
+
+                unsigned char result = dst[((size_t)y * width + x) * 4 + c];
+                int error = std::abs((int)result - (int)std::lround(sum));
+                maxError = std::max(maxError, error);
+            }
+        }
+    }
+    return maxError;
+}
+
+void checkResize() {
+    // Noise
+    TestImage noise(3840, 2160);
+    fillNoise(&noise, 1);
+    CHECK(maxAreaError(noise, 150, 84) <= 1);
+    CHECK(maxAreaError(noise, 640, 360) <= 1);
+
+    // Large downscales used to overflow the vertical sums
+    TestImage white(64, 2160);
+    for (unsigned int y = 0; y < white.height; y++) {
+        for (unsigned int x = 0; x < white.width; x++) {
+            for (int c = 0; c < 4; c++)
+                white.pixel(x, y)[c] = y % 97 == 0 ? 0 : 255;
+        }
+    }
+    CHECK(maxAreaError(white, 16, 12) <= 1);
+    CHECK(maxAreaError(white, 16, 16) <= 1);
+    CHECK(maxAreaError(white, 16, 84) <= 1);
+
+    TestImage line(1920, 1080);
+    for (unsigned int x = 0; x < line.width; x++) {
+        for (int c = 0; c < 4; c++)
+            line.pixel(x, 0)[c] = 255;
+    }
+    CHECK(maxAreaError(line, 8, 4) <= 1);
+    CHECK(maxAreaError(line, 16, 10) <= 1);
+
+    // Upscaling and flat areas keep their exact color
+    TestImage flat(7, 5);
+    for (char& value : flat.pixels)
+        value = 200;
+    CHECK(maxAreaError(flat, 3, 2) == 0);
+    CHECK(maxAreaError(flat, 20, 11) == 0);
+}
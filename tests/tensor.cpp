@@ -0,0 +1,172 @@
+/*
+    Compares the tensors with a per-value reference of the layouts and the
+    normalization, for sizes that end in every part of the SIMD kernels
+*/
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "check.hpp"
+#include "../src/tensor.hpp"
+
+// Extra pixels at the end of each source row, and the value of the
+// guard bytes after the tensor
+const unsigned int ROW_PADDING = 5;
+const char GUARD = 0x5a;
+const size_t GUARD_BYTES = 64;
+
+float halfToFloat(uint16_t half) {
+    /*
+        Converts an IEEE half precision value to a float
+     */
+
+    int exponent = (half >> 10) & 0x1f;
+    int mantissa = half & 0x3ff;
+    float value;
+
+    if (exponent == 0)
+        value = std::ldexp((float)mantissa, -24);
+    else if (exponent == 31)
+        value = mantissa == 0 ? INFINITY : NAN;
+    else
+        value = std::ldexp((float)(mantissa | 0x400), exponent - 25);
+
+    return half & 0x8000 ? -value : value;
+}
+
+std::vector<double> tensorReference(const RawImage& src,
+                                    const TensorSettings& settings) {
+    /*
+        Makes the values of the tensor one at a time with the formula of
+        messages.proto: (pixel / 255 - mean) / std, or the pixel value
+        for uint8 tensors
+     */
+
+    size_t pixels = (size_t)src.width * src.height;
+    std::vector<double> values(pixels * 3);
+
+    for (unsigned int y = 0; y < src.height; y++) {
+        for (unsigned int x = 0; x < src.width; x++) {
+            const unsigned char* p = (const unsigned char*)src.data
+                                     + (size_t)y * src.stride + x * 4;
+            size_t i = (size_t)y * src.width + x;
+
+            for (int c = 0; c < 3; c++) {
+                // RGB from BGRX
+                double value = p[2 - c];
+                if (settings.type != TENSOR_UINT8)
+                    value = (value / 255 - settings.mean[c]) / settings.std[c];
+
+                if (settings.layout == TENSOR_CHW)
+                    values[c * pixels + i] = value;
+                else
+                    values[i * 3 + c] = value;
+            }
+        }
+    }
+    return values;
+}
+
+bool isClose(double value, double expected, double relative) {
+    return std::fabs(value - expected)
+           <= std::fabs(expected) * relative + 1e-5;
+}
+
+bool convertsLikeReference(const RawImage& src,
+                           const TensorSettings& settings) {
+    /*
+        Returns true if convertToTensor gives the values of the reference,
+        within the precision of the type, and doesn't write past the size
+        given by getTensorSize
+     */
+
+    size_t bytes = getTensorSize(settings.type, src.width, src.height);
+    std::vector<char> dst(bytes + GUARD_BYTES, GUARD);
+    convertToTensor(src, settings, dst.data());
+
+    std::vector<double> expected = tensorReference(src, settings);
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (settings.type == TENSOR_UINT8) {
+            if ((unsigned char)dst[i] != expected[i])
+                return false;
+        } else if (settings.type == TENSOR_FLOAT32) {
+            float value;
+            memcpy(&value, &dst[i * 4], 4);
+            if (!isClose(value, expected[i], 1e-6))
+                return false;
+        } else {
+            // Rounded to the 11 significant bits of a half
+            uint16_t half;
+            memcpy(&half, &dst[i * 2], 2);
+            if (!isClose(halfToFloat(half), expected[i], 1.0 / 2048))
+                return false;
+        }
+    }
+
+    for (size_t i = bytes; i < dst.size(); i++) {
+        if (dst[i] != GUARD)
+            return false;
+    }
+    return true;
+}
+
+void checkTensor() {
+    const TensorLayout layouts[] = { TENSOR_HWC, TENSOR_CHW };
+    const TensorType types[] = {
+        TENSOR_UINT8, TENSOR_FLOAT32, TENSOR_FLOAT16
+    };
+    const unsigned int sizes[][2] = {
+        { 1, 1 }, { 3, 2 }, { 4, 3 }, { 15, 2 }, { 16, 3 }, { 33, 5 },
+        { 67, 4 }
+    };
+
+    // The normalization of ImageNet, and no normalization
+    TensorSettings imageNet;
+    const float mean[3] = { 0.485f, 0.456f, 0.406f };
+    const float std[3] = { 0.229f, 0.224f, 0.225f };
+    for (int c = 0; c < 3; c++) {
+        imageNet.mean[c] = mean[c];
+        imageNet.std[c] = std[c];
+    }
+    const TensorSettings normalizations[] = { imageNet, TensorSettings() };
+
+    for (const unsigned int* size : sizes) {
+        // The padding at the end of the rows is not part of the image
+        TestImage image(size[0] + ROW_PADDING, size[1]);
+        fillNoise(&image, size[0] * 100 + size[1]);
+
+        RawImage raw = image.raw();
+        raw.width = size[0];
+
+        for (TensorSettings settings : normalizations) {
+            settings.enabled = true;
+
+            for (TensorLayout layout : layouts) {
+                for (TensorType type : types) {
+                    settings.layout = layout;
+                    settings.type = type;
+                    CHECK(convertsLikeReference(raw, settings));
+                }
+            }
+        }
+    }
+
+    // Values that land on each side of zero after the normalization,
+    // which the halves have to keep
+    TestImage extremes(24, 2);
+    for (unsigned int y = 0; y < extremes.height; y++) {
+        for (unsigned int x = 0; x < extremes.width; x++) {
+            for (int c = 0; c < 4; c++)
+                extremes.pixel(x, y)[c] = x * 11 + y * 128 + c;
+        }
+    }
+    imageNet.enabled = true;
+    imageNet.type = TENSOR_FLOAT16;
+    CHECK(convertsLikeReference(extremes.raw(), imageNet));
+
+    CHECK(getTensorSize(TENSOR_UINT8, 5, 3) == 45);
+    CHECK(getTensorSize(TENSOR_FLOAT32, 5, 3) == 180);
+    CHECK(getTensorSize(TENSOR_FLOAT16, 5, 3) == 90);
+}
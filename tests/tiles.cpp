@@ -0,0 +1,193 @@
+/*
+    Checks the bitmaps and fingerprints of the tile maps against the
+    changes made to the image, and the mosaics of the changed tiles
+*/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <stdexcept>
+
+#include "check.hpp"
+#include "../src/tiles.hpp"
+
+// Size of the image, whose right and bottom edge tiles are partial
+const unsigned int IMAGE_WIDTH = 70;
+const unsigned int IMAGE_HEIGHT = 40;
+const unsigned int TILE_SIZE = 32;
+
+// Extra pixels at the end of each source row
+const unsigned int ROW_PADDING = 3;
+
+bool isChanged(const TileMap& tiles, unsigned int tile) {
+    return tiles.changed()[tile / 8] >> (tile % 8) & 1;
+}
+
+bool changedTilesAre(const TileMap& tiles,
+                     std::initializer_list<unsigned int> expected) {
+    /*
+        Returns true if exactly the given tiles are marked as changed
+     */
+
+    unsigned int count = tiles.columns() * tiles.rows();
+    if (tiles.changed().size() != (count + 7) / 8
+        || tiles.changed_count() != expected.size()) {
+        return false;
+    }
+
+    for (unsigned int tile = 0; tile < count; tile++) {
+        bool listed = std::find(expected.begin(), expected.end(), tile)
+                      != expected.end();
+        if (isChanged(tiles, tile) != listed)
+            return false;
+    }
+    return true;
+}
+
+bool mosaicMatches(const RawImage& raw, const TileMap& tiles,
+                   const RawImage& packed) {
+    /*
+        Returns true if the mosaic has the changed tiles in the order of the
+        bitmap, with the edge pixels repeated outside the image and the
+        unused tiles at the end cleared
+     */
+
+    unsigned int size = tiles.tile_size();
+    unsigned int count = tiles.changed_count();
+    unsigned int mosaicColumns = std::min(count, tiles.columns());
+    unsigned int mosaicRows = (count + mosaicColumns - 1) / mosaicColumns;
+    if (packed.data == NULL || packed.width != mosaicColumns * size
+        || packed.height != mosaicRows * size
+        || packed.stride != packed.width * 4) {
+        return false;
+    }
+
+    auto pixel = [](const RawImage& image, unsigned int x, unsigned int y) {
+        return image.data + (size_t)y * image.stride + x * 4;
+    };
+
+    unsigned int index = 0;
+    for (unsigned int tile = 0; tile < tiles.columns() * tiles.rows(); tile++) {
+        if (!isChanged(tiles, tile))
+            continue;
+
+        unsigned int left = tile % tiles.columns() * size;
+        unsigned int top = tile / tiles.columns() * size;
+        unsigned int mosaicLeft = index % mosaicColumns * size;
+        unsigned int mosaicTop = index / mosaicColumns * size;
+
+        for (unsigned int y = 0; y < size; y++) {
+            for (unsigned int x = 0; x < size; x++) {
+                unsigned int sourceX = std::min(left + x, raw.width - 1);
+                unsigned int sourceY = std::min(top + y, raw.height - 1);
+                if (memcmp(pixel(packed, mosaicLeft + x, mosaicTop + y),
+                           pixel(raw, sourceX, sourceY), 4) != 0) {
+                    return false;
+                }
+            }
+        }
+        index++;
+    }
+
+    for (; index < mosaicColumns * mosaicRows; index++) {
+        unsigned int mosaicLeft = index % mosaicColumns * size;
+        unsigned int mosaicTop = index / mosaicColumns * size;
+
+        for (unsigned int y = 0; y < size; y++) {
+            for (unsigned int x = 0; x < size * 4; x++) {
+                if (pixel(packed, mosaicLeft, mosaicTop + y)[x] != 0)
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+void checkTiles() {
+    // The padding at the end of the rows is not part of the image
+    TestImage image(IMAGE_WIDTH + ROW_PADDING, IMAGE_HEIGHT);
+    fillNoise(&image, 11);
+
+    RawImage raw = image.raw();
+    raw.width = IMAGE_WIDTH;
+
+    TileHistory history;
+    TileMap tiles;
+    RawImage packed;
+
+    // Without a previous capture every tile changed
+    updateTileMap(raw, TILE_SIZE, &tiles, &history);
+    CHECK(tiles.tile_size() == TILE_SIZE && tiles.columns() == 3
+          && tiles.rows() == 2);
+    CHECK(changedTilesAre(tiles, { 0, 1, 2, 3, 4, 5 }));
+    CHECK(tiles.previous_fingerprint() == 0 && tiles.fingerprint() != 0);
+
+    packChangedTiles(raw, tiles, &packed, &history);
+    CHECK(mosaicMatches(raw, tiles, packed));
+    uint64_t original = tiles.fingerprint();
+
+    // The same capture again, with other X bytes and padding
+    for (unsigned int y = 0; y < image.height; y++) {
+        image.pixel(y, y)[3] ^= 0xff;
+        image.pixel(IMAGE_WIDTH + 1, y)[0] ^= 0xff;
+    }
+    updateTileMap(raw, TILE_SIZE, &tiles, &history);
+    CHECK(changedTilesAre(tiles, {}));
+    CHECK(tiles.fingerprint() == original
+          && tiles.previous_fingerprint() == original);
+
+    packChangedTiles(raw, tiles, &packed, &history);
+    CHECK(packed.data == NULL && packed.width == 0 && packed.height == 0);
+
+    // One pixel in the first tile and one in the partial corner tile
+    image.pixel(31, 31)[0] ^= 1;
+    image.pixel(IMAGE_WIDTH - 1, IMAGE_HEIGHT - 1)[2] ^= 0x80;
+    updateTileMap(raw, TILE_SIZE, &tiles, &history);
+    CHECK(changedTilesAre(tiles, { 0, 5 }));
+    CHECK(tiles.fingerprint() != original
+          && tiles.previous_fingerprint() == original);
+
+    packChangedTiles(raw, tiles, &packed, &history);
+    CHECK(mosaicMatches(raw, tiles, packed));
+    uint64_t changed = tiles.fingerprint();
+
+    // Undoing the changes gives back the fingerprint of the same pixels
+    image.pixel(31, 31)[0] ^= 1;
+    image.pixel(IMAGE_WIDTH - 1, IMAGE_HEIGHT - 1)[2] ^= 0x80;
+    updateTileMap(raw, TILE_SIZE, &tiles, &history);
+    CHECK(changedTilesAre(tiles, { 0, 5 }));
+    CHECK(tiles.fingerprint() == original
+          && tiles.previous_fingerprint() == changed);
+
+    // Four changed tiles leave two unused tiles in the mosaic
+    for (unsigned int tile : { 1, 2, 3, 4 })
+        image.pixel(tile % 3 * TILE_SIZE + 5, tile / 3 * TILE_SIZE + 5)[1]++;
+    updateTileMap(raw, TILE_SIZE, &tiles, &history);
+    CHECK(changedTilesAre(tiles, { 1, 2, 3, 4 }));
+
+    packChangedTiles(raw, tiles, &packed, &history);
+    CHECK(mosaicMatches(raw, tiles, packed));
+
+    // After a reset, or with another tile size, every tile changed
+    resetTileMap(&history);
+    updateTileMap(raw, TILE_SIZE, &tiles, &history);
+    CHECK(changedTilesAre(tiles, { 0, 1, 2, 3, 4, 5 }));
+    CHECK(tiles.previous_fingerprint() == 0);
+
+    updateTileMap(raw, 16, &tiles, &history);
+    CHECK(tiles.columns() == 5 && tiles.rows() == 3
+          && tiles.changed_count() == 15 && tiles.previous_fingerprint() == 0);
+
+    packChangedTiles(raw, tiles, &packed, &history);
+    CHECK(mosaicMatches(raw, tiles, packed));
+
+    // Tiles have to line up with the blocks of jpg images
+    bool rejected = false;
+    try {
+        updateTileMap(raw, 24, &tiles, &history);
+    } catch (std::invalid_argument&) {
+        rejected = true;
+    }
+    CHECK(rejected);
+}